@@ -0,0 +1,145 @@
+/*
+ * Direct C baselines for bench/fiddle_bench.rb.
+ *
+ * Only compiled when the gem is built with FIDDLE_BENCH set in the
+ * environment, see mrbgem.rake.  Every baseline performs in plain C the
+ * operation a benchmark performs through Fiddle, and returns ns/op.
+ */
+#include <stdlib.h>
+#include <string.h>
+#include "../src/fiddle.h"
+#include "../src/profile.h"
+
+extern struct RClass *cFiddle;
+
+typedef double (*bench_d_d)(double);
+typedef double (*bench_d_dd)(double, double);
+typedef double (*bench_d_di)(double, int);
+typedef double (*bench_d_dp)(double, int *);
+
+/* what a CStruct made of an int, a double and a pointer looks like */
+struct bench_struct {
+    int i;
+    double d;
+    void *p;
+};
+
+#define BENCH_QSORT_LEN 64
+
+static volatile double bench_sink_d;
+static volatile long bench_sink_l;
+
+static int
+bench_compare(const void *a, const void *b)
+{
+    int x = *(const int *)a, y = *(const int *)b;
+    return (x > y) - (x < y);
+}
+
+/*
+ * call-seq: Fiddle::Bench.baseline(kind, n, addr = nil) => Float
+ *
+ * Runs the C baseline +kind+ +n+ times and returns ns/op.  The call
+ * baselines ("d_d", "d_dd", "d_di", "d_dp") call the C function at +addr+
+ * through a function pointer of that signature.
+ */
+static mrb_value
+mrb_fiddle_bench_baseline(mrb_state *mrb, mrb_value self)
+{
+    mrb_value vkind, addr = mrb_nil_value();
+    mrb_int n, i;
+    const char *kind;
+    void *fn = NULL;
+    uint64_t t0;
+    double elapsed;
+
+    mrb_get_args(mrb, "Si|o", &vkind, &n, &addr);
+    kind = mrb_string_value_cstr(mrb, &vkind);
+    if (n <= 0) {
+    	mrb_raisef(mrb, E_ARGUMENT_ERROR, "non-positive count %S", mrb_fixnum_value(n));
+    }
+    if (!mrb_nil_p(addr)) {
+    	fn = mrb_fixnum_p(addr) ? (void *)mrb_fixnum(addr) : mrb_cptr(addr);
+    }
+
+    t0 = fiddle_now_ns();
+    if (strcmp(kind, "d_d") == 0 && fn) {
+    	bench_d_d f = (bench_d_d)fn;
+    	for (i = 0; i < n; i++) bench_sink_d = f(0.5);
+    } else if (strcmp(kind, "d_dd") == 0 && fn) {
+    	bench_d_dd f = (bench_d_dd)fn;
+    	for (i = 0; i < n; i++) bench_sink_d = f(0.5, 0.25);
+    } else if (strcmp(kind, "d_di") == 0 && fn) {
+    	bench_d_di f = (bench_d_di)fn;
+    	for (i = 0; i < n; i++) bench_sink_d = f(0.5, 3);
+    } else if (strcmp(kind, "d_dp") == 0 && fn) {
+    	bench_d_dp f = (bench_d_dp)fn;
+    	int e;
+    	for (i = 0; i < n; i++) bench_sink_d = f(0.5, &e);
+    } else if (strcmp(kind, "qsort") == 0) {
+    	int data[BENCH_QSORT_LEN];
+    	for (i = 0; i < n; i++) {
+    	    int j;
+    	    for (j = 0; j < BENCH_QSORT_LEN; j++) data[j] = (j * 37) % BENCH_QSORT_LEN;
+    	    qsort(data, BENCH_QSORT_LEN, sizeof(int), bench_compare);
+    	}
+    	bench_sink_l = data[0];
+    } else if (strcmp(kind, "struct_get") == 0) {
+    	volatile struct bench_struct s = { 1, 2.0, NULL };
+    	for (i = 0; i < n; i++) bench_sink_l = s.i;
+    } else if (strcmp(kind, "struct_set") == 0) {
+    	volatile struct bench_struct s = { 1, 2.0, NULL };
+    	for (i = 0; i < n; i++) s.i = (int)i;
+    	bench_sink_l = s.i;
+    } else if (strcmp(kind, "ptr_get") == 0) {
+    	volatile char buf[16] = "0123456789abcde";
+    	for (i = 0; i < n; i++) bench_sink_l = buf[i & 15];
+    } else if (strcmp(kind, "ptr_to_s") == 0) {
+    	static const char text[] = "fiddle benchmark string";
+    	char copy[sizeof(text)];
+    	for (i = 0; i < n; i++) {
+    	    memcpy(copy, text, strlen(text) + 1);
+    	    bench_sink_l = copy[i % (sizeof(text) - 1)];
+    	}
+    } else if (strcmp(kind, "malloc_free") == 0) {
+    	for (i = 0; i < n; i++) {
+    	    void *p = malloc(64);
+    	    bench_sink_l = (long)(p != NULL);
+    	    free(p);
+    	}
+    } else if (strcmp(kind, "sym") == 0) {
+#if defined(HAVE_DLFCN_H)
+    	void *handle = dlopen(NULL, RTLD_LAZY);
+    	for (i = 0; i < n; i++) bench_sink_l = (long)(dlsym(handle, "strlen") != NULL);
+    	dlclose(handle);
+#else
+    	mrb_raise(mrb, E_NOTIMP_ERROR, "no dlsym baseline on this platform");
+#endif
+    } else {
+    	mrb_raisef(mrb, E_ARGUMENT_ERROR, "unknown baseline %S", vkind);
+    }
+    elapsed = (double)(fiddle_now_ns() - t0);
+
+    return mrb_float_value(mrb, elapsed / (double)n);
+}
+
+/*
+ * call-seq: Fiddle::Bench.now_ns => Integer
+ *
+ * Returns a monotonic clock reading in nanoseconds.
+ */
+static mrb_value
+mrb_fiddle_bench_now_ns(mrb_state *mrb, mrb_value self)
+{
+    return mrb_fixnum_value((mrb_int)fiddle_now_ns());
+}
+
+void
+mrb_fiddle_bench_init(mrb_state *mrb)
+{
+    struct RClass *mBench = mrb_define_module_under(mrb, cFiddle, "Bench");
+
+    mrb_define_module_function(mrb, mBench, "baseline", mrb_fiddle_bench_baseline, MRB_ARGS_ARG(2, 1));
+    mrb_define_module_function(mrb, mBench, "now_ns", mrb_fiddle_bench_now_ns, MRB_ARGS_NONE());
+}
+/* vim: set noet sws=4 sw=4: */
@@ -0,0 +1,48 @@
+# Compares Function#call through the specialized direct callers with the
+# same calls going through ffi_call.
+#
+#   bin/mruby bench/direct_call.rb
+#
+# Needs mruby-time for Time.now.
+
+module DirectCallBench
+  include Fiddle
+
+  N = 200_000
+
+  LIBC = Fiddle.dlopen(nil)
+  LIBM = Fiddle.dlopen("libm.so.6")
+
+  SIGNATURES = [
+    ["double(double)",        LIBM["sin"],     [TYPE_DOUBLE], TYPE_DOUBLE, [0.5]],
+    ["double(double,double)", LIBM["atan2"],   [TYPE_DOUBLE, TYPE_DOUBLE], TYPE_DOUBLE, [0.5, 0.25]],
+    ["int(void*)",            LIBC["atoi"],    [TYPE_VOIDP], TYPE_INT, ["42"]],
+    ["void*(void*,void*)",    LIBC["strstr"],  [TYPE_VOIDP, TYPE_VOIDP], TYPE_VOIDP, ["haystack", "st"]],
+    ["void(void)",            LIBC["endgrent"], [], TYPE_VOID, []],
+  ]
+
+  def self.measure(f, args)
+    i = 0
+    t = Time.now
+    while i < N
+      f.call(*args)
+      i += 1
+    end
+    (Time.now - t) * 1_000_000_000 / N
+  end
+
+  def self.run
+    SIGNATURES.each do |name, addr, types, ret, args|
+      f = Function.new(addr, types, ret)
+      f.capture_errno = false
+      f.direct_call = false
+      ffi = measure(f, args)
+      f.direct_call = true
+      direct = measure(f, args)
+      puts "%-24s ffi_call %8.1f ns/op  direct %8.1f ns/op  x%.2f" %
+        [name, ffi, direct, ffi / direct]
+    end
+  end
+end
+
+DirectCallBench.run
@@ -0,0 +1,146 @@
+# Microbenchmarks of the FFI call, closure and memory paths, each set
+# against a plain C baseline.  Prints a JSON array with one object per
+# benchmark:
+#
+#   {"name": "...", "ns_per_op": 41.2, "baseline_ns_per_op": 6.3, "ratio": 6.54}
+#
+# Fiddle::Bench is only compiled in when the gem is built with FIDDLE_BENCH
+# set:
+#
+#   FIDDLE_BENCH=1 rake
+#   bin/mruby path/to/mruby-fiddle/bench/fiddle_bench.rb [iterations]
+
+module FiddleBench
+  include Fiddle
+
+  N = (ARGV[0] || 100_000).to_i
+
+  LIBC = Fiddle.dlopen(nil)
+  LIBM = Fiddle.dlopen("libm.so.6")
+
+  # the signatures of example/libm.rb
+  LIBM_SIGNATURES = [
+    "double acos(double)", "double acosh(double)", "double asin(double)",
+    "double asinh(double)", "double atan(double)", "double atan2(double, double)",
+    "double cbrt(double)", "double cos(double)", "double cosh(double)",
+    "double erf(double)", "double erfc(double)", "double exp(double)",
+    "double frexp(double, int *)", "double hypot(double, double)",
+    "double ldexp(double, int)", "double log(double)", "double log2(double)",
+    "double log10(double)", "double sin(double)", "double sinh(double)",
+    "double sqrt(double)", "double tan(double)", "double tanh(double)",
+  ]
+
+  # sample arguments and baseline kind by argument types
+  SHAPES = {
+    [TYPE_DOUBLE]              => ["d_d",  [0.5]],
+    [TYPE_DOUBLE, TYPE_DOUBLE] => ["d_dd", [0.5, 0.25]],
+    [TYPE_DOUBLE, TYPE_INT]    => ["d_di", [0.5, 3]],
+    [TYPE_DOUBLE, TYPE_VOIDP]  => ["d_dp", [0.5, Pointer.malloc(SIZEOF_INT)]],
+  }
+
+  QSORT_LEN = 64
+
+  extend Fiddle::Importer
+  Sample = struct ["int i", "double d", "void *p"]
+
+  @results = []
+
+  def self.time(n = N)
+    i = 0
+    t = Bench.now_ns
+    while i < n
+      yield
+      i += 1
+    end
+    (Bench.now_ns - t).to_f / n
+  end
+
+  def self.report(name, ns, baseline)
+    @results << [name, ns, baseline]
+  end
+
+  def self.bench_calls
+    parser = Object.new
+    parser.extend(CParser)
+    LIBM_SIGNATURES.each do |signature|
+      name, ret, args = parser.parse_signature(signature)
+      kind, values = SHAPES[args]
+      addr = LIBM[name]
+      f = Function.new(addr, args, ret, Function::DEFAULT, name)
+      f.capture_errno = false
+      report("call #{signature}", time { f.call(*values) }, Bench.baseline(kind, N, addr))
+    end
+  end
+
+  def self.fill(buf)
+    j = 0
+    while j < QSORT_LEN
+      buf[j * SIZEOF_INT] = (j * 37) % QSORT_LEN
+      j += 1
+    end
+  end
+
+  def self.bench_qsort
+    # values stay below 128, so their first byte is enough to compare them
+    cmp = Closure::BlockCaller.new(TYPE_INT, [TYPE_VOIDP, TYPE_VOIDP]) do |a, b|
+      a[0] <=> b[0]
+    end
+    # size_t is unsigned long on the LP64 targets this runs on
+    qsort = Function.new(LIBC["qsort"], [TYPE_VOIDP, -TYPE_LONG, -TYPE_LONG, TYPE_VOIDP], TYPE_VOID)
+    buf = Pointer.malloc(SIZEOF_INT * QSORT_LEN)
+    n = N / 100 + 1
+    ns = time(n) do
+      fill(buf)
+      qsort.call(buf, QSORT_LEN, SIZEOF_INT, cmp)
+    end
+    report("qsort #{QSORT_LEN} ints through a Closure", ns, Bench.baseline("qsort", n))
+  end
+
+  def self.bench_struct
+    s = Sample.malloc
+    e = s.to_ptr
+    report("CStructEntity#[]", time { e["i"] }, Bench.baseline("struct_get", N))
+    report("CStructEntity#[]=", time { e["i"] = 1 }, Bench.baseline("struct_set", N))
+    s.destroy
+  end
+
+  def self.bench_pointer
+    text = "fiddle benchmark string"
+    ptr = Pointer.malloc(text.size + 1)
+    ptr[0, text.size] = text
+    report("Pointer#[]", time { ptr[3] }, Bench.baseline("ptr_get", N))
+    report("Pointer#to_s", time { ptr.to_s }, Bench.baseline("ptr_to_s", N))
+  end
+
+  def self.bench_memory
+    report("Fiddle.malloc/free", time { Fiddle.free(Fiddle.malloc(64)) }, Bench.baseline("malloc_free", N))
+  end
+
+  def self.bench_sym
+    report("Handle#sym", time { LIBC.sym("strlen") }, Bench.baseline("sym", N))
+  end
+
+  def self.json_number(x)
+    "%.2f" % x
+  end
+
+  def self.to_json
+    rows = @results.map do |name, ns, baseline|
+      "  {\"name\": \"#{name}\", \"ns_per_op\": #{json_number(ns)}, " +
+        "\"baseline_ns_per_op\": #{json_number(baseline)}, \"ratio\": #{json_number(ns / baseline)}}"
+    end
+    "[\n" + rows.join(",\n") + "\n]"
+  end
+
+  def self.run
+    bench_calls
+    bench_qsort
+    bench_struct
+    bench_pointer
+    bench_memory
+    bench_sym
+    puts to_json
+  end
+end
+
+FiddleBench.run
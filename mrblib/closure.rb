@@ -7,6 +7,9 @@ module Fiddle
     # arguments of the FFI closure
     attr_reader :args
 
+    # result of calls queued from other threads, see foreign_calls=
+    attr_reader :foreign_default
+
     # Extends Fiddle::Closure to allow for building the closure in a block
     class BlockCaller < Fiddle::Closure
 
@@ -38,6 +41,9 @@ module Fiddle
 
       # Calls the constructed BlockCaller, with +args+
       #
+      # Callbacks from C skip this method and yield to the block directly,
+      # unless a subclass overrides it.
+      #
       # For an example see Fiddle::Closure::BlockCaller.new
       #
       def call *args
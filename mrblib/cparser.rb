@@ -68,11 +68,17 @@ module Fiddle
     #   parse_signature('double sum(double, double)')
     #     #=> ["sum", Fiddle::TYPE_DOUBLE, [Fiddle::TYPE_DOUBLE, Fiddle::TYPE_DOUBLE]]
     #
+    #   parse_signature('int printf(const char *, ...)')
+    #     #=> ["printf", Fiddle::TYPE_INT, [Fiddle::TYPE_CONST_STRING, Fiddle::TYPE_VARIADIC]]
+    #
+    #   parse_signature('double frexp(double, out int *)')
+    #     #=> ["frexp", Fiddle::TYPE_DOUBLE, [Fiddle::TYPE_DOUBLE, Fiddle::TYPE_OUT + Fiddle::TYPE_INT]]
+    #
     def parse_signature(signature, tymap=nil)
       tymap ||= {}
       signature = signature.gsub(/\s+/, " ").strip
       case signature
-      when /^([\w@\*\s]+)\(([\w\*\s\,\[\]]*)\)$/
+      when /^([\w@\*\s]+)\(([\w\*\s\,\[\]\.]*)\)$/
         ret = $1
         (args = $2).strip!
         ret = ret.split(/\s+/)
@@ -83,7 +89,13 @@ module Fiddle
           ret.push("*")
         end
         ret  = ret.join(" ")
-        return [func, parse_ctype(ret, tymap), args.collect{|arg| parse_ctype(arg, tymap)}]
+        # const char * arguments take Strings without a copy; results
+        # stay Pointers, and so do the arguments of callbacks made by
+        # Importer#bind
+        args = args.collect{|arg|
+          arg =~ /^const char ?\* ?\w*$/ ? TYPE_CONST_STRING : parse_ctype(arg, tymap)
+        }
+        return [func, parse_ctype(ret, tymap), args]
       else
         raise(RuntimeError,"can't parse the function prototype: #{signature}")
       end
@@ -150,6 +162,12 @@ module Fiddle
         return TYPE_FLOAT
       when "double"
         return TYPE_DOUBLE
+      when "..."
+        return TYPE_VARIADIC
+      when /^(out|inout)\s+(.+?)\s*\*$/
+        flag = $1 == "out" ? TYPE_OUT : TYPE_INOUT
+        type = parse_ctype($2, tymap)
+        return type < 0 ? -(flag - type) : flag + type
       when "size_t"
         return TYPE_SIZE_T
       when "ssize_t"
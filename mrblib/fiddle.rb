@@ -1,32 +1,4 @@
 module Fiddle
-  if WINDOWS
-    # Returns the last win32 +Error+ of the current executing +Thread+ or nil
-    # if none
-    def self.win32_last_error
-      #Thread.current[:__FIDDLE_WIN32_LAST_ERROR__]
-      @error
-    end
-
-    # Sets the last win32 +Error+ of the current executing +Thread+ to +error+
-    def self.win32_last_error= error
-      #Thread.current[:__FIDDLE_WIN32_LAST_ERROR__] = error
-      @error = error
-    end
-  end
-
-  # Returns the last +Error+ of the current executing +Thread+ or nil if none
-  def self.last_error
-    #Thread.current[:__FIDDLE_LAST_ERROR__]
-    @error
-  end
-
-  # Sets the last +Error+ of the current executing +Thread+ to +error+
-  def self.last_error= error
-    #Thread.current[:__DL2_LAST_ERROR__] = error
-    #Thread.current[:__FIDDLE_LAST_ERROR__] = error
-    @error = error
-  end
-
   # call-seq: dlopen(library) => Fiddle::Handle
   #
   # Creates a new handler that opens +library+, and returns an instance of
@@ -156,10 +156,14 @@ module Fiddle
     # :startdoc:
 
     # Creates a global method from the given C +signature+.
+    #
+    # Pass +:noerrno+ in +opts+ for functions that do not report errors
+    # through errno, so their calls skip saving it into Fiddle.last_error.
     def extern(signature, *opts)
       symname, ctype, argtype = parse_signature(signature, @type_alias)
       opt = parse_bind_options(opts)
       f = import_function(symname, ctype, argtype, opt[:call_type])
+      f.capture_errno = false if opt[:noerrno]
       name = symname.gsub(/@.+/,'')
       @func_map[name] = f
       define_method(name){|*args,&block| f.call(*args,&block)}
@@ -279,9 +283,11 @@ module Fiddle
     # See Fiddle::Closure
     def bind_function(name, ctype, argtype, call_type = nil, &block)
       abi = CALL_TYPE_TO_ABI[call_type]
+      # the block still gets const char * arguments as Pointers
+      closure_args = argtype.collect{|ty| ty == TYPE_CONST_STRING ? TYPE_VOIDP : ty}
       closure = Class.new(Fiddle::Closure) {
         define_method(:call, &block)
-      }.new(ctype, argtype, abi)
+      }.new(ctype, closure_args, abi)
 
       Function.new(closure, argtype, ctype, abi, name)
     end
@@ -47,6 +47,19 @@ module Fiddle
       SIZE_MAP[TYPE_LONG_LONG] = SIZE_MAP[-TYPE_LONG_LONG] = SIZEOF_LONG_LONG
     end
 
+    # Fiddle::Pointer methods reading and writing a value of each type in
+    # place, as [getter, setter].
+    ACCESSOR_MAP = {
+      TYPE_VOIDP => [:get_ptr, :put_ptr],
+      TYPE_FLOAT => [:get_f32, :put_f32],
+      TYPE_DOUBLE => [:get_f64, :put_f64],
+    }
+    SIZE_MAP.each do |type, size|
+      next if ACCESSOR_MAP.key?(type)
+      name = "#{type < 0 ? 'u' : 'i'}#{size * 8}"
+      ACCESSOR_MAP[type] = ["get_#{name}".to_sym, "put_#{name}".to_sym]
+    end
+
     def align(addr, align)
       d = addr % align
       if( d == 0 )
@@ -43,6 +43,15 @@ module Fiddle
     #
     #   obj = MyStruct.allocate
     #
+    # Classes built from Fiddle::CStruct can also be given to
+    # Fiddle::Function and Fiddle::Closure as argument and return types to
+    # pass the struct by value:
+    #
+    #   Rect = Fiddle::CStructBuilder.create(Fiddle::CStruct,
+    #     [Fiddle::TYPE_INT] * 4, %w(x y w h))
+    #   area = Fiddle::Function.new(lib['rect_area'], [Rect], Fiddle::TYPE_INT)
+    #   area.call(Rect.malloc(0, 0, 4, 3)) #=> 12
+    #
     def create(klass, types, members)
       size = klass.entity_class.size(types)
       new_class = Class.new(klass){
@@ -63,8 +72,13 @@ module Fiddle
           end
           s
         }
-        define_method(:initialize){|addr|
-          @entity = klass.entity_class.new(addr, types)
+        if klass.ancestors.include?(CStruct)
+          # The libffi layout used to pass and return the struct by value,
+          # built on first use.
+          define_singleton_method(:ffi_type) { @ffi_type ||= StructType.new(types) }
+        end
+        define_method(:initialize){|addr, func = nil|
+          @entity = klass.entity_class.new(addr, types, func)
           @entity.assign_names(members)
         }
         define_method(:destroy) {
@@ -173,6 +187,9 @@ module Fiddle
         raise(ArgumentError, "no such member: #{name}")
       end
       ty = @ctypes[idx]
+      if( accessor = ACCESSOR_MAP[ty] )
+        return __send__(accessor[0], @offset[idx])
+      end
       if( ty.is_a?(Array) )
         r = super(@offset[idx], SIZE_MAP[ty[0]] * ty[1])
       else
@@ -212,8 +229,12 @@ module Fiddle
       end
       ty  = @ctypes[idx]
 
-      packer = Packer.new([ty])
       val = wrap_arg(val, ty, [])
+      if( accessor = ACCESSOR_MAP[ty] )
+        __send__(accessor[1], @offset[idx], val)
+        return ty < 0 ? unsigned_value(val, ty) : val
+      end
+      packer = Packer.new([ty])
       buff = packer.pack([val].flatten())
       super(@offset[idx], buff.size, buff)
       if( ty.is_a?(Integer) && (ty < 0) )
@@ -0,0 +1,397 @@
+#include <stdlib.h>
+#include "fiddle.h"
+#include "async.h"
+#include "struct.h"
+
+#if defined(FIDDLE_ASYNC)
+
+#include <pthread.h>
+#include <unistd.h>
+#include <fcntl.h>
+#if defined(__linux__)
+#include <sys/eventfd.h>
+#endif
+
+struct RClass *cFuture;
+
+extern struct RClass *cFiddle;
+
+/*
+ * Asynchronous calls.
+ *
+ * Function#call_async converts its arguments on the mruby thread into a
+ * fiddle_async_call and queues it to a pool of worker threads, which
+ * only run ffi_call and never touch the mrb_state.  The returned
+ * Fiddle::Future keeps the Function and the argument objects alive;
+ * until the call completes the Future itself is kept in a registry so
+ * that the GC can't free any of them while a worker reads them.
+ *
+ * Every completion is signalled on one eventfd per pool (a pipe where
+ * eventfd is not available), see Fiddle::Future.fileno.
+ */
+typedef struct fiddle_async_call {
+    struct fiddle_async_call *next;         /* queue link */
+    fiddle_function *fn;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    int done;
+    int err;                                /* errno after the call */
+    fiddle_generic *args;
+    void **values;
+    void *ret;                              /* at least a fiddle_generic */
+} fiddle_async_call;
+
+typedef struct fiddle_pool {
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    fiddle_async_call *head, *tail;
+    int stopping;
+    int nthreads;
+    pthread_t threads[FIDDLE_ASYNC_WORKERS];
+    int notify_fd;                          /* read by the event loop */
+    int signal_fd;                          /* written by the workers */
+    mrb_int prune_at;                       /* registry size of the next prune */
+} fiddle_pool;
+
+static void
+fiddle_async_call_free(mrb_state *mrb, void *p)
+{
+    fiddle_async_call *call = p;
+
+    if (!call) return;
+    /* wait for a worker still leaving the completion section */
+    pthread_mutex_lock(&call->lock);
+    pthread_mutex_unlock(&call->lock);
+    pthread_mutex_destroy(&call->lock);
+    pthread_cond_destroy(&call->cond);
+    mrb_free(mrb, call);
+}
+
+static const struct mrb_data_type future_data_type = {
+    "fiddle/future",
+    fiddle_async_call_free,
+};
+
+static void
+fiddle_pool_notify(fiddle_pool *pool)
+{
+#if defined(__linux__)
+    uint64_t one = 1;
+    ssize_t r = write(pool->signal_fd, &one, sizeof(one));
+#else
+    char one = 1;
+    ssize_t r = write(pool->signal_fd, &one, 1);
+#endif
+    (void)r;
+}
+
+static void *
+fiddle_pool_worker(void *arg)
+{
+    fiddle_pool *pool = arg;
+
+    for (;;) {
+    	fiddle_async_call *call;
+
+    	pthread_mutex_lock(&pool->lock);
+    	while (!pool->head && !pool->stopping) {
+    	    pthread_cond_wait(&pool->cond, &pool->lock);
+    	}
+    	call = pool->head;
+    	if (!call) {
+    	    pthread_mutex_unlock(&pool->lock);
+    	    return NULL;
+    	}
+    	pool->head = call->next;
+    	if (!pool->head) pool->tail = NULL;
+    	pthread_mutex_unlock(&pool->lock);
+
+    	ffi_call(&call->fn->cif, FFI_FN(call->fn->fn), call->ret, call->values);
+
+    	pthread_mutex_lock(&call->lock);
+    	call->err = errno;
+    	call->done = 1;
+    	pthread_cond_broadcast(&call->cond);
+    	pthread_mutex_unlock(&call->lock);
+    	fiddle_pool_notify(pool);
+    }
+}
+
+static fiddle_pool *
+fiddle_pool_get(mrb_state *mrb)
+{
+    fiddle_state *state = mrb_fiddle_state(mrb);
+    fiddle_pool *pool = state->pool;
+    int fds[2], i;
+
+    if (pool) return pool;
+
+#if defined(__linux__)
+    fds[0] = fds[1] = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    if (fds[0] < 0) mrb_sys_fail(mrb, "eventfd");
+#else
+    if (pipe(fds) != 0) mrb_sys_fail(mrb, "pipe");
+    fcntl(fds[0], F_SETFL, O_NONBLOCK);
+    fcntl(fds[1], F_SETFL, O_NONBLOCK);
+#endif
+
+    pool = mrb_calloc(mrb, 1, sizeof(fiddle_pool));
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->cond, NULL);
+    pool->notify_fd = fds[0];
+    pool->signal_fd = fds[1];
+    for (i = 0; i < FIDDLE_ASYNC_WORKERS; i++) {
+    	if (pthread_create(&pool->threads[i], NULL, fiddle_pool_worker, pool) != 0) break;
+    	pool->nthreads++;
+    }
+    state->pool = pool;
+    if (pool->nthreads == 0) {
+    	fiddle_pool_free(mrb, state);
+    	mrb_raise(mrb, E_RUNTIME_ERROR, "can't start call_async worker threads");
+    }
+    return pool;
+}
+
+/* Lets the workers finish the queued calls and joins them. */
+void
+fiddle_pool_free(mrb_state *mrb, fiddle_state *state)
+{
+    fiddle_pool *pool = state->pool;
+    int i;
+
+    if (!pool) return;
+    pthread_mutex_lock(&pool->lock);
+    pool->stopping = 1;
+    pthread_cond_broadcast(&pool->cond);
+    pthread_mutex_unlock(&pool->lock);
+    for (i = 0; i < pool->nthreads; i++) {
+    	pthread_join(pool->threads[i], NULL);
+    }
+    pthread_mutex_destroy(&pool->lock);
+    pthread_cond_destroy(&pool->cond);
+    close(pool->notify_fd);
+    if (pool->signal_fd != pool->notify_fd) close(pool->signal_fd);
+    mrb_free(mrb, pool);
+    state->pool = NULL;
+}
+
+static int
+fiddle_async_done_p(fiddle_async_call *call)
+{
+    int done;
+
+    pthread_mutex_lock(&call->lock);
+    done = call->done;
+    pthread_mutex_unlock(&call->lock);
+    return done;
+}
+
+/* The registry of Futures whose call may still be running. */
+static mrb_value
+fiddle_inflight(mrb_state *mrb)
+{
+    mrb_sym sym = mrb_intern_lit(mrb, "__inflight__");
+    mrb_value inflight = mrb_iv_get(mrb, mrb_obj_value(cFuture), sym);
+
+    if (mrb_nil_p(inflight)) {
+    	inflight = mrb_ary_new(mrb);
+    	mrb_iv_set(mrb, mrb_obj_value(cFuture), sym, inflight);
+    }
+    return inflight;
+}
+
+/*
+ * Drops the completed Futures from the registry, so the GC may collect
+ * them.  The registry is only scanned once it has doubled since the last
+ * prune, which keeps a submit O(1) amortized however many calls are
+ * outstanding.
+ */
+static void
+fiddle_inflight_prune(mrb_state *mrb, fiddle_pool *pool, mrb_value inflight)
+{
+    mrb_int i, kept = 0, len = mrb_ary_len(mrb, inflight);
+
+    if (len < pool->prune_at) return;
+    for (i = 0; i < len; i++) {
+    	mrb_value future = mrb_ary_entry(inflight, i);
+
+    	if (!fiddle_async_done_p((fiddle_async_call *)DATA_PTR(future))) {
+    	    mrb_ary_set(mrb, inflight, kept++, future);
+    	}
+    }
+    for (i = kept; i < len; i++) {
+    	mrb_ary_pop(mrb, inflight);
+    }
+    pool->prune_at = kept * 2 > FIDDLE_ASYNC_PRUNE ? kept * 2 : FIDDLE_ASYNC_PRUNE;
+}
+
+/*
+ * Builds an unsubmitted Future for a call of +fn+ and returns the
+ * argument storage the caller converts the arguments into.
+ */
+mrb_value
+mrb_fiddle_future_new(mrb_state *mrb, mrb_value function, fiddle_function *fn,
+    fiddle_generic **args, void ***values)
+{
+    fiddle_async_call *call;
+    struct RData *data;
+    mrb_value future;
+    size_t ret_size = fn->ret_size > sizeof(fiddle_generic) ? fn->ret_size : sizeof(fiddle_generic);
+    mrb_int i;
+
+    data = mrb_data_object_alloc(mrb, cFuture, NULL, &future_data_type);
+    future = mrb_obj_value(data);
+
+    /* args, return value and values share one block, all fiddle_generic aligned */
+    call = mrb_calloc(mrb, 1, sizeof(fiddle_async_call)
+    	+ sizeof(fiddle_generic) * fn->argc
+    	+ (ret_size + sizeof(fiddle_generic) - 1) / sizeof(fiddle_generic) * sizeof(fiddle_generic)
+    	+ sizeof(void *) * (fn->argc + 1));
+    pthread_mutex_init(&call->lock, NULL);
+    pthread_cond_init(&call->cond, NULL);
+    call->fn = fn;
+    call->args = (fiddle_generic *)(call + 1);
+    call->ret = call->args + fn->argc;
+    call->values = (void **)((char *)call->ret
+    	+ (ret_size + sizeof(fiddle_generic) - 1) / sizeof(fiddle_generic) * sizeof(fiddle_generic));
+    for (i = 0; i < fn->argc; i++) {
+    	call->values[i] = &call->args[i];
+    }
+    call->values[fn->argc] = NULL;
+    DATA_PTR(future) = call;
+
+    mrb_iv_set(mrb, future, mrb_intern_lit(mrb, "@function"), function);
+    *args = call->args;
+    *values = call->values;
+    return future;
+}
+
+/* Queues the call of +future+; +pins+ stay referenced until it is done. */
+void
+mrb_fiddle_future_submit(mrb_state *mrb, mrb_value future, mrb_value pins)
+{
+    fiddle_async_call *call = DATA_PTR(future);
+    fiddle_pool *pool = fiddle_pool_get(mrb);
+    mrb_value inflight = fiddle_inflight(mrb);
+
+    mrb_iv_set(mrb, future, mrb_intern_lit(mrb, "@pins"), pins);
+    fiddle_inflight_prune(mrb, pool, inflight);
+    mrb_ary_push(mrb, inflight, future);
+
+    pthread_mutex_lock(&pool->lock);
+    if (pool->tail) pool->tail->next = call;
+    else pool->head = call;
+    pool->tail = call;
+    pthread_cond_signal(&pool->cond);
+    pthread_mutex_unlock(&pool->lock);
+}
+
+/*
+ * call-seq: done? => true or false
+ *
+ * Returns true once the C function has returned.
+ */
+static mrb_value
+mrb_fiddle_future_done_p(mrb_state *mrb, mrb_value self)
+{
+    fiddle_async_call *call;
+
+    Data_Get_Struct(mrb, self, &future_data_type, call);
+    return mrb_bool_value(fiddle_async_done_p(call));
+}
+
+/*
+ * call-seq: wait => self
+ *
+ * Blocks until the C function has returned.
+ */
+static mrb_value
+mrb_fiddle_future_wait(mrb_state *mrb, mrb_value self)
+{
+    fiddle_async_call *call;
+
+    Data_Get_Struct(mrb, self, &future_data_type, call);
+    pthread_mutex_lock(&call->lock);
+    while (!call->done) {
+    	pthread_cond_wait(&call->cond, &call->lock);
+    }
+    pthread_mutex_unlock(&call->lock);
+    return self;
+}
+
+/*
+ * call-seq: value => result
+ *
+ * Waits for the call and returns its result converted like
+ * Function#call would.  Fiddle.last_error is set from the errno of the
+ * worker thread.
+ */
+static mrb_value
+mrb_fiddle_future_value(mrb_state *mrb, mrb_value self)
+{
+    fiddle_async_call *call;
+    fiddle_function *fn;
+
+    mrb_fiddle_future_wait(mrb, self);
+    Data_Get_Struct(mrb, self, &future_data_type, call);
+    fn = call->fn;
+
+    fiddle_capture_errno(fn, call->err);
+    if (fn->ret_type == TYPE_STRUCT) {
+    	void *mem = malloc(fn->ret_size);
+
+    	if (!mem) mrb_raise(mrb, E_RUNTIME_ERROR, "out of memory for the struct result");
+    	memcpy(mem, call->ret, fn->ret_size);
+    	return mrb_fiddle_struct_new(mrb,
+    	    mrb_iv_get(mrb, mrb_iv_get(mrb, self, mrb_intern_lit(mrb, "@function")),
+    		mrb_intern_lit(mrb, "@return_type")), mem);
+    }
+    return fn->ret_converter(mrb, *(fiddle_generic *)call->ret);
+}
+
+/*
+ * call-seq: Fiddle::Future.fileno => Integer
+ *
+ * Returns a descriptor that becomes readable whenever a call_async call
+ * completes, for event loops to wait on.  Reading it resets it; then
+ * check Future#done? of the outstanding Futures.
+ */
+static mrb_value
+mrb_fiddle_future_s_fileno(mrb_state *mrb, mrb_value klass)
+{
+    return mrb_fixnum_value(fiddle_pool_get(mrb)->notify_fd);
+}
+
+void
+mrb_fiddle_future_init(mrb_state *mrb)
+{
+    /*
+     * Document-class: Fiddle::Future
+     *
+     * The pending result of Function#call_async.
+     *
+     *   decode = Fiddle::Function.new(lib['decode'], [TYPE_VOIDP, TYPE_INT], TYPE_INT)
+     *   f = decode.call_async(buf, buf.size)
+     *   do_something_else until f.done?
+     *   f.value
+     */
+    cFuture = mrb_define_class_under(mrb, cFiddle, "Future", mrb->object_class);
+    MRB_SET_INSTANCE_TT(cFuture, MRB_TT_DATA);
+    mrb_undef_class_method(mrb, cFuture, "new");
+
+    mrb_define_method(mrb, cFuture, "done?", mrb_fiddle_future_done_p, MRB_ARGS_NONE());
+    mrb_define_method(mrb, cFuture, "wait", mrb_fiddle_future_wait, MRB_ARGS_NONE());
+    mrb_define_method(mrb, cFuture, "join", mrb_fiddle_future_wait, MRB_ARGS_NONE());
+    mrb_define_method(mrb, cFuture, "value", mrb_fiddle_future_value, MRB_ARGS_NONE());
+    mrb_define_class_method(mrb, cFuture, "fileno", mrb_fiddle_future_s_fileno, MRB_ARGS_NONE());
+}
+
+#else
+
+void
+mrb_fiddle_future_init(mrb_state *mrb)
+{
+}
+
+#endif
+/* vim: set noet sws=4 sw=4: */
@@ -0,0 +1,13 @@
+#ifndef FIDDLE_ASYNC_H
+#define FIDDLE_ASYNC_H
+
+#include "function.h"
+
+#if defined(FIDDLE_ASYNC)
+mrb_value mrb_fiddle_future_new(mrb_state *mrb, mrb_value function, fiddle_function *fn,
+    fiddle_generic **args, void ***values);
+void mrb_fiddle_future_submit(mrb_state *mrb, mrb_value future, mrb_value pins);
+void fiddle_pool_free(mrb_state *mrb, fiddle_state *state);
+#endif
+
+#endif
@@ -1,18 +1,53 @@
+#include <stdlib.h>
+#include <stdint.h>
 #include "fiddle.h"
 #include "conversions.h"
+#include "pointer.h"
+#include "struct.h"
+#include "trampoline.h"
+#include <mruby/error.h>
+#include <mruby/version.h>
+
+#if defined(FIDDLE_ASYNC)
+#include <pthread.h>
+#endif
 
 struct RClass *cClosure;
 
 extern struct RClass *cFiddle;
-extern struct RClass *cPointer;
+
+#ifndef FIDDLE_CLOSURE_STACK_ARGS
+#define FIDDLE_CLOSURE_STACK_ARGS 8
+#endif
+
+typedef mrb_value (*fiddle_closure_decoder)(mrb_state *mrb, const void *arg);
+
+/* Closure#foreign_calls */
+#define FIDDLE_FOREIGN_DIRECT 0     /* enter the mrb_state from any thread */
+#define FIDDLE_FOREIGN_QUEUE  1     /* queue the call, return foreign_default */
+#define FIDDLE_FOREIGN_WAIT   2     /* queue the call and wait for its result */
+
+struct fiddle_closure_batch;
 
 typedef struct {
     mrb_state *mrb;
-    void * code;
-    ffi_closure *pcl;
+    fiddle_state *state;                /* for Closure.gc_step_interval */
+    fiddle_trampoline *tramp;
     ffi_cif cif;
     int argc;
     ffi_type **argv;
+    int ret_type;                       /* TYPE_* code of the result */
+    fiddle_closure_decoder *decoders;   /* C -> mruby, NULL for a struct */
+    int call_argc;                      /* arguments of #call, 0 for (void) */
+    mrb_sym call;                       /* the method run by callbacks */
+    mrb_value block;                    /* yielded to instead, see closure_block_target */
+    int foreign;                        /* FIDDLE_FOREIGN_* for calls from other threads */
+    void *foreign_default;              /* result of queued calls */
+#if defined(FIDDLE_ASYNC)
+    pthread_t owner;                    /* the thread running the mrb_state */
+    struct fiddle_callq *callq;
+#endif
+    struct fiddle_closure_batch *batch; /* set by Closure#batch */
 } fiddle_closure;
 
 typedef struct {
@@ -20,26 +55,40 @@ typedef struct {
     mrb_value *obj;
 } closure_context;
 
-#if defined(USE_FFI_CLOSURE_ALLOC)
-#elif defined(__OpenBSD__) || defined(__APPLE__) || defined(__linux__)
-# define USE_FFI_CLOSURE_ALLOC 0
-#elif defined(RUBY_LIBFFI_MODVERSION) && RUBY_LIBFFI_MODVERSION < 3000005 && \
-	(defined(__i386__) || defined(__x86_64__) || defined(_M_IX86) || defined(_M_AMD64))
-# define USE_FFI_CLOSURE_ALLOC 0
-#else
-# define USE_FFI_CLOSURE_ALLOC 1
-#endif
+/*
+ * Batched callbacks, see Closure#batch.  A callback only copies its
+ * arguments into the next row of +rows+ and returns +result+; the rows
+ * are decoded and handed to +handler+ when all +capacity+ of them are
+ * used, or on Closure#flush.
+ */
+typedef struct fiddle_closure_batch {
+    mrb_value handler;
+    size_t *offsets;                    /* of each argument in a row */
+    size_t row_size;
+    mrb_int capacity;
+    mrb_int count;                      /* rows waiting for the handler */
+    char *rows;
+    void *result;                       /* returned to C by every call */
+} fiddle_closure_batch;
+
+static void
+closure_batch_free(mrb_state *mrb, fiddle_closure_batch *batch)
+{
+    mrb_free(mrb, batch->offsets);
+    mrb_free(mrb, batch->rows);
+    mrb_free(mrb, batch->result);
+    mrb_free(mrb, batch);
+}
 
 static void
 fiddle_closure_dealloc(mrb_state *mrb, void * ptr)
 {
     fiddle_closure * cls = (fiddle_closure *)ptr;
-#if USE_FFI_CLOSURE_ALLOC
-    ffi_closure_free(cls->pcl);
-#else
-    munmap(cls->pcl, sizeof(*cls->pcl));
-#endif
+    if (cls->tramp) fiddle_trampoline_free(cls->tramp);
     if (cls->argv) mrb_free(mrb, cls->argv);
+    if (cls->decoders) mrb_free(mrb, cls->decoders);
+    if (cls->foreign_default) mrb_free(mrb, cls->foreign_default);
+    if (cls->batch) closure_batch_free(mrb, cls->batch);
     mrb_free(mrb, cls);
 }
 
@@ -48,77 +97,116 @@ static const struct mrb_data_type closure_data_type = {
     fiddle_closure_dealloc,
 };
 
-void
-mrb_fiddle_closure_callback(ffi_cif *cif, void *resp, void **args, void *ctx)
+/*
+ * Argument decoders, one per TYPE_* code.  A Closure looks them up once
+ * at initialize, so a callback converts each argument with an indirect
+ * call instead of dispatching on its type.
+ */
+#define FIDDLE_CLOSURE_DECODER(name, ctype, expr) \
+static mrb_value \
+closure_decode_##name(mrb_state *mrb, const void *arg) \
+{ \
+    ctype v = *(ctype const *)arg; \
+    return expr; \
+}
+
+FIDDLE_CLOSURE_DECODER(schar, signed char, mrb_fixnum_value(v))
+FIDDLE_CLOSURE_DECODER(uchar, unsigned char, mrb_fixnum_value(v))
+FIDDLE_CLOSURE_DECODER(sshort, signed short, mrb_fixnum_value(v))
+FIDDLE_CLOSURE_DECODER(ushort, unsigned short, mrb_fixnum_value(v))
+FIDDLE_CLOSURE_DECODER(sint, int, mrb_fixnum_value(v))
+FIDDLE_CLOSURE_DECODER(uint, unsigned int, mrb_fixnum_value(v))
+FIDDLE_CLOSURE_DECODER(slong, long, mrb_fixnum_value(v))
+FIDDLE_CLOSURE_DECODER(ulong, unsigned long, mrb_fixnum_value(v))
+#if HAVE_LONG_LONG
+FIDDLE_CLOSURE_DECODER(slong_long, LONG_LONG, mrb_fixnum_value(v))
+FIDDLE_CLOSURE_DECODER(ulong_long, unsigned LONG_LONG, mrb_fixnum_value(v))
+#endif
+FIDDLE_CLOSURE_DECODER(float, float, mrb_float_value(mrb, v))
+FIDDLE_CLOSURE_DECODER(double, double, mrb_float_value(mrb, v))
+FIDDLE_CLOSURE_DECODER(voidp, void *, mrb_fiddle_ptr_new(mrb, v, 0, NULL))
+FIDDLE_CLOSURE_DECODER(const_string, char *, v ? mrb_str_new_cstr(mrb, v) : mrb_nil_value())
+
+#undef FIDDLE_CLOSURE_DECODER
+
+/* the decoder of argument +type+, NULL for void and structs */
+static fiddle_closure_decoder
+closure_decoder(mrb_state *mrb, int type)
 {
-    mrb_value self      = mrb_obj_value(ctx);
-    mrb_state *mrb      = ((fiddle_closure *)(DATA_PTR(self)))->mrb;
-    mrb_value rbargs    = mrb_iv_get(mrb, self, mrb_intern_lit(mrb, "@args"));
-    mrb_value ctype     = mrb_iv_get(mrb, self, mrb_intern_lit(mrb, "@ctype"));
-    mrb_int   argc      = mrb_ary_len(mrb, rbargs);
-    mrb_value params    = mrb_ary_new_capa(mrb, argc);
-    mrb_value ret;
+    switch (type) {
+      case TYPE_VOID:
+      case TYPE_STRUCT:
+    	return NULL;
+      case TYPE_CHAR:
+    	return closure_decode_schar;
+      case -TYPE_CHAR:
+    	return closure_decode_uchar;
+      case TYPE_SHORT:
+    	return closure_decode_sshort;
+      case -TYPE_SHORT:
+    	return closure_decode_ushort;
+      case TYPE_INT:
+    	return closure_decode_sint;
+      case -TYPE_INT:
+    	return closure_decode_uint;
+      case TYPE_LONG:
+    	return closure_decode_slong;
+      case -TYPE_LONG:
+    	return closure_decode_ulong;
+#if HAVE_LONG_LONG
+      case TYPE_LONG_LONG:
+    	return closure_decode_slong_long;
+      case -TYPE_LONG_LONG:
+    	return closure_decode_ulong_long;
+#endif
+      case TYPE_FLOAT:
+    	return closure_decode_float;
+      case TYPE_DOUBLE:
+    	return closure_decode_double;
+      case TYPE_VOIDP:
+    	return closure_decode_voidp;
+      case TYPE_CONST_STRING:
+    	return closure_decode_const_string;
+      default:
+    	mrb_raisef(mrb, E_RUNTIME_ERROR, "closure args: %S", mrb_fixnum_value(type));
+    }
+    return NULL;
+}
+
+/* argument +i+ of a callback as an mruby value */
+static mrb_value
+closure_arg(mrb_state *mrb, mrb_value self, fiddle_closure *cl, void **args, int i)
+{
+    mrb_value klass;
+    size_t size;
+    void *mem;
 
-    int i, type;
+    if (cl->decoders[i]) return cl->decoders[i](mrb, args[i]);
+
+    /* a struct passed by value, handed to the block as a copy */
+    klass = mrb_ary_entry(mrb_iv_get(mrb, self, mrb_intern_lit(mrb, "@args")), i);
+    size = cl->argv[i]->size;
+    mem = malloc(size);
+    if (!mem) mrb_raise(mrb, E_RUNTIME_ERROR, "out of memory for a struct argument");
+    memcpy(mem, args[i], size);
+    return mrb_fiddle_struct_new(mrb, klass, mem);
+}
+
+/* stores +ret+ into +resp+ the way libffi expects the result of +cl+ */
+static void
+closure_store_result(mrb_state *mrb, fiddle_closure *cl, mrb_value ret, void *resp)
+{
+    int type = cl->ret_type;
 
-    for (i = 0; i < argc; i++) {
-        type = mrb_fixnum(mrb_ary_entry(rbargs, i));
-        switch (type) {
-    	  case TYPE_VOID:
-    	    argc = 0;
-    	    break;
-    	  case TYPE_INT:
-    	    mrb_ary_push(mrb, params, mrb_fixnum_value(*(int *)args[i]));
-    	    break;
-    	  case -TYPE_INT:
-    	    mrb_ary_push(mrb, params, mrb_fixnum_value(*(unsigned int *)args[i]));
-    	    break;
-    	  case TYPE_VOIDP:
-    	    mrb_ary_push(mrb, params,
-    			mrb_funcall(mrb, mrb_obj_value(cPointer), "[]", 1,
-    				   mrb_cptr_value(mrb, *(void **)args[i])));
-    	    break;
-    	  case TYPE_LONG:
-    	    mrb_ary_push(mrb, params, mrb_fixnum_value(*(long *)args[i]));
-    	    break;
-    	  case -TYPE_LONG:
-    	    mrb_ary_push(mrb, params, mrb_fixnum_value(*(unsigned long *)args[i]));
-    	    break;
-    	  case TYPE_CHAR:
-    	    mrb_ary_push(mrb, params, mrb_fixnum_value(*(signed char *)args[i]));
-    	    break;
-    	  case -TYPE_CHAR:
-    	    mrb_ary_push(mrb, params, mrb_fixnum_value(*(unsigned char *)args[i]));
-    	    break;
-    	  case TYPE_SHORT:
-    	    mrb_ary_push(mrb, params, mrb_fixnum_value(*(signed short *)args[i]));
-    	    break;
-    	  case -TYPE_SHORT:
-    	    mrb_ary_push(mrb, params, mrb_fixnum_value(*(unsigned short *)args[i]));
-    	    break;
-    	  case TYPE_DOUBLE:
-    	    mrb_ary_push(mrb, params, mrb_float_value(mrb, *(double *)args[i]));
-    	    break;
-    	  case TYPE_FLOAT:
-    	    mrb_ary_push(mrb, params, mrb_float_value(mrb, *(float *)args[i]));
-    	    break;
-    #if HAVE_LONG_LONG
-    	  case TYPE_LONG_LONG:
-    	    mrb_ary_push(mrb, params, mrb_fixnum_value(*(LONG_LONG *)args[i]));
-    	    break;
-    	  case -TYPE_LONG_LONG:
-    	    mrb_ary_push(mrb, params, mrb_fixnum_value(*(unsigned LONG_LONG *)args[i]));
-    	    break;
-    #endif
-    	  default:
-    	    mrb_raisef(mrb, E_RUNTIME_ERROR, "closure args: %S", mrb_fixnum_value(type));
-        }
-    }
-
-    ret = mrb_funcall_argv(mrb, self, mrb_intern_lit(mrb, "call"), argc, RARRAY_PTR(params));
-
-    type = mrb_fixnum(ctype);
     switch (type) {
+      case TYPE_STRUCT:
+    	{
+    	    void *src = mrb_fiddle_value_to_cptr(mrb, ret);
+
+    	    if (!src) mrb_raise(mrb, E_ARGUMENT_ERROR, "NULL struct returned by value");
+    	    memcpy(resp, src, cl->cif.rtype->size);
+    	}
+    	break;
       case TYPE_VOID:
     	break;
       case TYPE_LONG:
@@ -138,7 +226,8 @@ mrb_fiddle_closure_callback(ffi_cif *cif, void *resp, void **args, void *ctx)
     	*(ffi_arg *)resp = (ffi_arg)mrb_int(mrb, ret);
     	break;
       case TYPE_VOIDP:
-    	*(void **)resp = mrb_cptr(ret);
+      case TYPE_CONST_STRING:
+    	*(void **)resp = mrb_fiddle_value_to_cptr(mrb, ret);
     	break;
       case TYPE_DOUBLE:
     	*(double *)resp = (double)mrb_float(mrb_Float(mrb, ret));
@@ -159,15 +248,393 @@ mrb_fiddle_closure_callback(ffi_cif *cif, void *resp, void **args, void *ctx)
     }
 }
 
+/*
+ * Runs a callback on the thread of the mrb_state.  Up to
+ * FIDDLE_CLOSURE_STACK_ARGS arguments are passed to #call from an
+ * on-stack array; the values it holds are kept alive by the GC arena.
+ * Wider callbacks build an Array.  Returns what the callback returned.
+ */
+static mrb_value
+closure_invoke(mrb_state *mrb, mrb_value self, fiddle_closure *cl, void *resp, void **args)
+{
+    mrb_value stack[FIDDLE_CLOSURE_STACK_ARGS];
+    mrb_value *params = stack;
+    mrb_value ret;
+    int i;
+
+    if (cl->call_argc <= FIDDLE_CLOSURE_STACK_ARGS) {
+    	for (i = 0; i < cl->call_argc; i++) {
+    	    stack[i] = closure_arg(mrb, self, cl, args, i);
+    	}
+    } else {
+    	mrb_value ary = mrb_ary_new_capa(mrb, cl->call_argc);
+
+    	for (i = 0; i < cl->call_argc; i++) {
+    	    mrb_ary_push(mrb, ary, closure_arg(mrb, self, cl, args, i));
+    	}
+    	params = RARRAY_PTR(ary);
+    }
+
+    if (mrb_nil_p(cl->block)) {
+    	ret = mrb_funcall_argv(mrb, self, cl->call, cl->call_argc, params);
+    } else {
+    	ret = mrb_yield_argv(mrb, cl->block, cl->call_argc, params);
+    }
+
+    closure_store_result(mrb, cl, ret, resp);
+    return ret;
+}
+
+/* bytes libffi reads back from the result buffer of +cl+ */
+static size_t
+closure_result_size(fiddle_closure *cl)
+{
+    size_t size = cl->cif.rtype->size;
+
+    if (cl->ret_type == TYPE_VOID) return 0;
+    return size < sizeof(ffi_arg) ? sizeof(ffi_arg) : size;
+}
+
+/*
+ * Hands the rows of a batched closure to its handler as one Array of
+ * argument lists, or of plain values for callbacks of one argument.
+ * Returns how many were delivered.
+ */
+static mrb_int
+closure_batch_flush(mrb_state *mrb, mrb_value self, fiddle_closure *cl)
+{
+    fiddle_closure_batch *batch = cl->batch;
+    mrb_value events;
+    mrb_int n = batch->count, r;
+    int i, ai;
+
+    if (n == 0) return 0;
+
+    events = mrb_ary_new_capa(mrb, n);
+    ai = mrb_gc_arena_save(mrb);
+    for (r = 0; r < n; r++) {
+    	char *row = batch->rows + (size_t)r * batch->row_size;
+
+    	if (cl->call_argc == 1) {
+    	    mrb_ary_push(mrb, events, cl->decoders[0](mrb, row));
+    	} else {
+    	    mrb_value event = mrb_ary_new_capa(mrb, cl->call_argc);
+
+    	    for (i = 0; i < cl->call_argc; i++) {
+    		mrb_ary_push(mrb, event, cl->decoders[i](mrb, row + batch->offsets[i]));
+    	    }
+    	    mrb_ary_push(mrb, events, event);
+    	}
+    	mrb_gc_arena_restore(mrb, ai);
+    }
+
+    /* the handler may cause more callbacks */
+    batch->count = 0;
+    mrb_yield_argv(mrb, batch->handler, 1, &events);
+    return n;
+}
+
+static void
+closure_batch_append(mrb_state *mrb, mrb_value self, fiddle_closure *cl, void *resp, void **args)
+{
+    fiddle_closure_batch *batch = cl->batch;
+    char *row = batch->rows + (size_t)batch->count * batch->row_size;
+    int i;
+
+    for (i = 0; i < cl->call_argc; i++) {
+    	memcpy(row + batch->offsets[i], args[i], cl->argv[i]->size);
+    }
+    memcpy(resp, batch->result, closure_result_size(cl));
+
+    if (++batch->count == batch->capacity) {
+    	closure_batch_flush(mrb, self, cl);
+    }
+}
+
+#if defined(FIDDLE_ASYNC)
+/*
+ * Calls from other threads.
+ *
+ * The mrb_state may only be entered by the thread running it.  A
+ * Closure whose foreign_calls mode is :queue or :wait pushes calls made
+ * on any other thread to a lock-free multi-producer queue of its
+ * mrb_state instead; Fiddle::Closure.dispatch_pending runs them on the
+ * mruby thread.  :queue copies the arguments and returns foreign_default
+ * at once, :wait blocks the calling thread until its call has run.
+ *
+ * The queue is Dmitry Vyukov's intrusive MPSC queue: producers swap
+ * themselves in at +head+ with a single atomic exchange, the mruby
+ * thread alone pops at +tail+.
+ */
+typedef struct fiddle_foreign_call {
+    struct fiddle_foreign_call *next;
+    struct RData *closure;
+    void **args;                            /* as libffi passes them */
+    void *resp;                             /* where the result goes */
+    int wait;                               /* is a thread blocked on it? */
+    int done;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+} fiddle_foreign_call;
+
+typedef struct fiddle_callq {
+    fiddle_foreign_call *head;              /* pushed last */
+    fiddle_foreign_call *tail;              /* popped next */
+    fiddle_foreign_call stub;
+} fiddle_callq;
+
+static void
+fiddle_callq_push(fiddle_callq *q, fiddle_foreign_call *call)
+{
+    fiddle_foreign_call *prev;
+
+    __atomic_store_n(&call->next, NULL, __ATOMIC_RELAXED);
+    prev = __atomic_exchange_n(&q->head, call, __ATOMIC_ACQ_REL);
+    __atomic_store_n(&prev->next, call, __ATOMIC_RELEASE);
+}
+
+/* NULL when empty, or when the call pushed last is not linked in yet */
+static fiddle_foreign_call *
+fiddle_callq_pop(fiddle_callq *q)
+{
+    fiddle_foreign_call *tail = q->tail;
+    fiddle_foreign_call *next = __atomic_load_n(&tail->next, __ATOMIC_ACQUIRE);
+
+    if (tail == &q->stub) {
+    	if (!next) return NULL;
+    	q->tail = next;
+    	tail = next;
+    	next = __atomic_load_n(&tail->next, __ATOMIC_ACQUIRE);
+    }
+    if (next) {
+    	q->tail = next;
+    	return tail;
+    }
+    if (tail != __atomic_load_n(&q->head, __ATOMIC_ACQUIRE)) return NULL;
+
+    fiddle_callq_push(q, &q->stub);
+    next = __atomic_load_n(&tail->next, __ATOMIC_ACQUIRE);
+    if (next) {
+    	q->tail = next;
+    	return tail;
+    }
+    return NULL;
+}
+
+static fiddle_callq *
+fiddle_callq_get(mrb_state *mrb)
+{
+    fiddle_state *state = mrb_fiddle_state(mrb);
+
+    if (!state->callq) {
+    	fiddle_callq *q = (fiddle_callq *)mrb_calloc(mrb, 1, sizeof(fiddle_callq));
+
+    	q->head = q->tail = &q->stub;
+    	state->callq = q;
+    }
+    return state->callq;
+}
+
+#define FIDDLE_FOREIGN_ALIGN(n) (((n) + 15) & ~(size_t)15)
+
+static void
+closure_defer(fiddle_closure *cl, struct RData *data, void *resp, void **args)
+{
+    fiddle_foreign_call *call;
+    size_t size, offset;
+    int i;
+
+    if (cl->foreign == FIDDLE_FOREIGN_WAIT) {
+    	fiddle_foreign_call wait;
+
+    	wait.closure = data;
+    	wait.args = args;
+    	wait.resp = resp;
+    	wait.wait = 1;
+    	wait.done = 0;
+    	pthread_mutex_init(&wait.lock, NULL);
+    	pthread_cond_init(&wait.cond, NULL);
+
+    	fiddle_callq_push(cl->callq, &wait);
+
+    	pthread_mutex_lock(&wait.lock);
+    	while (!wait.done) pthread_cond_wait(&wait.cond, &wait.lock);
+    	pthread_mutex_unlock(&wait.lock);
+    	pthread_mutex_destroy(&wait.lock);
+    	pthread_cond_destroy(&wait.cond);
+    	return;
+    }
+
+    memcpy(resp, cl->foreign_default, closure_result_size(cl));
+
+    /* one block: the call, the argument pointers, the arguments, the result */
+    size = FIDDLE_FOREIGN_ALIGN(sizeof(fiddle_foreign_call) + sizeof(void *) * cl->argc);
+    for (i = 0; i < cl->argc; i++) size += FIDDLE_FOREIGN_ALIGN(cl->argv[i]->size);
+    size += closure_result_size(cl);
+
+    call = (fiddle_foreign_call *)malloc(size);
+    if (!call) return;    /* the call is dropped */
+    call->closure = data;
+    call->args = (void **)(call + 1);
+    call->wait = 0;
+    offset = FIDDLE_FOREIGN_ALIGN(sizeof(fiddle_foreign_call) + sizeof(void *) * cl->argc);
+    for (i = 0; i < cl->argc; i++) {
+    	call->args[i] = (char *)call + offset;
+    	memcpy(call->args[i], args[i], cl->argv[i]->size);
+    	offset += FIDDLE_FOREIGN_ALIGN(cl->argv[i]->size);
+    }
+    call->resp = (char *)call + offset;
+
+    fiddle_callq_push(cl->callq, call);
+}
+
+static mrb_value
+closure_run_deferred(mrb_state *mrb, mrb_value data)
+{
+    fiddle_foreign_call *call = (fiddle_foreign_call *)mrb_cptr(data);
+    mrb_value self = mrb_obj_value(call->closure);
+    fiddle_closure *cl = (fiddle_closure *)DATA_PTR(self);
+
+    if (cl->batch) {
+    	closure_batch_append(mrb, self, cl, call->resp, call->args);
+    } else {
+    	closure_invoke(mrb, self, cl, call->resp, call->args);
+    }
+    return mrb_nil_value();
+}
+
+/* hands a :wait call its result, zeroed if it raised, or frees a :queue one */
+static void
+closure_complete(fiddle_foreign_call *call, int failed)
+{
+    if (!call->wait) {
+    	free(call);
+    	return;
+    }
+    if (failed) {
+    	fiddle_closure *cl = (fiddle_closure *)call->closure->data;
+
+    	memset(call->resp, 0, closure_result_size(cl));
+    }
+    pthread_mutex_lock(&call->lock);
+    call->done = 1;
+    pthread_cond_signal(&call->cond);
+    pthread_mutex_unlock(&call->lock);
+}
+
+/* releases the queue, failing the calls still waiting in it */
+void
+fiddle_callq_free(mrb_state *mrb, fiddle_state *state)
+{
+    fiddle_foreign_call *call;
+
+    if (!state->callq) return;
+    while ((call = fiddle_callq_pop(state->callq)) != NULL) {
+    	closure_complete(call, 1);
+    }
+    mrb_free(mrb, state->callq);
+    state->callq = NULL;
+}
+#endif
+
+/*
+ * Lets the GC make progress inside a C function that calls back many
+ * times: every Closure.gc_step_interval callbacks run one incremental
+ * step.
+ */
+static void
+closure_gc_step(mrb_state *mrb, fiddle_state *state)
+{
+    if (state->gc_step_interval <= 0) return;
+    if (--state->gc_step_countdown > 0) return;
+    state->gc_step_countdown = state->gc_step_interval;
+    mrb_incremental_gc(mrb);
+}
+
+/*
+ * The objects a callback creates are only protected by the GC arena
+ * until it returns: a C loop calling back millions of times within one
+ * Function#call would otherwise fill the arena and keep every one of
+ * them alive until the call is over.  Only a returned object C may
+ * point into stays alive, referenced by the closure until its next
+ * callback, so the arena doesn't grow with every call either.
+ */
+void
+mrb_fiddle_closure_callback(ffi_cif *cif, void *resp, void **args, void *ctx)
+{
+    mrb_value self      = mrb_obj_value(ctx);
+    fiddle_closure *cl  = (fiddle_closure *)DATA_PTR(self);
+    mrb_value ret = mrb_nil_value();
+    int ai;
+
+#if defined(FIDDLE_ASYNC)
+    if (cl->foreign != FIDDLE_FOREIGN_DIRECT && !pthread_equal(pthread_self(), cl->owner)) {
+    	closure_defer(cl, (struct RData *)ctx, resp, args);
+    	return;
+    }
+#endif
+    ai = mrb_gc_arena_save(cl->mrb);
+    if (cl->batch) {
+    	closure_batch_append(cl->mrb, self, cl, resp, args);
+    } else {
+    	ret = closure_invoke(cl->mrb, self, cl, resp, args);
+    }
+    mrb_gc_arena_restore(cl->mrb, ai);
+    /* C still reads a returned pointer, e.g. of a fresh String, after the callback */
+    if (cl->ret_type == TYPE_VOIDP || cl->ret_type == TYPE_CONST_STRING) {
+    	mrb_iv_set(cl->mrb, self, mrb_intern_lit(cl->mrb, "__result__"), ret);
+    }
+    closure_gc_step(cl->mrb, cl->state);
+}
+
+/*
+ * The block callbacks of +self+ can yield to, or nil.  That is +block+
+ * when +self+ is a Closure::BlockCaller whose #call is still the one
+ * only forwarding to its block, which saves a method dispatch and an
+ * argument splat per callback.  It is pinned in a hidden instance
+ * variable.
+ */
+static mrb_value
+closure_block_target(mrb_state *mrb, mrb_value self, mrb_sym call, mrb_value block)
+{
+    struct RClass *klass, *block_caller;
+#if MRUBY_RELEASE_MAJOR >= 2
+    mrb_method_t method, forwarder;
+#else
+    struct RProc *method, *forwarder;
+#endif
+
+    if (mrb_nil_p(block) || !mrb_class_defined_under(mrb, cClosure, "BlockCaller")) {
+    	return mrb_nil_value();
+    }
+
+    klass = mrb_obj_class(mrb, self);
+    block_caller = mrb_class_get_under(mrb, cClosure, "BlockCaller");
+    method = mrb_method_search_vm(mrb, &klass, call);
+    forwarder = mrb_method_search_vm(mrb, &block_caller, call);
+#if MRUBY_RELEASE_MAJOR >= 2
+    if (MRB_METHOD_UNDEF_P(method) || MRB_METHOD_UNDEF_P(forwarder) ||
+    	MRB_METHOD_FUNC_P(method) || MRB_METHOD_FUNC_P(forwarder) ||
+    	MRB_METHOD_PROC(method) != MRB_METHOD_PROC(forwarder)) {
+    	return mrb_nil_value();
+    }
+#else
+    if (!method || method != forwarder) return mrb_nil_value();
+#endif
+
+    mrb_iv_set(mrb, self, mrb_intern_lit(mrb, "__block__"), block);
+    return block;
+}
+
 static mrb_value
 mrb_fiddle_closure_initialize(mrb_state *mrb, mrb_value self)
 {
-    mrb_int ret, abi;
-    mrb_value args;
+    mrb_int abi;
+    mrb_value ret, args, block = mrb_nil_value();
+    ffi_type *ret_ffi_type;
     fiddle_closure * cl;
     ffi_cif * cif;
-    ffi_closure *pcl;
-    ffi_status result;
+    int result;
     mrb_int i, argc;
 
     cl = (fiddle_closure *)DATA_PTR(self);
@@ -177,53 +644,57 @@ mrb_fiddle_closure_initialize(mrb_state *mrb, mrb_value self)
     DATA_TYPE(self) = &closure_data_type;
     DATA_PTR(self) = NULL;
 
-    cl = mrb_malloc(mrb, sizeof(fiddle_closure));
+    cl = mrb_calloc(mrb, 1, sizeof(fiddle_closure));
     cl->mrb = mrb;
-#if USE_FFI_CLOSURE_ALLOC
-    cl->pcl = ffi_closure_alloc(sizeof(ffi_closure), &cl->code);
-#else
-    cl->pcl = mmap(NULL, sizeof(ffi_closure), PROT_READ | PROT_WRITE,
-        MAP_ANON | MAP_PRIVATE, -1, 0);
-#endif
+    cl->state = mrb_fiddle_state(mrb);
     DATA_PTR(self) = cl;
+    cl->tramp = fiddle_trampoline_alloc();
+    if (!cl->tramp) {
+    	mrb_raise(mrb, E_RUNTIME_ERROR, "cannot allocate a closure trampoline");
+    }
 
-    if (2 == mrb_get_args(mrb, "iA|i", &ret, &args, &abi))
+    cl->block = mrb_nil_value();
+    if (2 == mrb_get_args(mrb, "oA|i&", &ret, &args, &abi, &block))
     	abi = FFI_DEFAULT_ABI;
 
     //Check_Type(args, T_ARRAY);
 
     argc = mrb_ary_len(mrb, args);
 
+    cl->argc = (int)argc;
+    cl->call_argc = (int)argc;
     cl->argv = (ffi_type **)mrb_calloc(mrb, argc + 1, sizeof(ffi_type *));
+    cl->decoders = (fiddle_closure_decoder *)mrb_calloc(mrb, argc + 1, sizeof(fiddle_closure_decoder));
 
     for (i = 0; i < argc; i++) {
-        int type = mrb_fixnum(mrb_ary_entry(args, i));
-        cl->argv[i] = INT2FFI_TYPE(mrb, type);
+        int type = mrb_fiddle_type_code(mrb, mrb_ary_entry(args, i), &cl->argv[i]);
+
+        cl->decoders[i] = closure_decoder(mrb, type);
+        /* (void) declares a callback without arguments */
+        if (type == TYPE_VOID) cl->call_argc = 0;
     }
     cl->argv[argc] = NULL;
 
-    mrb_iv_set(mrb, self, mrb_intern_lit(mrb, "@ctype"), mrb_fixnum_value(ret));
+    cl->ret_type = mrb_fiddle_type_code(mrb, ret, &ret_ffi_type);
+    cl->call = mrb_intern_lit(mrb, "call");
+    cl->block = closure_block_target(mrb, self, cl->call, block);
+    mrb_iv_set(mrb, self, mrb_intern_lit(mrb, "@ctype"), ret);
     mrb_iv_set(mrb, self, mrb_intern_lit(mrb, "@args"), args);
 
     cif = &cl->cif;
-    pcl = cl->pcl;
 
-    result = ffi_prep_cif(cif, abi, argc, INT2FFI_TYPE(mrb, ret), cl->argv);
+    result = ffi_prep_cif(cif, abi, argc, ret_ffi_type, cl->argv);
 
     if (FFI_OK != result)
     	mrb_raisef(mrb, E_RUNTIME_ERROR, "error prepping CIF %S", mrb_fixnum_value(result));
 
-#if USE_FFI_CLOSURE_ALLOC
-    result = ffi_prep_closure_loc(pcl, cif, mrb_fiddle_closure_callback,
-		(void *)RDATA(self), cl->code);
-#else
-    result = ffi_prep_closure(pcl, cif, mrb_fiddle_closure_callback, (void *)RDATA(self));
-    cl->code = (void *)pcl;
-    i = mprotect(pcl, sizeof(*pcl), PROT_READ | PROT_EXEC);
-    if (i) {
+    /* zeroed, and wide enough for any result libffi reads back */
+    cl->foreign_default = mrb_calloc(mrb, 1, ret_ffi_type->size < sizeof(ffi_arg) ? sizeof(ffi_arg) : ret_ffi_type->size);
+
+    result = fiddle_trampoline_prep(cl->tramp, cif, mrb_fiddle_closure_callback, (void *)RDATA(self));
+    if (result < 0) {
         mrb_sys_fail(mrb, "mprotect");
     }
-#endif
 
     if (FFI_OK != result)
     	mrb_raisef(mrb, E_RUNTIME_ERROR, "error prepping closure %S", mrb_fixnum_value(result));
@@ -239,7 +710,7 @@ mrb_fiddle_closure_to_i(mrb_state *mrb, mrb_value self)
 
     Data_Get_Struct(mrb, self, &closure_data_type, cl);
 
-    code = cl->code;
+    code = cl->tramp->code;
 
     return mrb_fixnum_value((long)code);
 }
@@ -250,7 +721,313 @@ mrb_fiddle_closure_to_value(mrb_state *mrb, mrb_value self)
     fiddle_closure * cl;
 
     Data_Get_Struct(mrb, self, &closure_data_type, cl);
-    return mrb_cptr_value(mrb, cl->code);
+    return mrb_cptr_value(mrb, cl->tramp->code);
+}
+
+/*
+ * Lays out a recorded call like a C struct of the closure's arguments,
+ * filling +offsets+ when given, and returns the 16-byte aligned size of
+ * one.
+ */
+static size_t
+closure_batch_layout(fiddle_closure *cl, size_t *offsets)
+{
+    size_t offset = 0;
+    int i;
+
+    for (i = 0; i < cl->call_argc; i++) {
+    	size_t align = cl->argv[i]->alignment;
+
+    	offset = (offset + align - 1) / align * align;
+    	if (offsets) offsets[i] = offset;
+    	offset += cl->argv[i]->size;
+    }
+    return (offset + 15) & ~(size_t)15;
+}
+
+/*
+ * call-seq: batch(capacity, result = nil) { |events| ... } => self
+ *
+ * Batches the calls of this closure: instead of running #call, a call
+ * from C only records its arguments and returns +result+ (zero when
+ * nil).  Once +capacity+ calls are recorded, or on #flush, the block is
+ * yielded an Array with one entry per call: the Array of its arguments,
+ * or the argument itself for a closure taking one.
+ *
+ *   events = Closure::BlockCaller.new(TYPE_VOID, [TYPE_INT, TYPE_INT]) { }
+ *   events.batch(256) { |moves| moves.each { |x, y| track(x, y) } }
+ *
+ * Arguments are kept as they were passed, so pointers are only useful
+ * if what they point to outlives the batch; string and struct arguments
+ * are not supported.  Batching again flushes the calls recorded so far.
+ */
+static mrb_value
+mrb_fiddle_closure_batch(mrb_state *mrb, mrb_value self)
+{
+    fiddle_closure * cl;
+    fiddle_closure_batch *batch;
+    mrb_value result = mrb_nil_value(), handler = mrb_nil_value();
+    mrb_int capacity;
+    size_t row_size;
+    int i;
+
+    mrb_get_args(mrb, "i|o&", &capacity, &result, &handler);
+
+    Data_Get_Struct(mrb, self, &closure_data_type, cl);
+    if (mrb_nil_p(handler)) {
+    	mrb_raise(mrb, E_ARGUMENT_ERROR, "batch needs a block");
+    }
+    if (capacity <= 0) {
+    	mrb_raisef(mrb, E_ARGUMENT_ERROR, "invalid batch capacity %S", mrb_fixnum_value(capacity));
+    }
+    for (i = 0; i < cl->call_argc; i++) {
+    	if (!cl->decoders[i] || cl->decoders[i] == closure_decode_const_string) {
+    	    mrb_raise(mrb, E_ARGUMENT_ERROR, "batched closures only take scalar and pointer arguments");
+    	}
+    }
+    row_size = closure_batch_layout(cl, NULL);
+    if (row_size > 0 && (size_t)capacity > (SIZE_MAX - 1) / row_size) {
+    	mrb_raisef(mrb, E_ARGUMENT_ERROR, "batch capacity %S overflows", mrb_fixnum_value(capacity));
+    }
+
+    if (cl->batch) {
+    	closure_batch_flush(mrb, self, cl);
+    	closure_batch_free(mrb, cl->batch);
+    	cl->batch = NULL;
+    }
+
+    batch = (fiddle_closure_batch *)mrb_calloc(mrb, 1, sizeof(fiddle_closure_batch));
+    batch->offsets = (size_t *)mrb_calloc(mrb, cl->call_argc + 1, sizeof(size_t));
+    closure_batch_layout(cl, batch->offsets);
+    batch->row_size = row_size;
+    batch->capacity = capacity;
+    batch->rows = (char *)mrb_malloc(mrb, (size_t)capacity * row_size + 1);
+    batch->result = mrb_calloc(mrb, 1, sizeof(ffi_arg) + cl->cif.rtype->size);
+    batch->handler = handler;
+    cl->batch = batch;
+    mrb_iv_set(mrb, self, mrb_intern_lit(mrb, "__batch__"), handler);
+
+    if (!mrb_nil_p(result)) closure_store_result(mrb, cl, result, batch->result);
+    return self;
+}
+
+/*
+ * call-seq: flush => Integer
+ *
+ * Hands the calls a batched closure recorded so far to its block, and
+ * returns how many there were.
+ */
+static mrb_value
+mrb_fiddle_closure_flush(mrb_state *mrb, mrb_value self)
+{
+    fiddle_closure * cl;
+
+    Data_Get_Struct(mrb, self, &closure_data_type, cl);
+    if (!cl->batch) return mrb_fixnum_value(0);
+    return mrb_fixnum_value(closure_batch_flush(mrb, self, cl));
+}
+
+/*
+ * call-seq: unbatch => Integer
+ *
+ * Flushes a batched closure and makes calls run #call again.  Returns
+ * how many calls were flushed.
+ */
+static mrb_value
+mrb_fiddle_closure_unbatch(mrb_state *mrb, mrb_value self)
+{
+    fiddle_closure * cl;
+    mrb_int n;
+
+    Data_Get_Struct(mrb, self, &closure_data_type, cl);
+    if (!cl->batch) return mrb_fixnum_value(0);
+    n = closure_batch_flush(mrb, self, cl);
+    closure_batch_free(mrb, cl->batch);
+    cl->batch = NULL;
+    mrb_iv_set(mrb, self, mrb_intern_lit(mrb, "__batch__"), mrb_nil_value());
+    return mrb_fixnum_value(n);
+}
+
+/*
+ * call-seq: foreign_calls = :direct, :queue or :wait
+ *
+ * Sets how calls of this closure made by threads other than the mruby
+ * one are run:
+ *
+ * :direct :: on the calling thread, the default.  Only safe when the C
+ *            library calls back from the thread that called into it.
+ * :queue  :: queued for Fiddle::Closure.dispatch_pending; the caller
+ *            gets foreign_default at once
+ * :wait   :: queued, and the caller blocks until dispatch_pending has
+ *            run the call, so the mruby thread must not wait for it
+ *
+ * The thread setting the mode is taken as the mruby thread.  The
+ * closure must stay referenced while calls of it are queued.
+ */
+static mrb_value
+mrb_fiddle_closure_set_foreign_calls(mrb_state *mrb, mrb_value self)
+{
+    fiddle_closure * cl;
+    mrb_sym mode;
+
+    mrb_get_args(mrb, "n", &mode);
+
+    Data_Get_Struct(mrb, self, &closure_data_type, cl);
+    if (mode == mrb_intern_lit(mrb, "direct")) {
+    	cl->foreign = FIDDLE_FOREIGN_DIRECT;
+    	return mrb_symbol_value(mode);
+    }
+#if defined(FIDDLE_ASYNC)
+    if (mode == mrb_intern_lit(mrb, "queue")) {
+    	cl->foreign = FIDDLE_FOREIGN_QUEUE;
+    } else if (mode == mrb_intern_lit(mrb, "wait")) {
+    	cl->foreign = FIDDLE_FOREIGN_WAIT;
+    } else {
+    	mrb_raisef(mrb, E_ARGUMENT_ERROR, "unknown foreign_calls mode %S", mrb_symbol_value(mode));
+    }
+    cl->owner = pthread_self();
+    cl->callq = fiddle_callq_get(mrb);
+#else
+    mrb_raise(mrb, E_NOTIMP_ERROR, "foreign calls can only be run directly on this platform");
+#endif
+    return mrb_symbol_value(mode);
+}
+
+/*
+ * call-seq: foreign_calls => Symbol
+ *
+ * Returns how calls from other threads are run, see foreign_calls=.
+ */
+static mrb_value
+mrb_fiddle_closure_foreign_calls(mrb_state *mrb, mrb_value self)
+{
+    fiddle_closure * cl;
+
+    Data_Get_Struct(mrb, self, &closure_data_type, cl);
+    switch (cl->foreign) {
+      case FIDDLE_FOREIGN_QUEUE:
+    	return mrb_symbol_value(mrb_intern_lit(mrb, "queue"));
+      case FIDDLE_FOREIGN_WAIT:
+    	return mrb_symbol_value(mrb_intern_lit(mrb, "wait"));
+      default:
+    	return mrb_symbol_value(mrb_intern_lit(mrb, "direct"));
+    }
+}
+
+/*
+ * call-seq: foreign_default = value
+ *
+ * Sets what C gets back from calls queued in the :queue foreign_calls
+ * mode, converted to the return type of the closure.  It is zero until
+ * set, and should be set before C can call the closure.
+ */
+static mrb_value
+mrb_fiddle_closure_set_foreign_default(mrb_state *mrb, mrb_value self)
+{
+    fiddle_closure * cl;
+    mrb_value value;
+
+    mrb_get_args(mrb, "o", &value);
+
+    Data_Get_Struct(mrb, self, &closure_data_type, cl);
+    closure_store_result(mrb, cl, value, cl->foreign_default);
+    mrb_iv_set(mrb, self, mrb_intern_lit(mrb, "@foreign_default"), value);
+    return value;
+}
+
+/*
+ * call-seq: Fiddle::Closure.dispatch_pending(max = nil) => Integer
+ *
+ * Runs the calls other threads queued for closures of this mrb_state,
+ * at most +max+ of them, and returns how many ran.  An exception raised
+ * by one of them is raised from here, after its caller got a zero
+ * result; the calls after it stay queued.
+ */
+static mrb_value
+mrb_fiddle_closure_s_dispatch_pending(mrb_state *mrb, mrb_value klass)
+{
+    mrb_value max = mrb_nil_value();
+#if defined(FIDDLE_ASYNC)
+    fiddle_state *state = mrb_fiddle_state(mrb);
+    fiddle_foreign_call *call;
+    mrb_value exc;
+    mrb_int count = 0, limit;
+    mrb_bool failed;
+    int ai;
+
+    mrb_get_args(mrb, "|o", &max);
+    limit = mrb_nil_p(max) ? -1 : mrb_int(mrb, max);
+    if (!state->callq) return mrb_fixnum_value(0);
+
+    ai = mrb_gc_arena_save(mrb);
+    while (limit < 0 || count < limit) {
+    	call = fiddle_callq_pop(state->callq);
+    	if (!call) break;
+    	count++;
+    	exc = mrb_protect(mrb, closure_run_deferred, mrb_cptr_value(mrb, call), &failed);
+    	closure_complete(call, failed);
+    	if (failed) mrb_exc_raise(mrb, exc);
+    	mrb_gc_arena_restore(mrb, ai);
+    }
+    return mrb_fixnum_value(count);
+#else
+    mrb_get_args(mrb, "|o", &max);
+    return mrb_fixnum_value(0);
+#endif
+}
+
+/*
+ * call-seq: Fiddle::Closure.gc_step_interval = callbacks
+ *
+ * Makes every +callbacks+-th closure callback run one incremental GC
+ * step, so that garbage from callbacks is collected while a long C
+ * function is still calling back.  0, the default, leaves the GC to
+ * its usual schedule.
+ */
+static mrb_value
+mrb_fiddle_closure_s_set_gc_step_interval(mrb_state *mrb, mrb_value klass)
+{
+    fiddle_state *state = mrb_fiddle_state(mrb);
+    mrb_int interval;
+
+    mrb_get_args(mrb, "i", &interval);
+    if (interval < 0) {
+    	mrb_raisef(mrb, E_ARGUMENT_ERROR, "negative interval %S", mrb_fixnum_value(interval));
+    }
+    state->gc_step_interval = interval;
+    state->gc_step_countdown = interval;
+    return mrb_fixnum_value(interval);
+}
+
+/*
+ * call-seq: Fiddle::Closure.gc_step_interval => Integer
+ *
+ * Returns the callbacks between GC steps, 0 when they are disabled.
+ */
+static mrb_value
+mrb_fiddle_closure_s_gc_step_interval(mrb_state *mrb, mrb_value klass)
+{
+    return mrb_fixnum_value(mrb_fiddle_state(mrb)->gc_step_interval);
+}
+
+/*
+ * call-seq: Fiddle::Closure.trampoline_stats => Hash
+ *
+ * Returns the state of the process-wide pool closure trampolines are
+ * taken from and returned to:
+ *
+ * :pages         :: executable pages closures are carved from, 0 when
+ *                   libffi's ffi_closure_alloc is used
+ * :live          :: trampolines of existing Closures
+ * :free          :: trampolines kept for reuse
+ * :allocated     :: trampolines handed out so far
+ * :recycled      :: of them, trampolines reused after a free
+ * :fragmentation :: share of the kept trampolines that are not in use
+ */
+static mrb_value
+mrb_fiddle_closure_s_trampoline_stats(mrb_state *mrb, mrb_value klass)
+{
+    return fiddle_trampoline_stats(mrb);
 }
 
 void
@@ -301,5 +1078,15 @@ mrb_fiddle_closure_init(mrb_state *mrb)
      */
     mrb_define_method(mrb, cClosure, "to_i", mrb_fiddle_closure_to_i, MRB_ARGS_NONE());
     mrb_define_method(mrb, cClosure, "to_value", mrb_fiddle_closure_to_value, MRB_ARGS_NONE());
+    mrb_define_method(mrb, cClosure, "batch", mrb_fiddle_closure_batch, MRB_ARGS_ARG(1, 1) | MRB_ARGS_BLOCK());
+    mrb_define_method(mrb, cClosure, "flush", mrb_fiddle_closure_flush, MRB_ARGS_NONE());
+    mrb_define_method(mrb, cClosure, "unbatch", mrb_fiddle_closure_unbatch, MRB_ARGS_NONE());
+    mrb_define_method(mrb, cClosure, "foreign_calls=", mrb_fiddle_closure_set_foreign_calls, MRB_ARGS_REQ(1));
+    mrb_define_method(mrb, cClosure, "foreign_calls", mrb_fiddle_closure_foreign_calls, MRB_ARGS_NONE());
+    mrb_define_method(mrb, cClosure, "foreign_default=", mrb_fiddle_closure_set_foreign_default, MRB_ARGS_REQ(1));
+    mrb_define_class_method(mrb, cClosure, "dispatch_pending", mrb_fiddle_closure_s_dispatch_pending, MRB_ARGS_OPT(1));
+    mrb_define_class_method(mrb, cClosure, "gc_step_interval=", mrb_fiddle_closure_s_set_gc_step_interval, MRB_ARGS_REQ(1));
+    mrb_define_class_method(mrb, cClosure, "gc_step_interval", mrb_fiddle_closure_s_gc_step_interval, MRB_ARGS_NONE());
+    mrb_define_class_method(mrb, cClosure, "trampoline_stats", mrb_fiddle_closure_s_trampoline_stats, MRB_ARGS_NONE());
 }
 /* vim: set noet sw=4 sts=4 */
@@ -6,4 +6,29 @@
 
 #define LONG_LONG long long
 
+/* JIT stubs for hot functions are only emitted for the SysV x86-64 ABI */
+#if defined(__x86_64__) && !defined(_WIN32) && !defined(FIDDLE_NO_JIT)
+#define FIDDLE_JIT 1
+#endif
+
+/* Function#call_async runs calls on a pthread worker pool */
+#if !defined(_WIN32) && !defined(FIDDLE_NO_ASYNC)
+#define FIDDLE_ASYNC 1
+#endif
+
+/* number of call_async worker threads */
+#ifndef FIDDLE_ASYNC_WORKERS
+#define FIDDLE_ASYNC_WORKERS 4
+#endif
+
+/* outstanding call_async Futures before the completed ones are dropped */
+#ifndef FIDDLE_ASYNC_PRUNE
+#define FIDDLE_ASYNC_PRUNE 64
+#endif
+
+/* default of Fiddle::Function.jit_threshold */
+#ifndef FIDDLE_JIT_THRESHOLD
+#define FIDDLE_JIT_THRESHOLD 100
+#endif
+
 #endif
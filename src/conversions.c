@@ -1,7 +1,6 @@
 #include "fiddle.h"
 #include "conversions.h"
-
-extern struct RClass *cPointer;
+#include "pointer.h"
 
 ffi_type *
 int_to_ffi_type(mrb_state *mrb, int type)
@@ -19,6 +18,8 @@ int_to_ffi_type(mrb_state *mrb, int type)
       case TYPE_VOID:
     	return &ffi_type_void;
       case TYPE_VOIDP:
+      case TYPE_CONST_STRING:
+      case TYPE_STRING_BUFFER:
     	return &ffi_type_pointer;
       case TYPE_CHAR:
     	return rb_ffi_type_of(char);
@@ -42,102 +43,379 @@ int_to_ffi_type(mrb_state *mrb, int type)
     return &ffi_type_pointer;
 }
 
-extern void *
-mrb_fiddle_ptr_to_cptr(mrb_state *mrb, mrb_value self);
+/*
+ * Argument converters, one per TYPE_* code.  They are looked up once by
+ * int_to_arg_converter when a Function is built and then called directly.
+ */
+#define FIDDLE_INT_ARG_CONVERTER(name, field, ctype) \
+static void \
+name##_to_generic(mrb_state *mrb, mrb_value src, fiddle_generic *dst) \
+{ \
+    dst->field = (ctype)mrb_int(mrb, src); \
+}
+
+FIDDLE_INT_ARG_CONVERTER(schar, schar, signed char)
+FIDDLE_INT_ARG_CONVERTER(uchar, uchar, unsigned char)
+FIDDLE_INT_ARG_CONVERTER(sshort, sshort, signed short)
+FIDDLE_INT_ARG_CONVERTER(ushort, ushort, unsigned short)
+FIDDLE_INT_ARG_CONVERTER(sint, sint, signed int)
+FIDDLE_INT_ARG_CONVERTER(uint, uint, unsigned int)
+FIDDLE_INT_ARG_CONVERTER(slong, slong, signed long)
+FIDDLE_INT_ARG_CONVERTER(ulong, ulong, unsigned long)
+#if HAVE_LONG_LONG
+FIDDLE_INT_ARG_CONVERTER(slong_long, slong_long, signed LONG_LONG)
+FIDDLE_INT_ARG_CONVERTER(ulong_long, ulong_long, unsigned LONG_LONG)
+#endif
+
+#undef FIDDLE_INT_ARG_CONVERTER
+
+static void
+void_to_generic(mrb_state *mrb, mrb_value src, fiddle_generic *dst)
+{
+}
+
+static void
+voidp_to_generic(mrb_state *mrb, mrb_value src, fiddle_generic *dst)
+{
+    dst->pointer = mrb_fiddle_value_to_cptr(mrb, src);
+}
+
+/*
+ * A String is passed as its own buffer.  Only a String sharing the
+ * buffer of another one may lack the NUL right after its bytes; it is
+ * then passed as a terminated copy, which the GC arena keeps alive.
+ */
+static void
+const_string_to_generic(mrb_state *mrb, mrb_value src, fiddle_generic *dst)
+{
+    if (mrb_string_p(src)) {
+    	if (RSTRING_PTR(src)[RSTRING_LEN(src)] == '\0') {
+    	    dst->pointer = RSTRING_PTR(src);
+    	} else {
+    	    dst->pointer = mrb_str_to_cstr(mrb, src);
+    	}
+    	return;
+    }
+    dst->pointer = mrb_fiddle_value_to_cptr(mrb, src);
+}
+
+/*
+ * A String the C function writes into is passed as its own buffer after
+ * making it writable; the caller sets its length once the call is done.
+ */
+static void
+string_buffer_to_generic(mrb_state *mrb, mrb_value src, fiddle_generic *dst)
+{
+    if (!mrb_string_p(src)) {
+    	mrb_raisef(mrb, E_TYPE_ERROR, "expected a String buffer, got %S", src);
+    }
+    mrb_str_modify(mrb, mrb_str_ptr(src));
+    dst->pointer = RSTRING_PTR(src);
+}
+
+/* structs are passed by address; the frame hands libffi the bytes behind it */
+static void
+struct_to_generic(mrb_state *mrb, mrb_value src, fiddle_generic *dst)
+{
+    dst->pointer = mrb_fiddle_value_to_cptr(mrb, src);
+    if (!dst->pointer) {
+    	mrb_raise(mrb, E_ARGUMENT_ERROR, "NULL struct passed by value");
+    }
+}
+
+static void
+float_to_generic(mrb_state *mrb, mrb_value src, fiddle_generic *dst)
+{
+    dst->ffloat = (float)mrb_float(mrb_Float(mrb, src));
+}
+
+static void
+double_to_generic(mrb_state *mrb, mrb_value src, fiddle_generic *dst)
+{
+    dst->ddouble = (double)mrb_float(mrb_Float(mrb, src));
+}
+
+fiddle_arg_converter
+int_to_arg_converter(mrb_state *mrb, int type)
+{
+    switch (type) {
+      case TYPE_VOID:
+    	return void_to_generic;
+      case TYPE_VOIDP:
+    	return voidp_to_generic;
+      case TYPE_CHAR:
+    	return schar_to_generic;
+      case -TYPE_CHAR:
+    	return uchar_to_generic;
+      case TYPE_SHORT:
+    	return sshort_to_generic;
+      case -TYPE_SHORT:
+    	return ushort_to_generic;
+      case TYPE_INT:
+    	return sint_to_generic;
+      case -TYPE_INT:
+    	return uint_to_generic;
+      case TYPE_LONG:
+    	return slong_to_generic;
+      case -TYPE_LONG:
+    	return ulong_to_generic;
+#if HAVE_LONG_LONG
+      case TYPE_LONG_LONG:
+    	return slong_long_to_generic;
+      case -TYPE_LONG_LONG:
+    	return ulong_long_to_generic;
+#endif
+      case TYPE_FLOAT:
+    	return float_to_generic;
+      case TYPE_DOUBLE:
+    	return double_to_generic;
+      case TYPE_STRUCT:
+    	return struct_to_generic;
+      case TYPE_CONST_STRING:
+    	return const_string_to_generic;
+      case TYPE_STRING_BUFFER:
+    	return string_buffer_to_generic;
+      default:
+	     mrb_raisef(mrb, E_RUNTIME_ERROR, "unknown type %S", mrb_fixnum_value(type));
+    }
+    return NULL;
+}
 
 void
 value_to_generic(mrb_state *mrb, int type, mrb_value src, fiddle_generic * dst)
+{
+    int_to_arg_converter(mrb, type)(mrb, src, dst);
+}
+
+/*
+ * Return value converters.  Integral values narrower than ffi_arg are
+ * widened by libffi, so they are read back through fffi_sarg/fffi_arg.
+ */
+static mrb_value
+generic_to_void(mrb_state *mrb, fiddle_generic retval)
+{
+    return mrb_nil_value();
+}
+
+static mrb_value
+generic_to_voidp(mrb_state *mrb, fiddle_generic retval)
+{
+    return mrb_fiddle_ptr_new(mrb, retval.pointer, 0, NULL);
+}
+
+static mrb_value
+generic_to_const_string(mrb_state *mrb, fiddle_generic retval)
+{
+    return retval.pointer ? mrb_str_new_cstr(mrb, (const char *)retval.pointer) : mrb_nil_value();
+}
+
+static mrb_value
+generic_to_schar(mrb_state *mrb, fiddle_generic retval)
+{
+    return mrb_fixnum_value((signed char)retval.fffi_sarg);
+}
+
+static mrb_value
+generic_to_uchar(mrb_state *mrb, fiddle_generic retval)
+{
+    return mrb_fixnum_value((unsigned char)retval.fffi_arg);
+}
+
+static mrb_value
+generic_to_sshort(mrb_state *mrb, fiddle_generic retval)
+{
+    return mrb_fixnum_value((signed short)retval.fffi_sarg);
+}
+
+static mrb_value
+generic_to_ushort(mrb_state *mrb, fiddle_generic retval)
+{
+    return mrb_fixnum_value((unsigned short)retval.fffi_arg);
+}
+
+static mrb_value
+generic_to_sint(mrb_state *mrb, fiddle_generic retval)
+{
+    return mrb_fixnum_value((signed int)retval.fffi_sarg);
+}
+
+static mrb_value
+generic_to_uint(mrb_state *mrb, fiddle_generic retval)
+{
+    return mrb_fixnum_value((unsigned int)retval.fffi_arg);
+}
+
+static mrb_value
+generic_to_slong(mrb_state *mrb, fiddle_generic retval)
+{
+    return mrb_fixnum_value(retval.slong);
+}
+
+static mrb_value
+generic_to_ulong(mrb_state *mrb, fiddle_generic retval)
+{
+    return mrb_fixnum_value(retval.ulong);
+}
+
+#if HAVE_LONG_LONG
+static mrb_value
+generic_to_slong_long(mrb_state *mrb, fiddle_generic retval)
+{
+    return mrb_fixnum_value(retval.slong_long);
+}
+
+static mrb_value
+generic_to_ulong_long(mrb_state *mrb, fiddle_generic retval)
+{
+    return mrb_fixnum_value(retval.ulong_long);
+}
+#endif
+
+static mrb_value
+generic_to_float(mrb_state *mrb, fiddle_generic retval)
+{
+    return mrb_float_value(mrb, retval.ffloat);
+}
+
+static mrb_value
+generic_to_double(mrb_state *mrb, fiddle_generic retval)
+{
+    return mrb_float_value(mrb, retval.ddouble);
+}
+
+fiddle_ret_converter
+int_to_ret_converter(mrb_state *mrb, int type)
+{
+    switch (type) {
+      case TYPE_VOID:
+    	return generic_to_void;
+      case TYPE_VOIDP:
+    	return generic_to_voidp;
+      case TYPE_CONST_STRING:
+    	return generic_to_const_string;
+      case TYPE_CHAR:
+    	return generic_to_schar;
+      case -TYPE_CHAR:
+    	return generic_to_uchar;
+      case TYPE_SHORT:
+    	return generic_to_sshort;
+      case -TYPE_SHORT:
+    	return generic_to_ushort;
+      case TYPE_INT:
+    	return generic_to_sint;
+      case -TYPE_INT:
+    	return generic_to_uint;
+      case TYPE_LONG:
+    	return generic_to_slong;
+      case -TYPE_LONG:
+    	return generic_to_ulong;
+#if HAVE_LONG_LONG
+      case TYPE_LONG_LONG:
+    	return generic_to_slong_long;
+      case -TYPE_LONG_LONG:
+    	return generic_to_ulong_long;
+#endif
+      case TYPE_FLOAT:
+    	return generic_to_float;
+      case TYPE_DOUBLE:
+    	return generic_to_double;
+      default:
+	     mrb_raisef(mrb, E_RUNTIME_ERROR, "unknown type %S", mrb_fixnum_value(type));
+    }
+    return NULL;
+}
+
+mrb_value
+generic_to_value(mrb_state *mrb, mrb_value rettype, fiddle_generic retval)
+{
+    return int_to_ret_converter(mrb, mrb_int(mrb, rettype))(mrb, retval);
+}
+
+/*
+ * Stores a return value into +dst+ with the width of +type+, undoing the
+ * ffi_arg widening libffi applies to small integral results.
+ */
+void
+generic_to_memory(mrb_state *mrb, int type, const fiddle_generic *retval, void *dst)
 {
     switch (type) {
       case TYPE_VOID:
     	break;
       case TYPE_VOIDP:
-    	dst->pointer = mrb_fiddle_ptr_to_cptr(mrb, src);
+      case TYPE_CONST_STRING:
+    	*(void **)dst = retval->pointer;
     	break;
       case TYPE_CHAR:
-    	dst->schar = (signed char)mrb_int(mrb, src);
-    	break;
       case -TYPE_CHAR:
-    	dst->uchar = (unsigned char)mrb_int(mrb, src);
+    	*(unsigned char *)dst = (unsigned char)retval->fffi_arg;
     	break;
       case TYPE_SHORT:
-    	dst->sshort = (unsigned short)mrb_int(mrb, src);
-    	break;
       case -TYPE_SHORT:
-    	dst->sshort = (signed short)mrb_int(mrb, src);
+    	*(unsigned short *)dst = (unsigned short)retval->fffi_arg;
     	break;
       case TYPE_INT:
-    	dst->sint = (signed int)mrb_int(mrb, src);
-    	break;
       case -TYPE_INT:
-    	dst->uint = (unsigned int)mrb_int(mrb, src);
+    	*(unsigned int *)dst = (unsigned int)retval->fffi_arg;
     	break;
       case TYPE_LONG:
-    	dst->slong = (signed long)mrb_int(mrb, src);
-    	break;
       case -TYPE_LONG:
-    	dst->ulong = (unsigned long)mrb_int(mrb, src);
+    	*(unsigned long *)dst = retval->ulong;
     	break;
 #if HAVE_LONG_LONG
       case TYPE_LONG_LONG:
-    	dst->slong_long = (signed LONG_LONG)mrb_int(mrb, src);
-    	break;
       case -TYPE_LONG_LONG:
-    	dst->ulong_long = (unsigned LONG_LONG)mrb_int(mrb, src);
+    	*(unsigned LONG_LONG *)dst = retval->ulong_long;
     	break;
 #endif
       case TYPE_FLOAT:
-    	dst->ffloat = (float)mrb_float(mrb_Float(mrb, src));
+    	*(float *)dst = retval->ffloat;
     	break;
       case TYPE_DOUBLE:
-    	dst->ddouble = (double)mrb_float(mrb_Float(mrb, src));
+    	*(double *)dst = retval->ddouble;
     	break;
       default:
 	     mrb_raisef(mrb, E_RUNTIME_ERROR, "unknown type %S", mrb_fixnum_value(type));
     }
 }
 
+/* Reads a value of +type+ stored at its native width at +src+. */
 mrb_value
-generic_to_value(mrb_state *mrb, mrb_value rettype, fiddle_generic retval)
+memory_to_value(mrb_state *mrb, int type, const void *src)
 {
-    int type = mrb_int(mrb, rettype);
-
     switch (type) {
-      case TYPE_VOID:
-    	return mrb_nil_value();
       case TYPE_VOIDP:
-        return mrb_funcall(mrb, mrb_obj_value(cPointer), "[]",
-            1, mrb_cptr_value(mrb, (void *)retval.pointer));
+    	return mrb_fiddle_ptr_new(mrb, *(void * const *)src, 0, NULL);
+      case TYPE_CONST_STRING:
+    	return *(char * const *)src ? mrb_str_new_cstr(mrb, *(char * const *)src) : mrb_nil_value();
       case TYPE_CHAR:
-    	return mrb_fixnum_value((signed char)retval.fffi_sarg);
+    	return mrb_fixnum_value(*(const signed char *)src);
       case -TYPE_CHAR:
-    	return mrb_fixnum_value((unsigned char)retval.fffi_arg);
+    	return mrb_fixnum_value(*(const unsigned char *)src);
       case TYPE_SHORT:
-    	return mrb_fixnum_value((signed short)retval.fffi_sarg);
+    	return mrb_fixnum_value(*(const signed short *)src);
       case -TYPE_SHORT:
-    	return mrb_fixnum_value((unsigned short)retval.fffi_arg);
+    	return mrb_fixnum_value(*(const unsigned short *)src);
       case TYPE_INT:
-    	return mrb_fixnum_value((signed int)retval.fffi_sarg);
+    	return mrb_fixnum_value(*(const signed int *)src);
       case -TYPE_INT:
-    	return mrb_fixnum_value((unsigned int)retval.fffi_arg);
+    	return mrb_fixnum_value(*(const unsigned int *)src);
       case TYPE_LONG:
-    	return mrb_fixnum_value(retval.slong);
+    	return mrb_fixnum_value(*(const signed long *)src);
       case -TYPE_LONG:
-    	return mrb_fixnum_value(retval.ulong);
+    	return mrb_fixnum_value(*(const unsigned long *)src);
 #if HAVE_LONG_LONG
       case TYPE_LONG_LONG:
-    	return mrb_fixnum_value(retval.slong_long);
+    	return mrb_fixnum_value(*(const signed LONG_LONG *)src);
       case -TYPE_LONG_LONG:
-    	return mrb_fixnum_value(retval.ulong_long);
+    	return mrb_fixnum_value(*(const unsigned LONG_LONG *)src);
 #endif
       case TYPE_FLOAT:
-    	return mrb_float_value(mrb, retval.ffloat);
+    	return mrb_float_value(mrb, *(const float *)src);
       case TYPE_DOUBLE:
-    	return mrb_float_value(mrb, retval.ddouble);
+    	return mrb_float_value(mrb, *(const double *)src);
       default:
 	     mrb_raisef(mrb, E_RUNTIME_ERROR, "unknown type %S", mrb_fixnum_value(type));
     }
-
     return mrb_nil_value();
 }
 
@@ -24,9 +24,16 @@ typedef union
     void * pointer;        /* ffi_type_pointer */
 } fiddle_generic;
 
+typedef void (*fiddle_arg_converter)(mrb_state *mrb, mrb_value src, fiddle_generic *dst);
+typedef mrb_value (*fiddle_ret_converter)(mrb_state *mrb, fiddle_generic retval);
+
 ffi_type * int_to_ffi_type(mrb_state *mrb, int type);
+fiddle_arg_converter int_to_arg_converter(mrb_state *mrb, int type);
+fiddle_ret_converter int_to_ret_converter(mrb_state *mrb, int type);
 void value_to_generic(mrb_state *mrb, int type, mrb_value src, fiddle_generic * dst);
 mrb_value generic_to_value(mrb_state *mrb, mrb_value rettype, fiddle_generic retval);
+void generic_to_memory(mrb_state *mrb, int type, const fiddle_generic *retval, void *dst);
+mrb_value memory_to_value(mrb_state *mrb, int type, const void *src);
 
 #define VALUE2GENERIC(_mrb, _type, _src, _dst) value_to_generic((_mrb), (_type), (_src), (_dst))
 #define INT2FFI_TYPE(_mrb, _type) int_to_ffi_type((_mrb), (_type))
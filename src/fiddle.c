@@ -1,4 +1,6 @@
 #include "fiddle.h"
+#include "function.h"
+#include "async.h"
 
 struct RClass *cFiddle;
 struct RClass *cFiddleError;
@@ -7,8 +9,80 @@ extern void mrb_fiddle_pointer_init(mrb_state *mrb);
 extern void mrb_fiddle_function_init(mrb_state *mrb);
 extern void mrb_fiddle_handle_init(mrb_state *mrb);
 extern void mrb_fiddle_closure_init(mrb_state *mrb);
+extern void mrb_fiddle_native_closure_init(mrb_state *mrb);
+extern void mrb_fiddle_struct_type_init(mrb_state *mrb);
+extern void mrb_fiddle_future_init(mrb_state *mrb);
+extern void mrb_fiddle_profile_init(mrb_state *mrb);
+#if defined(FIDDLE_ASYNC)
+extern void fiddle_callq_free(mrb_state *mrb, fiddle_state *state);
+#endif
+#if defined(FIDDLE_BENCH)
+extern void mrb_fiddle_bench_init(mrb_state *mrb);
+#endif
 extern void mrb_fiddle_memory_trace_init(mrb_state *mrb);
 
+fiddle_state *
+mrb_fiddle_state(mrb_state *mrb)
+{
+    mrb_value state = mrb_iv_get(mrb, mrb_obj_value(cFiddle), mrb_intern_lit(mrb, "__fiddle_state__"));
+    return (fiddle_state *)mrb_cptr(state);
+}
+
+/*
+ * call-seq: Fiddle.last_error => Integer
+ *
+ * Returns the errno saved after the last call of a Fiddle::Function that
+ * captures it.
+ */
+static mrb_value
+mrb_fiddle_s_last_error(mrb_state *mrb, mrb_value self)
+{
+    return mrb_fixnum_value(mrb_fiddle_state(mrb)->last_error);
+}
+
+/*
+ * call-seq: Fiddle.last_error = errno
+ *
+ * Overwrites the saved errno.
+ */
+static mrb_value
+mrb_fiddle_s_set_last_error(mrb_state *mrb, mrb_value self)
+{
+    mrb_int err;
+
+    mrb_get_args(mrb, "i", &err);
+    mrb_fiddle_state(mrb)->last_error = (int)err;
+    return mrb_fixnum_value(err);
+}
+
+#if defined(_WIN32)
+/*
+ * call-seq: Fiddle.win32_last_error => Integer
+ *
+ * Returns the last win32 error saved after a foreign call.
+ */
+static mrb_value
+mrb_fiddle_s_win32_last_error(mrb_state *mrb, mrb_value self)
+{
+    return mrb_fixnum_value(mrb_fiddle_state(mrb)->win32_last_error);
+}
+
+/*
+ * call-seq: Fiddle.win32_last_error = error
+ *
+ * Overwrites the saved win32 error.
+ */
+static mrb_value
+mrb_fiddle_s_set_win32_last_error(mrb_state *mrb, mrb_value self)
+{
+    mrb_int err;
+
+    mrb_get_args(mrb, "i", &err);
+    mrb_fiddle_state(mrb)->win32_last_error = (int)err;
+    return mrb_fixnum_value(err);
+}
+#endif
+
 /*
  * call-seq: Fiddle.malloc(size)
  *
@@ -85,6 +159,33 @@ mrb_fiddle_free(mrb_state *mrb, mrb_value self)
     return mrb_nil_value();
 }
 
+/*
+ * call-seq: Fiddle.string_buffer(capacity) => String
+ *
+ * Returns an empty String with room for at least +capacity+ bytes, to be
+ * passed as a TYPE_STRING_BUFFER argument.  The room is zero filled.
+ *
+ *   getcwd = Fiddle::Function.new(libc['getcwd'], [TYPE_STRING_BUFFER, TYPE_SIZE_T], TYPE_VOIDP)
+ *   dir = Fiddle.string_buffer(4096)
+ *   getcwd.call(dir, 4096)
+ *   dir #=> "/home/user"
+ */
+static mrb_value
+mrb_fiddle_string_buffer(mrb_state *mrb, mrb_value self)
+{
+    mrb_value str;
+    mrb_int capa;
+
+    mrb_get_args(mrb, "i", &capa);
+    if (capa < 0) {
+    	mrb_raisef(mrb, E_ARGUMENT_ERROR, "negative buffer capacity %S", mrb_fixnum_value(capa));
+    }
+
+    str = mrb_str_buf_new(mrb, (size_t)capa);
+    memset(RSTRING_PTR(str), 0, (size_t)RSTRING_CAPA(str) + 1);
+    return str;
+}
+
 /*
  * call-seq: Fiddle.dlunwrap(addr)
  *
@@ -139,6 +240,8 @@ mrb_fiddle_value2ptr(mrb_state *mrb, mrb_value self)
 static void
 mrb_fiddle_init(mrb_state *mrb)
 {
+    fiddle_state *state;
+
     /*
      * Document-module: Fiddle
      *
@@ -237,6 +340,55 @@ mrb_fiddle_init(mrb_state *mrb)
      */
     mrb_define_const(mrb, cFiddle, "TYPE_DOUBLE",    mrb_fixnum_value(TYPE_DOUBLE));
 
+    /* Document-const: TYPE_VARIADIC
+     *
+     * C type - the variadic arguments (...) of a function.  Only valid as
+     * the last argument type of a Fiddle::Function.
+     */
+    mrb_define_const(mrb, cFiddle, "TYPE_VARIADIC",  mrb_fixnum_value(TYPE_VARIADIC));
+
+    /* Document-const: TYPE_STRUCT
+     *
+     * C type - a struct passed or returned by value.  Functions and
+     * closures take the CStruct class itself as the type and report this
+     * code for it.
+     */
+    mrb_define_const(mrb, cFiddle, "TYPE_STRUCT",    mrb_fixnum_value(TYPE_STRUCT));
+
+    /* Document-const: TYPE_CONST_STRING
+     *
+     * C type - const char *.  String arguments are passed as their own
+     * NUL terminated buffer without any copy; results are returned as a
+     * new String, or nil for NULL.
+     */
+    mrb_define_const(mrb, cFiddle, "TYPE_CONST_STRING", mrb_fixnum_value(TYPE_CONST_STRING));
+
+    /* Document-const: TYPE_STRING_BUFFER
+     *
+     * C type - char * the function writes into.  The argument is a String
+     * whose buffer is passed as is; after the call its length is set from
+     * the result or from the terminating NUL, see Fiddle.string_buffer.
+     * Function arguments only.
+     */
+    mrb_define_const(mrb, cFiddle, "TYPE_STRING_BUFFER", mrb_fixnum_value(TYPE_STRING_BUFFER));
+
+    /* Document-const: TYPE_OUT
+     *
+     * Added to a scalar type to mark a Function argument as a pointer the
+     * C function writes a value of that type through, e.g.
+     * TYPE_OUT + TYPE_INT for an int *.  The argument is left out of the
+     * call and its value returned after the result.  Use
+     * -(TYPE_OUT + TYPE_INT) for unsigned types.
+     */
+    mrb_define_const(mrb, cFiddle, "TYPE_OUT",       mrb_fixnum_value(TYPE_OUT));
+
+    /* Document-const: TYPE_INOUT
+     *
+     * Like TYPE_OUT, but the argument is passed to the call as the value
+     * the pointed-to scalar starts with.
+     */
+    mrb_define_const(mrb, cFiddle, "TYPE_INOUT",     mrb_fixnum_value(TYPE_INOUT));
+
     /* Document-const: ALIGN_VOIDP
      *
      * The alignment size of a void*
@@ -427,6 +579,20 @@ mrb_fiddle_init(mrb_state *mrb)
     mrb_define_module_function(mrb, cFiddle, "calloc", mrb_fiddle_calloc, MRB_ARGS_REQ(2));
     mrb_define_module_function(mrb, cFiddle, "realloc", mrb_fiddle_realloc, MRB_ARGS_REQ(2));
     mrb_define_module_function(mrb, cFiddle, "free", mrb_fiddle_free, MRB_ARGS_REQ(1));
+    mrb_define_module_function(mrb, cFiddle, "string_buffer", mrb_fiddle_string_buffer, MRB_ARGS_REQ(1));
+
+    state = mrb_calloc(mrb, 1, sizeof(fiddle_state));
+#if defined(FIDDLE_JIT)
+    state->jit_threshold = FIDDLE_JIT_THRESHOLD;
+#endif
+    mrb_iv_set(mrb, mrb_obj_value(cFiddle), mrb_intern_lit(mrb, "__fiddle_state__"),
+        mrb_cptr_value(mrb, state));
+    mrb_define_class_method(mrb, cFiddle, "last_error", mrb_fiddle_s_last_error, MRB_ARGS_NONE());
+    mrb_define_class_method(mrb, cFiddle, "last_error=", mrb_fiddle_s_set_last_error, MRB_ARGS_REQ(1));
+#if defined(_WIN32)
+    mrb_define_class_method(mrb, cFiddle, "win32_last_error", mrb_fiddle_s_win32_last_error, MRB_ARGS_NONE());
+    mrb_define_class_method(mrb, cFiddle, "win32_last_error=", mrb_fiddle_s_set_win32_last_error, MRB_ARGS_REQ(1));
+#endif
 }
 
 extern void
@@ -440,6 +606,13 @@ mrb_mruby_fiddle_gem_init(mrb_state* mrb) {
     mrb_fiddle_function_init(mrb);
     mrb_fiddle_handle_init(mrb);
     mrb_fiddle_closure_init(mrb);
+    mrb_fiddle_native_closure_init(mrb);
+    mrb_fiddle_struct_type_init(mrb);
+    mrb_fiddle_future_init(mrb);
+    mrb_fiddle_profile_init(mrb);
+#if defined(FIDDLE_BENCH)
+    mrb_fiddle_bench_init(mrb);
+#endif
     mrb_fiddle_memory_trace_init(mrb);
     mrb_gc_arena_restore(mrb, 0);
 }
@@ -447,5 +620,14 @@ mrb_mruby_fiddle_gem_init(mrb_state* mrb) {
 void
 mrb_mruby_fiddle_gem_final(mrb_state* mrb) {
   /* finalizer */
+  fiddle_state *state = mrb_fiddle_state(mrb);
+#if defined(FIDDLE_ASYNC)
+  fiddle_pool_free(mrb, state);
+  fiddle_callq_free(mrb, state);
+#endif
+#if defined(FIDDLE_JIT)
+  fiddle_jit_free(mrb, state);
+#endif
+  mrb_free(mrb, state);
 }
 /* vim: set noet sws=4 sw=4: */
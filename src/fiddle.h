@@ -76,6 +76,19 @@
 #endif
 #define TYPE_FLOAT 7
 #define TYPE_DOUBLE 8
+#define TYPE_VARIADIC 9
+#define TYPE_STRUCT 10
+#define TYPE_CONST_STRING 11
+#define TYPE_STRING_BUFFER 12
+
+/*
+ * Out and inout scalar arguments: the flag is added to the magnitude of
+ * the pointed-to type, so -(TYPE_OUT + TYPE_INT) is an unsigned int *.
+ */
+#define TYPE_OUT   0x100
+#define TYPE_INOUT 0x200
+#define FIDDLE_OUT_FLAGS(type) (((type) < 0 ? -(type) : (type)) & (TYPE_OUT | TYPE_INOUT))
+#define FIDDLE_OUT_BASE(type)  ((type) < 0 ? -(-(type) & 0xff) : ((type) & 0xff))
 
 #define ALIGN_OF(type) offsetof(struct {char align_c; type align_x;}, align_x)
 
@@ -90,6 +103,27 @@
 #define ALIGN_FLOAT  ALIGN_OF(float)
 #define ALIGN_DOUBLE ALIGN_OF(double)
 
+/*
+ * Per mrb_state data of the gem, created by mrb_mruby_fiddle_gem_init and
+ * released by mrb_mruby_fiddle_gem_final.
+ */
+typedef struct {
+    int last_error;             /* errno saved after the last foreign call */
+#if defined(_WIN32)
+    int win32_last_error;
+#endif
+    mrb_int jit_threshold;      /* calls before a Function gets a JIT stub, 0 = never */
+    struct fiddle_jit *jit;     /* stub cache and code pages, see jit.c */
+    struct fiddle_pool *pool;   /* call_async workers, see async.c */
+    int profiling;              /* Fiddle.profile, see profile.c */
+    struct fiddle_callq *callq; /* closure calls from other threads, see closure.c */
+    mrb_int gc_step_interval;   /* callbacks between GC steps, 0 = never, see closure.c */
+    mrb_int gc_step_countdown;
+    mrb_int heap_fallbacks;     /* calls whose arguments didn't fit on the stack, see function.c */
+} fiddle_state;
+
+fiddle_state *mrb_fiddle_state(mrb_state *mrb);
+
 #include "memory.h"
 
 #endif
@@ -1,16 +1,302 @@
+#include <stdlib.h>
+#include <stdint.h>
 #include "fiddle.h"
 #include "conversions.h"
+#include "function.h"
+#include "pointer.h"
+#include "struct.h"
+#include "async.h"
 
 struct RClass *cFunction;
 extern struct RClass *cFiddle;
 extern struct RClass *cPointer;
 
+/*
+ * Calls with up to FIDDLE_STACK_ARGS arguments marshal them in an
+ * on-stack block; only wider signatures fall back to the heap.  The heap
+ * block is the buffer of a String only the GC arena references, so an
+ * argument converter raising can't leak it.
+ */
+#ifndef FIDDLE_STACK_ARGS
+#define FIDDLE_STACK_ARGS 8
+#endif
+
+/* Argument storage of one in-flight call. */
+typedef struct {
+    fiddle_generic *args;
+    void **values;
+    fiddle_generic stack_args[FIDDLE_STACK_ARGS];
+    void *stack_values[FIDDLE_STACK_ARGS + 1];
+} fiddle_frame;
+
+static void
+fiddle_frame_init(mrb_state *mrb, mrb_int argc, fiddle_frame *frame)
+{
+    mrb_int i;
+
+    if (argc <= FIDDLE_STACK_ARGS) {
+    	frame->args = frame->stack_args;
+    	frame->values = frame->stack_values;
+    } else {
+    	mrb_value buf = mrb_str_buf_new(mrb, (size_t)(argc + 1) * sizeof(void *) + (size_t)argc * sizeof(fiddle_generic));
+
+    	mrb_fiddle_state(mrb)->heap_fallbacks++;
+    	frame->args = (fiddle_generic *)RSTRING_PTR(buf);
+    	frame->values = (void **)((char *)frame->args + (size_t)argc * sizeof(fiddle_generic));
+    }
+
+    for (i = 0; i < argc; i++) {
+    	frame->values[i] = (void *)&frame->args[i];
+    }
+    frame->values[argc] = NULL;
+}
+
+static void
+fiddle_frame_convert(mrb_state *mrb, fiddle_function *fn, fiddle_frame *frame, const mrb_value *argv)
+{
+    mrb_int i;
+
+    for (i = 0; i < fn->argc; i++) {
+    	fn->arg_converters[i](mrb, argv[i], &frame->args[i]);
+    	if (fn->arg_types[i] == TYPE_STRUCT) frame->values[i] = frame->args[i].pointer;
+    }
+}
+
+/*
+ * Direct callers.
+ *
+ * Signatures made only of int, long, pointer, double and float values and
+ * taking at most four arguments are common enough to get a caller of
+ * their own, which calls the target through a typed function pointer
+ * instead of running libffi's generic argument loop.  A caller is named
+ * after its signature: fiddle_direct_D_DD is double f(double, double).
+ */
+#define FIDDLE_CTYPE_V void
+#define FIDDLE_CTYPE_I int
+#define FIDDLE_CTYPE_L long
+#define FIDDLE_CTYPE_P void *
+#define FIDDLE_CTYPE_D double
+#define FIDDLE_CTYPE_F float
+
+#define FIDDLE_ARG_I(a, n) ((a)[n].sint)
+#define FIDDLE_ARG_L(a, n) ((a)[n].slong)
+#define FIDDLE_ARG_P(a, n) ((a)[n].pointer)
+#define FIDDLE_ARG_D(a, n) ((a)[n].ddouble)
+#define FIDDLE_ARG_F(a, n) ((a)[n].ffloat)
+
+#define FIDDLE_STORE_V(r, call) (call)
+#define FIDDLE_STORE_I(r, call) ((r)->fffi_sarg = (ffi_sarg)(call))
+#define FIDDLE_STORE_L(r, call) ((r)->slong = (call))
+#define FIDDLE_STORE_P(r, call) ((r)->pointer = (call))
+#define FIDDLE_STORE_D(r, call) ((r)->ddouble = (call))
+#define FIDDLE_STORE_F(r, call) ((r)->ffloat = (call))
+
+#define FIDDLE_DIRECT0(R) \
+static void \
+fiddle_direct_##R##_(fiddle_function *f, fiddle_generic *ret, fiddle_generic *a) \
+{ \
+    FIDDLE_STORE_##R(ret, ((FIDDLE_CTYPE_##R (*)(void))f->fn)()); \
+}
+
+#define FIDDLE_DIRECT1(R, A) \
+static void \
+fiddle_direct_##R##_##A(fiddle_function *f, fiddle_generic *ret, fiddle_generic *a) \
+{ \
+    FIDDLE_STORE_##R(ret, ((FIDDLE_CTYPE_##R (*)(FIDDLE_CTYPE_##A))f->fn)( \
+        FIDDLE_ARG_##A(a, 0))); \
+}
+
+#define FIDDLE_DIRECT2(R, A, B) \
+static void \
+fiddle_direct_##R##_##A##B(fiddle_function *f, fiddle_generic *ret, fiddle_generic *a) \
+{ \
+    FIDDLE_STORE_##R(ret, ((FIDDLE_CTYPE_##R (*)(FIDDLE_CTYPE_##A, FIDDLE_CTYPE_##B))f->fn)( \
+        FIDDLE_ARG_##A(a, 0), FIDDLE_ARG_##B(a, 1))); \
+}
+
+#define FIDDLE_DIRECT3(R, A, B, C) \
+static void \
+fiddle_direct_##R##_##A##B##C(fiddle_function *f, fiddle_generic *ret, fiddle_generic *a) \
+{ \
+    FIDDLE_STORE_##R(ret, ((FIDDLE_CTYPE_##R (*)(FIDDLE_CTYPE_##A, FIDDLE_CTYPE_##B, \
+        FIDDLE_CTYPE_##C))f->fn)( \
+        FIDDLE_ARG_##A(a, 0), FIDDLE_ARG_##B(a, 1), FIDDLE_ARG_##C(a, 2))); \
+}
+
+#define FIDDLE_DIRECT4(R, A, B, C, D) \
+static void \
+fiddle_direct_##R##_##A##B##C##D(fiddle_function *f, fiddle_generic *ret, fiddle_generic *a) \
+{ \
+    FIDDLE_STORE_##R(ret, ((FIDDLE_CTYPE_##R (*)(FIDDLE_CTYPE_##A, FIDDLE_CTYPE_##B, \
+        FIDDLE_CTYPE_##C, FIDDLE_CTYPE_##D))f->fn)( \
+        FIDDLE_ARG_##A(a, 0), FIDDLE_ARG_##B(a, 1), FIDDLE_ARG_##C(a, 2), \
+        FIDDLE_ARG_##D(a, 3))); \
+}
+
+/* argument shapes that get a caller, for every return type */
+#define FIDDLE_DIRECT_SHAPES(R, X0, X1, X2, X3, X4) \
+    X0(R) \
+    X1(R, I) X1(R, L) X1(R, P) X1(R, D) X1(R, F) \
+    X2(R, I, I) X2(R, I, L) X2(R, I, P) X2(R, I, D) \
+    X2(R, L, I) X2(R, L, L) X2(R, L, P) X2(R, L, D) \
+    X2(R, P, I) X2(R, P, L) X2(R, P, P) X2(R, P, D) \
+    X2(R, D, I) X2(R, D, L) X2(R, D, P) X2(R, D, D) \
+    X2(R, F, F) \
+    X3(R, I, I, I) X3(R, L, L, L) X3(R, P, P, P) X3(R, D, D, D) X3(R, F, F, F) \
+    X3(R, P, I, I) X3(R, P, P, I) X3(R, P, I, P) X3(R, P, P, L) X3(R, P, L, P) \
+    X3(R, P, L, L) \
+    X4(R, I, I, I, I) X4(R, L, L, L, L) X4(R, P, P, P, P) X4(R, D, D, D, D) \
+    X4(R, P, I, I, I) X4(R, P, P, I, I) X4(R, P, P, P, I) X4(R, P, P, P, L) \
+    X4(R, P, L, L, L)
+
+#define FIDDLE_DIRECT_RETURNS(X0, X1, X2, X3, X4) \
+    FIDDLE_DIRECT_SHAPES(V, X0, X1, X2, X3, X4) \
+    FIDDLE_DIRECT_SHAPES(I, X0, X1, X2, X3, X4) \
+    FIDDLE_DIRECT_SHAPES(L, X0, X1, X2, X3, X4) \
+    FIDDLE_DIRECT_SHAPES(P, X0, X1, X2, X3, X4) \
+    FIDDLE_DIRECT_SHAPES(D, X0, X1, X2, X3, X4) \
+    FIDDLE_DIRECT_SHAPES(F, X0, X1, X2, X3, X4)
+
+FIDDLE_DIRECT_RETURNS(FIDDLE_DIRECT0, FIDDLE_DIRECT1, FIDDLE_DIRECT2, FIDDLE_DIRECT3, FIDDLE_DIRECT4)
+
+#define FIDDLE_ENTRY0(R) { #R "_", fiddle_direct_##R##_ },
+#define FIDDLE_ENTRY1(R, A) { #R "_" #A, fiddle_direct_##R##_##A },
+#define FIDDLE_ENTRY2(R, A, B) { #R "_" #A #B, fiddle_direct_##R##_##A##B },
+#define FIDDLE_ENTRY3(R, A, B, C) { #R "_" #A #B #C, fiddle_direct_##R##_##A##B##C },
+#define FIDDLE_ENTRY4(R, A, B, C, D) { #R "_" #A #B #C #D, fiddle_direct_##R##_##A##B##C##D },
+
+static const struct {
+    const char *signature;
+    fiddle_direct_caller caller;
+} fiddle_direct_table[] = {
+    FIDDLE_DIRECT_RETURNS(FIDDLE_ENTRY0, FIDDLE_ENTRY1, FIDDLE_ENTRY2, FIDDLE_ENTRY3, FIDDLE_ENTRY4)
+};
+
+/* the letter of +type+ in a direct caller signature, 0 if it has none */
+static char
+fiddle_direct_class(int type)
+{
+    switch (type) {
+      case TYPE_VOID:
+    	return 'V';
+      case TYPE_VOIDP:
+      case TYPE_CONST_STRING:
+      case TYPE_STRING_BUFFER:
+    	return 'P';
+      case TYPE_INT:
+      case -TYPE_INT:
+    	return 'I';
+      case TYPE_LONG:
+      case -TYPE_LONG:
+    	return 'L';
+#if HAVE_LONG_LONG
+      case TYPE_LONG_LONG:
+      case -TYPE_LONG_LONG:
+    	return sizeof(LONG_LONG) == sizeof(long) ? 'L' : 0;
+#endif
+      case TYPE_FLOAT:
+    	return 'F';
+      case TYPE_DOUBLE:
+    	return 'D';
+      default:
+    	return 0;
+    }
+}
+
+static fiddle_direct_caller
+fiddle_direct_lookup(fiddle_function *fn)
+{
+    char signature[8];
+    size_t i;
+
+    if (fn->argc > 4 || fn->cif.abi != FFI_DEFAULT_ABI) return NULL;
+
+    signature[0] = fiddle_direct_class(fn->ret_type);
+    signature[1] = '_';
+    for (i = 0; i < (size_t)fn->argc; i++) {
+    	signature[i + 2] = fiddle_direct_class(fn->arg_types[i]);
+    	if (!signature[i + 2] || signature[i + 2] == 'V') return NULL;
+    }
+    signature[i + 2] = '\0';
+    if (!signature[0]) return NULL;
+
+    for (i = 0; i < sizeof(fiddle_direct_table) / sizeof(fiddle_direct_table[0]); i++) {
+    	if (strcmp(fiddle_direct_table[i].signature, signature) == 0) {
+    	    return fiddle_direct_table[i].caller;
+    	}
+    }
+    return NULL;
+}
+
+static inline void
+fiddle_invoke(fiddle_function *fn, fiddle_generic *retval, fiddle_frame *frame)
+{
+    if (fn->direct) {
+    	fn->direct(fn, retval, frame->args);
+    } else {
+    	ffi_call(&fn->cif, FFI_FN(fn->fn), retval, frame->values);
+    }
+}
+
+/*
+ * Copies one row of a packed argument buffer into the frame.  Rows read
+ * from a String need not be aligned for their member types.  A struct
+ * doesn't fit a fiddle_generic, so libffi reads it from the row itself.
+ */
+static void
+fiddle_frame_load_row(fiddle_function *fn, fiddle_frame *frame, const char *row)
+{
+    mrb_int j;
+
+    for (j = 0; j < fn->argc; j++) {
+    	if (fn->arg_types[j] == TYPE_STRUCT) {
+    	    frame->values[j] = (void *)(row + fn->arg_offsets[j]);
+    	} else {
+    	    memcpy(&frame->args[j], row + fn->arg_offsets[j], fn->ffi_arg_types[j]->size);
+    	}
+    }
+}
+
+/* Stores a result packed into +dst+, which need not be aligned. */
+static void
+fiddle_store_result(mrb_state *mrb, fiddle_function *fn, const fiddle_generic *retval, char *dst)
+{
+    fiddle_generic tmp;
+
+    generic_to_memory(mrb, fn->ret_type, retval, &tmp);
+    memcpy(dst, &tmp, fn->ret_size);
+}
+
+static void
+fiddle_function_clear(mrb_state *mrb, fiddle_function *fn)
+{
+    if (fn->var_cifs) {
+    	mrb_int i;
+
+    	for (i = 0; i < FIDDLE_VAR_CIF_CACHE; i++) {
+    	    if (fn->var_cifs[i].var_types) mrb_free(mrb, fn->var_cifs[i].var_types);
+    	    if (fn->var_cifs[i].ffi_types) mrb_free(mrb, fn->var_cifs[i].ffi_types);
+    	}
+    	mrb_free(mrb, fn->var_cifs);
+    	fn->var_cifs = NULL;
+    }
+    if (fn->ffi_arg_types) mrb_free(mrb, fn->ffi_arg_types);
+    if (fn->arg_types) mrb_free(mrb, fn->arg_types);
+    if (fn->arg_converters) mrb_free(mrb, fn->arg_converters);
+    if (fn->arg_offsets) mrb_free(mrb, fn->arg_offsets);
+    fn->ffi_arg_types = NULL;
+    fn->arg_types = NULL;
+    fn->arg_converters = NULL;
+    fn->arg_offsets = NULL;
+}
+
 static void
 mrb_function_free(mrb_state *mrb, void *p)
 {
-    ffi_cif *ptr = p;
-    if (ptr->arg_types) mrb_free(mrb, ptr->arg_types);
-    mrb_free(mrb, ptr);
+    fiddle_function *fn = p;
+    fiddle_function_clear(mrb, fn);
+    if (fn->stats) mrb_free(mrb, fn->stats);
+    mrb_free(mrb, fn);
 }
 
 static const struct mrb_data_type function_data_type = {
@@ -21,51 +307,131 @@ static const struct mrb_data_type function_data_type = {
 static mrb_value
 mrb_fiddle_func_new(mrb_state *mrb)
 {
-    ffi_cif * cif;
+    fiddle_function * fn;
     struct RData *data;
 
-    Data_Make_Struct(mrb, cFunction, ffi_cif, &function_data_type, cif, data);
+    Data_Make_Struct(mrb, cFunction, fiddle_function, &function_data_type, fn, data);
 
     return mrb_obj_value(data);
 }
 
 static mrb_value
 mrb_fiddle_new_function_full(mrb_state *mrb, mrb_value self, mrb_value ptr, mrb_value args,
-    mrb_int ret_type, mrb_int abi, mrb_value name)
+    mrb_value ret_type, mrb_int abi, mrb_value name)
 {
-    ffi_cif * cif;
-    ffi_type **arg_types;
+    fiddle_function * fn;
+    ffi_type *ret_ffi_type;
     ffi_status result;
     mrb_int i, args_len;
+    size_t offset, max_align;
 
     mrb_iv_set(mrb, self, mrb_intern_lit(mrb, "@ptr"), ptr);
     mrb_iv_set(mrb, self, mrb_intern_lit(mrb, "@args"), args);
-    mrb_iv_set(mrb, self, mrb_intern_lit(mrb, "@return_type"), mrb_fixnum_value(ret_type));
+    mrb_iv_set(mrb, self, mrb_intern_lit(mrb, "@return_type"), ret_type);
     mrb_iv_set(mrb, self, mrb_intern_lit(mrb, "@abi"), mrb_fixnum_value(abi));
     mrb_iv_set(mrb, self, mrb_intern_lit(mrb, "@name"), name);
 
-    Data_Get_Struct(mrb, self, &function_data_type, cif);
+    Data_Get_Struct(mrb, self, &function_data_type, fn);
+    fiddle_function_clear(mrb, fn);
 
     args_len = mrb_ary_len(mrb, args);
+    fn->variadic = 0;
+    for (i = 0; i < args_len; i++) {
+    	mrb_value type = mrb_ary_entry(args, i);
+
+    	if (!mrb_fixnum_p(type) || mrb_fixnum(type) != TYPE_VARIADIC) continue;
+    	if (i != args_len - 1) {
+    	    mrb_raise(mrb, E_ARGUMENT_ERROR, "TYPE_VARIADIC must be the last argument type");
+    	}
+    	fn->variadic = 1;
+    	args_len--;
+    }
+
+    fn->fn = mrb_fixnum_p(ptr) ? (void *)mrb_fixnum(ptr) : mrb_cptr(ptr);
+    fn->argc = args_len;
+    fn->state = mrb_fiddle_state(mrb);
+    fn->capture_errno = 1;
+    fn->ffi_arg_types = mrb_calloc(mrb, args_len + 1, sizeof(ffi_type *));
+    fn->arg_types = mrb_calloc(mrb, args_len + 1, sizeof(int));
+    fn->arg_converters = mrb_calloc(mrb, args_len + 1, sizeof(fiddle_arg_converter));
+    fn->arg_offsets = mrb_calloc(mrb, args_len + 1, sizeof(size_t));
 
-    arg_types = mrb_calloc(mrb, args_len + 1, sizeof(ffi_type *));
+    fn->outs = fn->out_only = fn->buffers = 0;
 
+    /* packed rows follow the C struct layout also used by CStructEntity */
+    offset = 0;
+    max_align = 1;
     for (i = 0; i < args_len; i++) {
-        mrb_int type = mrb_fixnum(mrb_ary_entry(args, i));
-        arg_types[i] = INT2FFI_TYPE(mrb, type);
+        mrb_value entry = mrb_ary_entry(args, i);
+        ffi_type *arg_type;
+        int type;
+
+        if (mrb_fixnum_p(entry) && FIDDLE_OUT_FLAGS(mrb_fixnum(entry))) {
+            /* the C function gets a pointer to a value fiddle_call_outs stages */
+            type = (int)mrb_fixnum(entry);
+            if (FIDDLE_OUT_FLAGS(type) == (TYPE_OUT | TYPE_INOUT) || FIDDLE_OUT_BASE(type) == TYPE_VOID
+                || FIDDLE_OUT_BASE(type) == TYPE_VARIADIC || FIDDLE_OUT_BASE(type) == TYPE_STRUCT) {
+                mrb_raisef(mrb, E_ARGUMENT_ERROR, "invalid out argument type %S", entry);
+            }
+            INT2FFI_TYPE(mrb, FIDDLE_OUT_BASE(type));
+            arg_type = &ffi_type_pointer;
+            fn->arg_converters[i] = int_to_arg_converter(mrb, FIDDLE_OUT_BASE(type));
+            fn->outs++;
+            if (FIDDLE_OUT_FLAGS(type) == TYPE_OUT) fn->out_only++;
+        } else {
+            type = mrb_fiddle_type_code(mrb, entry, &arg_type);
+            fn->arg_converters[i] = int_to_arg_converter(mrb, type);
+            if (type == TYPE_STRING_BUFFER) fn->buffers++;
+        }
+
+        fn->arg_types[i] = type;
+        fn->ffi_arg_types[i] = arg_type;
+
+        offset = (offset + arg_type->alignment - 1) / arg_type->alignment * arg_type->alignment;
+        fn->arg_offsets[i] = offset;
+        offset += arg_type->size;
+        if (arg_type->alignment > max_align) max_align = arg_type->alignment;
     }
-    arg_types[args_len] = NULL;
+    fn->ffi_arg_types[args_len] = NULL;
+    fn->row_size = (offset + max_align - 1) / max_align * max_align;
 
-    result = ffi_prep_cif (
-        cif,
-        abi,
-        args_len,
-        INT2FFI_TYPE(mrb, ret_type),
-        arg_types);
+    fn->ret_type = mrb_fiddle_type_code(mrb, ret_type, &ret_ffi_type);
+    /* struct results are wrapped by fiddle_struct_result instead */
+    fn->ret_converter = fn->ret_type == TYPE_STRUCT ? NULL : int_to_ret_converter(mrb, fn->ret_type);
+    fn->ret_size = fn->ret_type == TYPE_VOID ? 0 : ret_ffi_type->size;
+
+    if ((fn->outs > 0 || fn->buffers > 0) && (fn->variadic || fn->ret_type == TYPE_STRUCT)) {
+    	mrb_raise(mrb, E_ARGUMENT_ERROR, "out arguments need fixed arguments and a scalar result");
+    }
+
+    if (fn->variadic) {
+    	/* only keeps abi and rtype; calls prepare a CIF per call shape */
+    	result = ffi_prep_cif_var(&fn->cif, abi, args_len, args_len, ret_ffi_type, fn->ffi_arg_types);
+    	fn->var_cifs = mrb_calloc(mrb, FIDDLE_VAR_CIF_CACHE, sizeof(fiddle_var_cif));
+    	for (i = 0; i < FIDDLE_VAR_CIF_CACHE; i++) fn->var_cifs[i].nvar = -1;
+    	fn->var_next = 0;
+    } else {
+    	result = ffi_prep_cif (
+    	    &fn->cif,
+    	    abi,
+    	    args_len,
+    	    ret_ffi_type,
+    	    fn->ffi_arg_types);
+    }
 
     if (result)
        mrb_raisef(mrb, E_RUNTIME_ERROR, "error creating CIF %S", mrb_fixnum_value(result));
 
+    fn->direct_match = fn->variadic ? NULL : fiddle_direct_lookup(fn);
+    fn->direct = fn->direct_match;
+    fn->jit_code = NULL;
+    fn->jit_countdown = -1;
+#if defined(FIDDLE_JIT)
+    if (!fn->direct && !fn->variadic && fn->state->jit_threshold > 0 && fiddle_jit_supported_p(fn)) {
+    	fn->jit_countdown = fn->state->jit_threshold;
+    }
+#endif
+
     return self;
 }
 
@@ -75,27 +441,27 @@ mrb_fiddle_new_function(mrb_state *mrb, mrb_value ptr, mrb_value args, mrb_int r
     mrb_value self;
 
     self = mrb_fiddle_func_new(mrb);
-    return mrb_fiddle_new_function_full(mrb, self, ptr, args, ret_type, FFI_DEFAULT_ABI, mrb_nil_value());
+    return mrb_fiddle_new_function_full(mrb, self, ptr, args, mrb_fixnum_value(ret_type), FFI_DEFAULT_ABI, mrb_nil_value());
 }
 
 static mrb_value
 mrb_fiddle_func_initialize(mrb_state *mrb, mrb_value self)
 {
-    ffi_cif * cif;
-    mrb_value ptr, args, name = mrb_nil_value();
-    mrb_int ret_type = TYPE_VOID, abi = FFI_DEFAULT_ABI;
+    fiddle_function * fn;
+    mrb_value ptr, args, ret_type = mrb_fixnum_value(TYPE_VOID), name = mrb_nil_value();
+    mrb_int abi = FFI_DEFAULT_ABI;
 
-    mrb_get_args(mrb, "oA|iiS", &ptr, &args, &ret_type, &abi, &name);
+    mrb_get_args(mrb, "oA|oiS", &ptr, &args, &ret_type, &abi, &name);
 
-    cif = (ffi_cif *)DATA_PTR(self);
-    if (cif) {
-        mrb_function_free(mrb, cif);
+    fn = (fiddle_function *)DATA_PTR(self);
+    if (fn) {
+        mrb_function_free(mrb, fn);
     }
     DATA_TYPE(self) = &function_data_type;
     DATA_PTR(self) = NULL;
 
-    cif = mrb_malloc(mrb, sizeof(ffi_cif));
-    DATA_PTR(self) = cif;
+    fn = mrb_calloc(mrb, 1, sizeof(fiddle_function));
+    DATA_PTR(self) = fn;
 
     if (mrb_respond_to(mrb, ptr, mrb_intern_lit(mrb, "to_value"))) {
         ptr = mrb_funcall(mrb, ptr, "to_value", 0, NULL);
@@ -106,60 +472,898 @@ mrb_fiddle_func_initialize(mrb_state *mrb, mrb_value self)
 
 
 
+/*
+ * Calls a function returning a struct by value.  libffi writes the
+ * result straight into malloc'ed memory owned by the returned CStruct.
+ */
 static mrb_value
-mrb_fiddle_func_call(mrb_state *mrb, mrb_value self)
+fiddle_struct_result(mrb_state *mrb, mrb_value self, fiddle_function *fn, ffi_cif *cif, fiddle_frame *frame)
+{
+    void *mem = malloc(fn->ret_size < sizeof(ffi_arg) ? sizeof(ffi_arg) : fn->ret_size);
+
+    if (!mem) mrb_raise(mrb, E_RUNTIME_ERROR, "out of memory for the struct result");
+    ffi_call(cif, FFI_FN(fn->fn), mem, frame->values);
+    fiddle_capture_errno(fn, errno);
+
+    return mrb_fiddle_struct_new(mrb, mrb_iv_get(mrb, self, mrb_intern_lit(mrb, "@return_type")), mem);
+}
+
+/*
+ * Variadic arguments undergo the default argument promotions, which
+ * ffi_prep_cif_var expects to have been applied already.
+ */
+static int
+fiddle_var_promote(mrb_state *mrb, mrb_int type)
+{
+    switch (type) {
+      case TYPE_CHAR:
+      case -TYPE_CHAR:
+      case TYPE_SHORT:
+      case -TYPE_SHORT:
+    	return TYPE_INT;
+      case TYPE_FLOAT:
+    	return TYPE_DOUBLE;
+      case TYPE_VOID:
+      case TYPE_VARIADIC:
+    	mrb_raisef(mrb, E_ARGUMENT_ERROR, "invalid variadic argument type %S", mrb_fixnum_value(type));
+      default:
+    	return (int)type;
+    }
+}
+
+/* Returns the CIF for variadic arguments of +types+, preparing it on a miss. */
+static fiddle_var_cif *
+fiddle_var_cif_lookup(mrb_state *mrb, fiddle_function *fn, const int *types, mrb_int nvar)
+{
+    fiddle_var_cif *var;
+    ffi_status result;
+    mrb_int i;
+
+    for (i = 0; i < FIDDLE_VAR_CIF_CACHE; i++) {
+    	var = &fn->var_cifs[i];
+    	if (var->nvar == nvar && memcmp(var->var_types, types, sizeof(int) * nvar) == 0) {
+    	    return var;
+    	}
+    }
+
+    var = &fn->var_cifs[fn->var_next];
+    fn->var_next = (fn->var_next + 1) % FIDDLE_VAR_CIF_CACHE;
+
+    var->nvar = -1;
+    var->var_types = mrb_realloc(mrb, var->var_types, sizeof(int) * (nvar + 1));
+    var->ffi_types = mrb_realloc(mrb, var->ffi_types, sizeof(ffi_type *) * (fn->argc + nvar + 1));
+    memcpy(var->ffi_types, fn->ffi_arg_types, sizeof(ffi_type *) * fn->argc);
+    for (i = 0; i < nvar; i++) {
+    	var->var_types[i] = types[i];
+    	var->ffi_types[fn->argc + i] = INT2FFI_TYPE(mrb, types[i]);
+    }
+    var->ffi_types[fn->argc + nvar] = NULL;
+
+    result = ffi_prep_cif_var(&var->cif, fn->cif.abi, fn->argc, fn->argc + nvar,
+    	fn->cif.rtype, var->ffi_types);
+    if (result)
+       mrb_raisef(mrb, E_RUNTIME_ERROR, "error creating CIF %S", mrb_fixnum_value(result));
+
+    var->nvar = nvar;
+    return var;
+}
+
+/*
+ * Calls a variadic function.  The fixed arguments are followed by a
+ * type and a value for every variadic argument:
+ *
+ *   printf.call("%d %s\n", Fiddle::TYPE_INT, 1, Fiddle::TYPE_VOIDP, "x")
+ */
+static mrb_value
+fiddle_call_variadic(mrb_state *mrb, mrb_value self, fiddle_function *fn, const mrb_value *argv, mrb_int argc)
 {
-    ffi_cif * cif;
     fiddle_generic retval;
-    fiddle_generic *generic_args;
-    void **values;
-    mrb_value *argv, cfunc, types;
-    mrb_int i, argc, args_len;
+    fiddle_frame frame;
+    fiddle_var_cif *var;
+    int stack_types[FIDDLE_STACK_ARGS], *types = stack_types;
+    mrb_int i, nvar;
 
-    mrb_get_args(mrb, "*", &argv, &argc);
+    if (argc < fn->argc || (argc - fn->argc) % 2 != 0) {
+    	mrb_raisef(mrb, E_ARGUMENT_ERROR,
+    	    "wrong number of arguments (%S for %S fixed arguments and type/value pairs)",
+    	    mrb_fixnum_value(argc), mrb_fixnum_value(fn->argc));
+    }
+    nvar = (argc - fn->argc) / 2;
 
-    cfunc    = mrb_iv_get(mrb, self, mrb_intern_lit(mrb, "@ptr"));
-    types    = mrb_iv_get(mrb, self, mrb_intern_lit(mrb, "@args"));
+    /* like the frame, a wide type list lives in a String so raising can't leak it */
+    if (nvar > FIDDLE_STACK_ARGS) types = (int *)RSTRING_PTR(mrb_str_buf_new(mrb, sizeof(int) * nvar));
+    for (i = 0; i < nvar; i++) {
+    	types[i] = fiddle_var_promote(mrb, mrb_int(mrb, argv[fn->argc + i * 2]));
+    }
+    var = fiddle_var_cif_lookup(mrb, fn, types, nvar);
+
+    fiddle_frame_init(mrb, fn->argc + nvar, &frame);
+    fiddle_frame_convert(mrb, fn, &frame, argv);
+    for (i = 0; i < nvar; i++) {
+    	int_to_arg_converter(mrb, var->var_types[i])(mrb, argv[fn->argc + i * 2 + 1],
+    	    &frame.args[fn->argc + i]);
+    }
+
+    if (fn->ret_type == TYPE_STRUCT) {
+    	return fiddle_struct_result(mrb, self, fn, &var->cif, &frame);
+    }
+    ffi_call(&var->cif, FFI_FN(fn->fn), &retval, frame.values);
+    fiddle_capture_errno(fn, errno);
+
+    return fn->ret_converter(mrb, retval);
+}
+
+/* Batch calls need one fixed argument layout and a scalar result. */
+static void
+fiddle_check_batch(mrb_state *mrb, fiddle_function *fn)
+{
+    if (fn->variadic) {
+    	mrb_raise(mrb, E_ARGUMENT_ERROR, "batch calls of variadic functions are not supported");
+    }
+    if (fn->ret_type == TYPE_STRUCT) {
+    	mrb_raise(mrb, E_ARGUMENT_ERROR, "batch calls of functions returning a struct are not supported");
+    }
+    if (fn->outs || fn->buffers) {
+    	mrb_raise(mrb, E_ARGUMENT_ERROR, "batch calls of functions with out arguments are not supported");
+    }
+}
+
+/*
+ * Sets the length of the TYPE_STRING_BUFFER arguments after a call.
+ * When there is a single buffer and the result is integral, a result
+ * within the buffer's capacity is its length, e.g. the byte count of
+ * read(2) or snprintf(3), and a negative one leaves it empty.  Otherwise
+ * the length is where the C function put the terminating NUL.  The
+ * bytes are never copied.
+ */
+static void
+fiddle_finish_buffers(mrb_state *mrb, fiddle_function *fn, const mrb_value *argv, fiddle_generic *retval)
+{
+    mrb_int i, j, len, capa, ret = 0;
+    int base = fn->ret_type < 0 ? -fn->ret_type : fn->ret_type;
+    int by_ret = 0;
+
+    if (fn->buffers == 1 && base >= TYPE_CHAR && base < TYPE_FLOAT) {
+    	mrb_value v = fn->ret_converter(mrb, *retval);
 
-    args_len = mrb_ary_len(mrb, types);
+    	if (mrb_fixnum_p(v)) {
+    	    ret = mrb_fixnum(v);
+    	    by_ret = 1;
+    	}
+    }
+
+    for (i = j = 0; i < fn->argc; i++) {
+    	mrb_value str;
 
-    if(argc != args_len) {
+    	if (FIDDLE_OUT_FLAGS(fn->arg_types[i]) == TYPE_OUT) continue;
+    	str = argv[j++];
+    	if (fn->arg_types[i] != TYPE_STRING_BUFFER) continue;
+
+    	capa = RSTRING_CAPA(str);
+    	if (by_ret && ret < 0) {
+    	    len = 0;
+    	} else if (by_ret && ret <= capa) {
+    	    len = ret;
+    	} else {
+    	    const char *nul = (const char *)memchr(RSTRING_PTR(str), '\0', (size_t)capa);
+    	    len = nul ? (mrb_int)(nul - RSTRING_PTR(str)) : capa;
+    	}
+    	RSTR_SET_LEN(mrb_str_ptr(str), len);
+    	RSTRING_PTR(str)[len] = '\0';
+    }
+}
+
+/*
+ * Calls a function with out arguments or string buffers.  Out arguments
+ * point into storage of the call itself, on the stack unless there are
+ * more than FIDDLE_STACK_ARGS of them, so a callback calling the same
+ * Function again can't overwrite them.  Their values are returned after
+ * the result:
+ *
+ *   frexp = Function.new(libm['frexp'], [TYPE_DOUBLE, TYPE_OUT + TYPE_INT], TYPE_DOUBLE)
+ *   frexp.call(8.0) #=> [0.5, 4]
+ *
+ * String buffers are written in place, see fiddle_finish_buffers:
+ *
+ *   read = Function.new(libc['read'], [TYPE_INT, TYPE_STRING_BUFFER, TYPE_SIZE_T], TYPE_SSIZE_T)
+ *   buf = Fiddle.string_buffer(4096)
+ *   read.call(fd, buf, 4096) # buf now holds what was read
+ */
+static mrb_value
+fiddle_call_outs(mrb_state *mrb, fiddle_function *fn, const mrb_value *argv, mrb_int argc)
+{
+    fiddle_generic retval, stack_outs[FIDDLE_STACK_ARGS], *outs = stack_outs;
+    fiddle_frame frame;
+    mrb_value result;
+    mrb_int i, j, k;
+
+    if (argc != fn->argc - fn->out_only) {
         mrb_raisef(mrb, E_ARGUMENT_ERROR, "wrong number of arguments (%S for %S)",
-		      mrb_fixnum_value(argc), mrb_fixnum_value(args_len));
+		      mrb_fixnum_value(argc), mrb_fixnum_value(fn->argc - fn->out_only));
     }
 
-    Data_Get_Struct(mrb, self, &function_data_type, cif);
+#if defined(FIDDLE_JIT)
+    if (fn->jit_countdown > 0 && --fn->jit_countdown == 0) {
+    	fiddle_jit_compile(mrb, fn);
+    }
+#endif
 
-    generic_args = mrb_malloc(mrb, (size_t)(argc + 1) * sizeof(void *) + (size_t)argc * sizeof(fiddle_generic));
-    values = (void **)((char *)generic_args + (size_t)argc * sizeof(fiddle_generic));
+    fiddle_frame_init(mrb, fn->argc, &frame);
+    if (fn->outs > FIDDLE_STACK_ARGS) {
+    	outs = (fiddle_generic *)RSTRING_PTR(mrb_str_buf_new(mrb, (size_t)fn->outs * sizeof(fiddle_generic)));
+    }
+    for (i = j = k = 0; i < fn->argc; i++) {
+    	int flags = FIDDLE_OUT_FLAGS(fn->arg_types[i]);
 
-    for (i = 0; i < argc; i++) {
-    	mrb_value type = mrb_ary_entry(types, i);
-    	mrb_value src = argv[i];
-
-    	if(mrb_fixnum(type) == TYPE_VOIDP) {
-    	    if(mrb_nil_p(src)) {
-                src = mrb_cptr_value(mrb, NULL);
-    	    } else if(!mrb_obj_is_instance_of(mrb, src, cPointer)) {
-                src = mrb_funcall(mrb, mrb_obj_value(cPointer), "[]", 1, src);
+    	if (!flags) {
+    	    fn->arg_converters[i](mrb, argv[j++], &frame.args[i]);
+    	    continue;
+    	}
+    	if (flags == TYPE_INOUT) {
+    	    fn->arg_converters[i](mrb, argv[j++], &outs[k]);
+    	} else {
+    	    memset(&outs[k], 0, sizeof(fiddle_generic));
+    	}
+    	frame.args[i].pointer = &outs[k++];
+    }
+
+    fiddle_invoke(fn, &retval, &frame);
+    fiddle_capture_errno(fn, errno);
+
+    if (fn->buffers) {
+    	fiddle_finish_buffers(mrb, fn, argv, &retval);
+    }
+    if (!fn->outs) {
+    	return fn->ret_converter(mrb, retval);
+    }
+
+    result = mrb_ary_new_capa(mrb, fn->outs + 1);
+    if (fn->ret_type != TYPE_VOID) {
+    	mrb_ary_push(mrb, result, fn->ret_converter(mrb, retval));
+    }
+    for (i = k = 0; i < fn->argc; i++) {
+    	if (FIDDLE_OUT_FLAGS(fn->arg_types[i])) {
+    	    mrb_ary_push(mrb, result, memory_to_value(mrb, FIDDLE_OUT_BASE(fn->arg_types[i]), &outs[k++]));
+    	}
+    }
+    return result;
+}
+
+static inline mrb_value
+fiddle_call(mrb_state *mrb, mrb_value self, fiddle_function *fn, const mrb_value *argv, mrb_int argc)
+{
+    fiddle_generic retval;
+    fiddle_frame frame;
+
+    if (fn->variadic) {
+    	return fiddle_call_variadic(mrb, self, fn, argv, argc);
+    }
+    if (fn->outs || fn->buffers) {
+    	return fiddle_call_outs(mrb, fn, argv, argc);
+    }
+
+    if(argc != fn->argc) {
+        mrb_raisef(mrb, E_ARGUMENT_ERROR, "wrong number of arguments (%S for %S)",
+		      mrb_fixnum_value(argc), mrb_fixnum_value(fn->argc));
+    }
+
+#if defined(FIDDLE_JIT)
+    if (fn->jit_countdown > 0 && --fn->jit_countdown == 0) {
+    	fiddle_jit_compile(mrb, fn);
+    }
+#endif
+
+    fiddle_frame_init(mrb, fn->argc, &frame);
+    fiddle_frame_convert(mrb, fn, &frame, argv);
+
+    if (fn->ret_type == TYPE_STRUCT) {
+    	return fiddle_struct_result(mrb, self, fn, &fn->cif, &frame);
+    }
+    fiddle_invoke(fn, &retval, &frame);
+    fiddle_capture_errno(fn, errno);
+
+    return fn->ret_converter(mrb, retval);
+}
+
+/*
+ * Function#call while Fiddle.profile is on.  The time of fixed-arity
+ * calls with a scalar result is split into conversion and native time;
+ * other calls count as native time only.
+ */
+static mrb_value
+fiddle_call_profiled(mrb_state *mrb, mrb_value self, fiddle_function *fn, const mrb_value *argv, mrb_int argc)
+{
+    fiddle_generic retval;
+    fiddle_frame frame;
+    mrb_value result;
+    uint64_t t0, t1, t2, t3;
+
+    if (!fn->stats) fn->stats = mrb_fiddle_profile_register(mrb, self);
+
+    if (fn->variadic || fn->outs || fn->buffers || fn->ret_type == TYPE_STRUCT || argc != fn->argc) {
+    	t0 = fiddle_now_ns();
+    	result = fiddle_call(mrb, self, fn, argv, argc);
+    	t3 = fiddle_now_ns();
+    	fiddle_stats_record(fn->stats, t3 - t0, 0, t3 - t0);
+    	return result;
+    }
+
+#if defined(FIDDLE_JIT)
+    if (fn->jit_countdown > 0 && --fn->jit_countdown == 0) {
+    	fiddle_jit_compile(mrb, fn);
+    }
+#endif
+
+    t0 = fiddle_now_ns();
+    fiddle_frame_init(mrb, fn->argc, &frame);
+    fiddle_frame_convert(mrb, fn, &frame, argv);
+    t1 = fiddle_now_ns();
+    fiddle_invoke(fn, &retval, &frame);
+    fiddle_capture_errno(fn, errno);
+    t2 = fiddle_now_ns();
+    result = fn->ret_converter(mrb, retval);
+    t3 = fiddle_now_ns();
+
+    fiddle_stats_record(fn->stats, t3 - t0, (t1 - t0) + (t3 - t2), t2 - t1);
+    return result;
+}
+
+static mrb_value
+mrb_fiddle_func_call(mrb_state *mrb, mrb_value self)
+{
+    fiddle_function * fn;
+    mrb_value *argv;
+    mrb_int argc;
+
+    mrb_get_args(mrb, "*", &argv, &argc);
+
+    Data_Get_Struct(mrb, self, &function_data_type, fn);
+
+    if (fn->state->profiling) {
+    	return fiddle_call_profiled(mrb, self, fn, argv, argc);
+    }
+    return fiddle_call(mrb, self, fn, argv, argc);
+}
+
+/*
+ * Returns the memory behind a Pointer or String buffer holding +count+
+ * elements of +size+ bytes.  Strings are always bounds checked and, when
+ * +write+ is set, made writable first; a Pointer without a known size is
+ * trusted, like Pointer#[]= does.
+ */
+static char *
+fiddle_batch_buffer(mrb_state *mrb, mrb_value buf, mrb_int count, size_t size, const char *what, int write)
+{
+    size_t need;
+    long len;
+    char *ptr;
+
+    if (size > 0 && (size_t)count > SIZE_MAX / size) {
+    	mrb_raisef(mrb, E_ARGUMENT_ERROR, "%S buffer size overflows (%S elements)",
+    	    mrb_str_new_cstr(mrb, what), mrb_fixnum_value(count));
+    }
+    need = (size_t)count * size;
+
+    if (mrb_string_p(buf)) {
+    	if (write) mrb_str_modify(mrb, mrb_str_ptr(buf));
+    	ptr = RSTRING_PTR(buf);
+    	len = RSTRING_LEN(buf);
+    } else if (mrb_obj_is_kind_of(mrb, buf, cPointer)) {
+    	ptr = mrb_fiddle_ptr_to_cptr(mrb, buf);
+    	len = mrb_fiddle_ptr_size(mrb, buf);
+    	if (!ptr && need > 0) {
+    	    mrb_raisef(mrb, E_ARGUMENT_ERROR, "%S buffer is NULL", mrb_str_new_cstr(mrb, what));
+    	}
+    	if (len <= 0) return ptr;
+    } else {
+    	mrb_raisef(mrb, E_TYPE_ERROR, "%S buffer must be a Fiddle::Pointer or String",
+    	    mrb_str_new_cstr(mrb, what));
+    	return NULL;
+    }
+
+    if ((size_t)len < need) {
+    	mrb_raisef(mrb, E_ARGUMENT_ERROR, "%S buffer too small (%S bytes for %S)",
+    	    mrb_str_new_cstr(mrb, what), mrb_fixnum_value(len), mrb_fixnum_value((mrb_int)need));
+    }
+    return ptr;
+}
+
+/*
+ * call-seq:
+ *    call_many(rows)        => Array
+ *    call_many(rows, out)   => out
+ *
+ * Calls the function once for every argument tuple in +rows+ and returns
+ * the results as an Array.  Rows of a one-argument function may be given
+ * as plain values instead of one-element Arrays.
+ *
+ * When +out+ is a Fiddle::Pointer the results are stored there packed
+ * back to back with the width of the return type instead, and +out+ is
+ * returned.
+ */
+static mrb_value
+mrb_fiddle_func_call_many(mrb_state *mrb, mrb_value self)
+{
+    fiddle_function * fn;
+    fiddle_generic retval;
+    fiddle_frame frame;
+    mrb_value rows, out = mrb_nil_value(), result = mrb_nil_value();
+    mrb_int i, count;
+    char *dst = NULL;
+    int ai, err = 0;
+
+    mrb_get_args(mrb, "A|o", &rows, &out);
+
+    Data_Get_Struct(mrb, self, &function_data_type, fn);
+    fiddle_check_batch(mrb, fn);
+
+    count = mrb_ary_len(mrb, rows);
+    if (mrb_nil_p(out)) {
+    	result = mrb_ary_new_capa(mrb, count);
+    } else {
+    	dst = fiddle_batch_buffer(mrb, out, count, fn->ret_size, "result", 1);
+    }
+
+    fiddle_frame_init(mrb, fn->argc, &frame);
+    ai = mrb_gc_arena_save(mrb);
+
+    for (i = 0; i < count; i++) {
+    	mrb_value row = mrb_ary_entry(rows, i);
+
+    	if (mrb_array_p(row)) {
+    	    if (mrb_ary_len(mrb, row) != fn->argc) {
+    		mrb_raisef(mrb, E_ARGUMENT_ERROR, "wrong number of arguments in row %S (%S for %S)",
+    		    mrb_fixnum_value(i), mrb_fixnum_value(mrb_ary_len(mrb, row)), mrb_fixnum_value(fn->argc));
     	    }
+    	    fiddle_frame_convert(mrb, fn, &frame, RARRAY_PTR(row));
+    	} else if (fn->argc == 1) {
+    	    fiddle_frame_convert(mrb, fn, &frame, &row);
+    	} else {
+    	    mrb_raisef(mrb, E_TYPE_ERROR, "row %S is not an Array", mrb_fixnum_value(i));
+    	}
+
+    	fiddle_invoke(fn, &retval, &frame);
+    	err = errno;
+
+    	if (dst) {
+    	    fiddle_store_result(mrb, fn, &retval, dst);
+    	    dst += fn->ret_size;
+    	} else {
+    	    mrb_ary_push(mrb, result, fn->ret_converter(mrb, retval));
+    	}
+    	mrb_gc_arena_restore(mrb, ai);
+    }
+
+    if (count > 0) fiddle_capture_errno(fn, err);
+
+    return dst ? out : result;
+}
+
+/*
+ * call-seq:
+ *    call_packed(args, count)        => Array
+ *    call_packed(args, count, out)   => out
+ *
+ * Calls the function +count+ times with arguments read straight from the
+ * packed buffer +args+ (a Fiddle::Pointer or a String built with
+ * Array#pack).  Each row is laid out like a C struct whose members are the
+ * argument types, see #row_size.
+ *
+ * Results are returned as an Array, or stored packed into +out+ like
+ * #call_many does.
+ */
+static mrb_value
+mrb_fiddle_func_call_packed(mrb_state *mrb, mrb_value self)
+{
+    fiddle_function * fn;
+    fiddle_generic retval;
+    fiddle_frame frame;
+    mrb_value args, out = mrb_nil_value(), result = mrb_nil_value();
+    mrb_int i, count;
+    char *row, *dst = NULL;
+    int ai, err = 0;
+
+    mrb_get_args(mrb, "oi|o", &args, &count, &out);
+
+    Data_Get_Struct(mrb, self, &function_data_type, fn);
+    fiddle_check_batch(mrb, fn);
+
+    if (count < 0) {
+    	mrb_raisef(mrb, E_ARGUMENT_ERROR, "negative count %S", mrb_fixnum_value(count));
+    }
+    row = fiddle_batch_buffer(mrb, args, count, fn->row_size, "argument", 0);
+    if (mrb_nil_p(out)) {
+    	result = mrb_ary_new_capa(mrb, count);
+    } else {
+    	dst = fiddle_batch_buffer(mrb, out, count, fn->ret_size, "result", 1);
+    }
+
+    fiddle_frame_init(mrb, fn->argc, &frame);
+    ai = mrb_gc_arena_save(mrb);
+
+    for (i = 0; i < count; i++, row += fn->row_size) {
+    	fiddle_frame_load_row(fn, &frame, row);
+    	fiddle_invoke(fn, &retval, &frame);
+    	err = errno;
+
+    	if (dst) {
+    	    fiddle_store_result(mrb, fn, &retval, dst);
+    	    dst += fn->ret_size;
+    	} else {
+    	    mrb_ary_push(mrb, result, fn->ret_converter(mrb, retval));
+    	    mrb_gc_arena_restore(mrb, ai);
+    	}
+    }
+
+    if (count > 0) fiddle_capture_errno(fn, err);
+
+    return dst ? out : result;
+}
+
+#define FIDDLE_MAP1(T) do { \
+    T (*f)(T) = (T (*)(T))fn->fn; \
+    const T *in = (const T *)src; \
+    T *o = (T *)dst; \
+    for (i = 0; i < count; i++) o[i] = f(in[i]); \
+} while (0)
+
+#define FIDDLE_MAP2(T) do { \
+    T (*f)(T, T) = (T (*)(T, T))fn->fn; \
+    const T *in = (const T *)src; \
+    T *o = (T *)dst; \
+    for (i = 0; i < count; i++, in += 2) o[i] = f(in[0], in[1]); \
+} while (0)
+
+/*
+ * true if every argument and the result are +type+, direct calls are
+ * enabled and both buffers are aligned for +size+ byte elements
+ */
+static int
+fiddle_map_typed_p(fiddle_function *fn, int type, size_t size, const char *src, const char *dst)
+{
+    mrb_int i;
+
+    if (!fn->direct || fn->ret_type != type || fn->cif.abi != FFI_DEFAULT_ABI) return 0;
+    if ((uintptr_t)src % size || (uintptr_t)dst % size) return 0;
+    for (i = 0; i < fn->argc; i++) {
+    	if (fn->arg_types[i] != type) return 0;
+    }
+    return 1;
+}
+
+/*
+ * call-seq: map_buffer(input, output, count) => output
+ *
+ * Applies the function to +count+ packed argument rows read from +input+
+ * and stores the packed results into +output+, without creating a single
+ * mruby value per element.  Both buffers are Fiddle::Pointer or String
+ * objects; the input row layout is the one of #call_packed.
+ *
+ *   sin = LibMath['sin']          # double sin(double)
+ *   xs  = Fiddle::Pointer.malloc(Fiddle::SIZEOF_DOUBLE * n)
+ *   ys  = Fiddle::Pointer.malloc(Fiddle::SIZEOF_DOUBLE * n)
+ *   sin.map_buffer(xs, ys, n)
+ *
+ * <tt>double f(double)</tt>, <tt>double f(double, double)</tt>,
+ * <tt>float f(float)</tt> and <tt>float f(float, float)</tt> are called
+ * directly through a typed function pointer while #direct_call? is true
+ * and both buffers are aligned for the type; everything else goes
+ * through the function's regular caller.
+ */
+static mrb_value
+mrb_fiddle_func_map_buffer(mrb_state *mrb, mrb_value self)
+{
+    fiddle_function * fn;
+    fiddle_generic retval;
+    fiddle_frame frame;
+    mrb_value input, output;
+    mrb_int i, count;
+    char *src, *dst;
+
+    mrb_get_args(mrb, "ooi", &input, &output, &count);
+
+    Data_Get_Struct(mrb, self, &function_data_type, fn);
+    fiddle_check_batch(mrb, fn);
+
+    if (fn->ret_type == TYPE_VOID) {
+    	mrb_raise(mrb, E_TYPE_ERROR, "map_buffer needs a function returning a value");
+    }
+    if (count < 0) {
+    	mrb_raisef(mrb, E_ARGUMENT_ERROR, "negative count %S", mrb_fixnum_value(count));
+    }
+    src = fiddle_batch_buffer(mrb, input, count, fn->row_size, "input", 0);
+    dst = fiddle_batch_buffer(mrb, output, count, fn->ret_size, "output", 1);
+    if (count == 0) return output;
+
+    if (fn->argc == 1 && fiddle_map_typed_p(fn, TYPE_DOUBLE, sizeof(double), src, dst)) {
+    	FIDDLE_MAP1(double);
+    } else if (fn->argc == 2 && fiddle_map_typed_p(fn, TYPE_DOUBLE, sizeof(double), src, dst)) {
+    	FIDDLE_MAP2(double);
+    } else if (fn->argc == 1 && fiddle_map_typed_p(fn, TYPE_FLOAT, sizeof(float), src, dst)) {
+    	FIDDLE_MAP1(float);
+    } else if (fn->argc == 2 && fiddle_map_typed_p(fn, TYPE_FLOAT, sizeof(float), src, dst)) {
+    	FIDDLE_MAP2(float);
+    } else {
+    	fiddle_frame_init(mrb, fn->argc, &frame);
+    	for (i = 0; i < count; i++, src += fn->row_size, dst += fn->ret_size) {
+    	    fiddle_frame_load_row(fn, &frame, src);
+    	    fiddle_invoke(fn, &retval, &frame);
+    	    fiddle_store_result(mrb, fn, &retval, dst);
+    	}
+    }
+    fiddle_capture_errno(fn, errno);
+
+    return output;
+}
+
+#undef FIDDLE_MAP1
+#undef FIDDLE_MAP2
+
+/*
+ * call-seq: row_size => Integer
+ *
+ * Size in bytes of one packed argument row used by #call_packed.
+ */
+static mrb_value
+mrb_fiddle_func_row_size(mrb_state *mrb, mrb_value self)
+{
+    fiddle_function * fn;
+
+    Data_Get_Struct(mrb, self, &function_data_type, fn);
+    return mrb_fixnum_value((mrb_int)fn->row_size);
+}
+
+/*
+ * call-seq: capture_errno = bool
+ *
+ * Enables or disables saving errno into Fiddle.last_error after each call
+ * of this function.  Functions that never report errors through errno can
+ * turn it off.
+ */
+static mrb_value
+mrb_fiddle_func_set_capture_errno(mrb_state *mrb, mrb_value self)
+{
+    fiddle_function * fn;
+    mrb_bool capture;
+
+    mrb_get_args(mrb, "b", &capture);
+
+    Data_Get_Struct(mrb, self, &function_data_type, fn);
+    fn->capture_errno = capture;
+    return mrb_bool_value(capture);
+}
+
+/*
+ * call-seq: capture_errno? => true or false
+ *
+ * Returns true if calls of this function save errno.
+ */
+static mrb_value
+mrb_fiddle_func_capture_errno_p(mrb_state *mrb, mrb_value self)
+{
+    fiddle_function * fn;
+
+    Data_Get_Struct(mrb, self, &function_data_type, fn);
+    return mrb_bool_value(fn->capture_errno);
+}
+
+/*
+ * call-seq: direct_call = bool
+ *
+ * Enables or disables the specialized direct caller or JIT stub of this
+ * function.  When disabled every call goes through ffi_call, which is
+ * mostly useful to compare both paths.  Enabling it has no effect on
+ * signatures without a direct caller that have not been compiled yet.
+ */
+static mrb_value
+mrb_fiddle_func_set_direct_call(mrb_state *mrb, mrb_value self)
+{
+    fiddle_function * fn;
+    mrb_bool direct;
+
+    mrb_get_args(mrb, "b", &direct);
+
+    Data_Get_Struct(mrb, self, &function_data_type, fn);
+    fn->direct = direct ? fn->direct_match : NULL;
+    if (!direct) fn->jit_countdown = -1;
+    return mrb_bool_value(direct);
+}
+
+/*
+ * call-seq: direct_call? => true or false
+ *
+ * Returns true if calls of this function bypass ffi_call.
+ */
+static mrb_value
+mrb_fiddle_func_direct_call_p(mrb_state *mrb, mrb_value self)
+{
+    fiddle_function * fn;
+
+    Data_Get_Struct(mrb, self, &function_data_type, fn);
+    return mrb_bool_value(fn->direct != NULL);
+}
+
+#if defined(FIDDLE_ASYNC)
+/*
+ * Returns the object an argument of call_async is converted from.  The
+ * converters may go through temporaries only the GC arena references,
+ * a terminated copy of a const string or the result of #to_ptr; those
+ * are made here instead so that the Future can keep them alive.
+ */
+static mrb_value
+fiddle_async_arg(mrb_state *mrb, int type, mrb_value arg)
+{
+    switch (type) {
+      case TYPE_CONST_STRING:
+    	if (mrb_string_p(arg) && RSTRING_PTR(arg)[RSTRING_LEN(arg)] != '\0') {
+    	    return mrb_str_new(mrb, RSTRING_PTR(arg), RSTRING_LEN(arg));
+    	}
+    	/* fall through */
+      case TYPE_VOIDP:
+      case TYPE_STRUCT:
+    	if (mrb_nil_p(arg) || mrb_string_p(arg) || mrb_cptr_p(arg) || mrb_fixnum_p(arg) ||
+    	    mrb_obj_is_kind_of(mrb, arg, cPointer)) {
+    	    return arg;
     	}
+    	if (mrb_respond_to(mrb, arg, mrb_intern_lit(mrb, "to_ptr"))) {
+    	    return mrb_funcall(mrb, arg, "to_ptr", 0, 0);
+    	}
+    	return arg;
+      default:
+    	return arg;
+    }
+}
+#endif
+
+/*
+ * call-seq: call_async(*args) => Fiddle::Future
+ *
+ * Converts +args+ like #call, then runs the function on a worker thread
+ * and returns a Fiddle::Future for its result, so that C functions that
+ * block don't stall the interpreter.  The Future keeps +args+ alive
+ * until the call completes, together with the terminated String copies
+ * and #to_ptr results they were converted through; Strings and memory
+ * passed by pointer must not be modified meanwhile.
+ *
+ * The function must not call back into mruby, e.g. through a
+ * Fiddle::Closure.  Variadic functions, out arguments and string
+ * buffers are not supported.
+ */
+static mrb_value
+mrb_fiddle_func_call_async(mrb_state *mrb, mrb_value self)
+{
+#if defined(FIDDLE_ASYNC)
+    fiddle_function * fn;
+    fiddle_generic *args;
+    void **values;
+    mrb_value *argv, future, pins;
+    mrb_int i, argc;
+
+    mrb_get_args(mrb, "*", &argv, &argc);
+
+    Data_Get_Struct(mrb, self, &function_data_type, fn);
 
-    	VALUE2GENERIC(mrb, mrb_fixnum(type), src, &generic_args[i]);
-    	values[i] = (void *)&generic_args[i];
+    if (fn->variadic || fn->outs || fn->buffers) {
+    	mrb_raise(mrb, E_ARGUMENT_ERROR, "call_async of variadic functions or with out arguments is not supported");
+    }
+    if (argc != fn->argc) {
+        mrb_raisef(mrb, E_ARGUMENT_ERROR, "wrong number of arguments (%S for %S)",
+		      mrb_fixnum_value(argc), mrb_fixnum_value(fn->argc));
     }
-    values[argc] = NULL;
 
-    ffi_call(cif, mrb_cptr(cfunc), &retval, values);
+    future = mrb_fiddle_future_new(mrb, self, fn, &args, &values);
+    pins = mrb_ary_new_from_values(mrb, argc, argv);
+    for (i = 0; i < argc; i++) {
+    	mrb_value arg = fiddle_async_arg(mrb, fn->arg_types[i], argv[i]);
 
-    mrb_free(mrb, generic_args);
+    	if (!mrb_obj_equal(mrb, arg, argv[i])) mrb_ary_push(mrb, pins, arg);
+    	fn->arg_converters[i](mrb, arg, &args[i]);
+    	if (fn->arg_types[i] == TYPE_STRUCT) values[i] = args[i].pointer;
+    }
+    mrb_fiddle_future_submit(mrb, future, pins);
 
-    mrb_funcall(mrb, mrb_obj_value(cFiddle), "last_error=", 1, mrb_fixnum_value(errno));
-#if defined(_WIN32)
-    mrb_funcall(mrb, mrb_obj_value(cFiddle), "win32_last_error=", 1, mrb_fixnum_value(errno));
+    return future;
+#else
+    mrb_raise(mrb, E_NOTIMP_ERROR, "call_async is not supported on this platform");
+    return mrb_nil_value();
 #endif
+}
+
+/*
+ * call-seq: stats => Hash or nil
+ *
+ * Returns what was recorded for this function while Fiddle.profile was
+ * on, nil if it was never called then:
+ *
+ * :calls      :: number of calls
+ * :total_ns   :: total wall time of the calls
+ * :max_ns     :: the slowest call
+ * :convert_ns :: time spent converting arguments and results
+ * :native_ns  :: time spent inside the C function
+ * :histogram  :: calls by latency, element i counting calls that took
+ *                2**i up to 2**(i+1) nanoseconds
+ */
+static mrb_value
+mrb_fiddle_func_stats(mrb_state *mrb, mrb_value self)
+{
+    fiddle_function * fn;
+
+    Data_Get_Struct(mrb, self, &function_data_type, fn);
+    return fn->stats ? fiddle_stats_to_hash(mrb, fn->stats) : mrb_nil_value();
+}
+
+/*
+ * call-seq: variadic? => true or false
+ *
+ * Returns true if the last argument type of this function is
+ * Fiddle::TYPE_VARIADIC.
+ */
+static mrb_value
+mrb_fiddle_func_variadic_p(mrb_state *mrb, mrb_value self)
+{
+    fiddle_function * fn;
 
-    return GENERIC2VALUE(mrb, mrb_iv_get(mrb, self, mrb_intern_lit(mrb, "@return_type")), retval);
+    Data_Get_Struct(mrb, self, &function_data_type, fn);
+    return mrb_bool_value(fn->variadic);
+}
+
+/*
+ * call-seq: jit? => true or false
+ *
+ * Returns true if calls of this function go through a JIT stub.
+ */
+static mrb_value
+mrb_fiddle_func_jit_p(mrb_state *mrb, mrb_value self)
+{
+    fiddle_function * fn;
+
+    Data_Get_Struct(mrb, self, &function_data_type, fn);
+    return mrb_bool_value(fn->direct != NULL && fn->jit_code != NULL);
+}
+
+/*
+ * call-seq: Fiddle::Function.jit_threshold = calls
+ *
+ * Sets how many calls a Function without a direct caller makes through
+ * ffi_call before a JIT stub is emitted for it.  0 disables the JIT for
+ * Functions created afterwards.  The JIT is only available on x86-64.
+ */
+static mrb_value
+mrb_fiddle_func_s_set_jit_threshold(mrb_state *mrb, mrb_value klass)
+{
+    mrb_int threshold;
+
+    mrb_get_args(mrb, "i", &threshold);
+    if (threshold < 0) {
+    	mrb_raisef(mrb, E_ARGUMENT_ERROR, "negative threshold %S", mrb_fixnum_value(threshold));
+    }
+#if defined(FIDDLE_JIT)
+    mrb_fiddle_state(mrb)->jit_threshold = threshold;
+#endif
+    return mrb_fixnum_value(threshold);
+}
+
+/*
+ * call-seq: Fiddle::Function.jit_threshold => Integer
+ *
+ * Returns the JIT threshold, 0 when the JIT is disabled or unavailable.
+ */
+static mrb_value
+mrb_fiddle_func_s_jit_threshold(mrb_state *mrb, mrb_value klass)
+{
+    return mrb_fixnum_value(mrb_fiddle_state(mrb)->jit_threshold);
+}
+
+/*
+ * call-seq: Fiddle::Function.heap_fallbacks => Integer
+ *
+ * Returns how many calls had more than FIDDLE_STACK_ARGS arguments and
+ * had to marshal them in heap memory instead of on the stack.
+ */
+static mrb_value
+mrb_fiddle_func_s_heap_fallbacks(mrb_state *mrb, mrb_value klass)
+{
+    return mrb_fixnum_value(mrb_fiddle_state(mrb)->heap_fallbacks);
 }
 
 void
@@ -238,9 +1442,72 @@ mrb_fiddle_function_init(mrb_state *mrb)
      *
      * Calls the constructed Function, with +args+
      *
+     * The fixed arguments of a variadic Function are followed by a
+     * Fiddle::TYPE_* and a value for each variadic argument.
+     *
      * For an example see Fiddle::Function
      *
      */
     mrb_define_method(mrb, cFunction, "call", mrb_fiddle_func_call, MRB_ARGS_ANY());
+
+    /*
+     * Document-method: call_async
+     *
+     * Calls the constructed Function on a worker thread
+     *
+     */
+    mrb_define_method(mrb, cFunction, "call_async", mrb_fiddle_func_call_async, MRB_ARGS_ANY());
+
+    /*
+     * Document-method: call_many
+     *
+     * Calls the constructed Function once per argument tuple
+     *
+     */
+    mrb_define_method(mrb, cFunction, "call_many", mrb_fiddle_func_call_many, MRB_ARGS_ARG(1, 1));
+
+    /*
+     * Document-method: call_packed
+     *
+     * Calls the constructed Function over a packed argument buffer
+     *
+     */
+    mrb_define_method(mrb, cFunction, "call_packed", mrb_fiddle_func_call_packed, MRB_ARGS_ARG(2, 1));
+    mrb_define_method(mrb, cFunction, "row_size", mrb_fiddle_func_row_size, MRB_ARGS_NONE());
+
+    /*
+     * Document-method: map_buffer
+     *
+     * Applies a scalar Function over a packed memory region
+     *
+     */
+    mrb_define_method(mrb, cFunction, "map_buffer", mrb_fiddle_func_map_buffer, MRB_ARGS_REQ(3));
+
+    mrb_define_method(mrb, cFunction, "capture_errno=", mrb_fiddle_func_set_capture_errno, MRB_ARGS_REQ(1));
+    mrb_define_method(mrb, cFunction, "capture_errno?", mrb_fiddle_func_capture_errno_p, MRB_ARGS_NONE());
+
+    mrb_define_method(mrb, cFunction, "direct_call=", mrb_fiddle_func_set_direct_call, MRB_ARGS_REQ(1));
+    mrb_define_method(mrb, cFunction, "direct_call?", mrb_fiddle_func_direct_call_p, MRB_ARGS_NONE());
+    mrb_define_method(mrb, cFunction, "stats", mrb_fiddle_func_stats, MRB_ARGS_NONE());
+    mrb_define_method(mrb, cFunction, "variadic?", mrb_fiddle_func_variadic_p, MRB_ARGS_NONE());
+    mrb_define_method(mrb, cFunction, "jit?", mrb_fiddle_func_jit_p, MRB_ARGS_NONE());
+    mrb_define_class_method(mrb, cFunction, "jit_threshold", mrb_fiddle_func_s_jit_threshold, MRB_ARGS_NONE());
+    mrb_define_class_method(mrb, cFunction, "jit_threshold=", mrb_fiddle_func_s_set_jit_threshold, MRB_ARGS_REQ(1));
+
+    /*
+     * Document-method: heap_fallbacks
+     *
+     * Number of calls whose arguments did not fit the on-stack buffer
+     *
+     */
+    mrb_define_class_method(mrb, cFunction, "heap_fallbacks", mrb_fiddle_func_s_heap_fallbacks, MRB_ARGS_NONE());
+
+    /*
+     * Document-const: STACK_ARGS
+     *
+     * Widest arity marshalled without touching the heap
+     *
+     */
+    mrb_define_const(mrb, cFunction, "STACK_ARGS", mrb_fixnum_value(FIDDLE_STACK_ARGS));
 }
 /* vim: set noet sws=4 sw=4: */
@@ -0,0 +1,81 @@
+#ifndef FIDDLE_FUNCTION_H
+#define FIDDLE_FUNCTION_H
+
+#include "fiddle.h"
+#include "conversions.h"
+#include "profile.h"
+
+struct fiddle_function;
+
+/* number of variadic call shapes whose CIF is kept by a Function */
+#ifndef FIDDLE_VAR_CIF_CACHE
+#define FIDDLE_VAR_CIF_CACHE 4
+#endif
+
+/* CIF of a variadic function for one shape of its variadic arguments */
+typedef struct {
+    ffi_cif cif;
+    mrb_int nvar;                           /* variadic argument count, -1 if unused */
+    int *var_types;                         /* promoted TYPE_* code of each of them */
+    ffi_type **ffi_types;                   /* fixed and variadic argument types */
+} fiddle_var_cif;
+
+/*
+ * Calls the function of +fn+ with arguments read from +args+ without
+ * going through libffi, and stores the result into +ret+ the way
+ * ffi_call would.
+ */
+typedef void (*fiddle_direct_caller)(struct fiddle_function *fn, fiddle_generic *ret, fiddle_generic *args);
+
+/*
+ * Native call descriptor of a Fiddle::Function.
+ *
+ * Everything Function#call needs is resolved once by
+ * mrb_fiddle_new_function_full, so the call path never has to look at
+ * the @ptr, @args and @return_type instance variables again.
+ */
+typedef struct fiddle_function {
+    ffi_cif cif;
+    void *fn;                               /* address of the C function */
+    int ret_type;                           /* TYPE_* code of the return value */
+    mrb_int argc;                           /* fixed arguments of a variadic function */
+    int *arg_types;                         /* TYPE_* code of each argument */
+    ffi_type **ffi_arg_types;               /* argument types handed to ffi_prep_cif */
+    fiddle_arg_converter *arg_converters;   /* mruby -> C, one per argument */
+    fiddle_ret_converter ret_converter;     /* C -> mruby for the return value */
+    size_t *arg_offsets;                    /* offset of each argument in a packed row */
+    size_t row_size;                        /* size of one packed argument row */
+    size_t ret_size;                        /* size of the return value in memory */
+    fiddle_direct_caller direct;            /* specialized caller, NULL to use ffi_call */
+    fiddle_direct_caller direct_match;      /* caller matching the signature, if any */
+    void *jit_code;                         /* JIT stub used by a JIT direct caller */
+    mrb_int jit_countdown;                  /* calls left before JIT, -1 if never */
+    mrb_int outs;                           /* TYPE_OUT and TYPE_INOUT arguments */
+    mrb_int out_only;                       /* TYPE_OUT arguments, not passed to #call */
+    mrb_int buffers;                        /* TYPE_STRING_BUFFER arguments */
+    int variadic;                           /* declared with TYPE_VARIADIC last? */
+    fiddle_var_cif *var_cifs;               /* FIDDLE_VAR_CIF_CACHE recent call shapes */
+    mrb_int var_next;                       /* slot of var_cifs replaced next */
+    fiddle_stats *stats;                    /* profile, NULL until first profiled */
+    fiddle_state *state;                    /* where errno is saved after a call */
+    int capture_errno;                      /* save errno after each call? */
+} fiddle_function;
+
+static inline void
+fiddle_capture_errno(fiddle_function *fn, int err)
+{
+    if (fn->capture_errno) {
+    	fn->state->last_error = err;
+#if defined(_WIN32)
+    	fn->state->win32_last_error = err;
+#endif
+    }
+}
+
+#if defined(FIDDLE_JIT)
+int fiddle_jit_supported_p(fiddle_function *fn);
+void fiddle_jit_compile(mrb_state *mrb, fiddle_function *fn);
+void fiddle_jit_free(mrb_state *mrb, fiddle_state *state);
+#endif
+
+#endif
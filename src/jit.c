@@ -0,0 +1,325 @@
+#include "function.h"
+#include "trampoline.h"
+
+#if defined(FIDDLE_JIT)
+
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+/*
+ * x86-64 call stubs for hot Fiddle::Functions.
+ *
+ * A stub is called as stub(args, target): it loads every argument from
+ * the fiddle_generic array into the register the SysV ABI expects and
+ * tail-jumps to +target+, so the C function returns straight to the
+ * JIT caller.  Stubs only depend on the argument types, so Functions
+ * with the same signature share one.
+ *
+ * The code lives in pages of its own that are mapped twice, like the
+ * closure trampolines: stubs are written through a writable view and
+ * called through an executable one, so no stub ever loses PROT_EXEC
+ * while another is installed.  Where no such mapping can be made, a
+ * stub gets a fresh page that is made executable once it is written and
+ * never written again.  Memory from ffi_closure_alloc is not used: with
+ * static trampolines libffi hands out data, not code.
+ */
+
+#define FIDDLE_JIT_INT_REGS 6
+#define FIDDLE_JIT_SSE_REGS 8
+#define FIDDLE_JIT_MAX_ARGS (FIDDLE_JIT_INT_REGS + FIDDLE_JIT_SSE_REGS)
+#define FIDDLE_JIT_STUB_MAX (6 + FIDDLE_JIT_MAX_ARGS * 6 + 2)
+
+typedef struct fiddle_jit_stub {
+    struct fiddle_jit_stub *next;
+    mrb_int argc;
+    int types[FIDDLE_JIT_MAX_ARGS];
+    void *code;
+} fiddle_jit_stub;
+
+typedef struct fiddle_jit_page {
+    struct fiddle_jit_page *next;
+    unsigned char *base;        /* writable view */
+    unsigned char *code;        /* executable view, base if single */
+    size_t size;
+    size_t used;
+} fiddle_jit_page;
+
+struct fiddle_jit {
+    fiddle_jit_stub *stubs;
+    fiddle_jit_page *pages;
+};
+
+static const unsigned char fiddle_jit_int_regs[FIDDLE_JIT_INT_REGS] = {
+    7 /* rdi */, 6 /* rsi */, 2 /* rdx */, 1 /* rcx */, 8 /* r8 */, 9 /* r9 */
+};
+
+#define FIDDLE_JIT_CALLER(R) \
+static void \
+fiddle_jit_call_##R(fiddle_function *f, fiddle_generic *ret, fiddle_generic *a) \
+{ \
+    FIDDLE_JIT_STORE_##R(ret, ((FIDDLE_JIT_CTYPE_##R (*)(fiddle_generic *, void *))f->jit_code)(a, f->fn)); \
+}
+
+#define FIDDLE_JIT_CTYPE_V void
+#define FIDDLE_JIT_CTYPE_I int
+#define FIDDLE_JIT_CTYPE_L long
+#define FIDDLE_JIT_CTYPE_P void *
+#define FIDDLE_JIT_CTYPE_D double
+#define FIDDLE_JIT_CTYPE_F float
+
+#define FIDDLE_JIT_STORE_V(r, call) (call)
+#define FIDDLE_JIT_STORE_I(r, call) ((r)->fffi_sarg = (ffi_sarg)(call))
+#define FIDDLE_JIT_STORE_L(r, call) ((r)->slong = (call))
+#define FIDDLE_JIT_STORE_P(r, call) ((r)->pointer = (call))
+#define FIDDLE_JIT_STORE_D(r, call) ((r)->ddouble = (call))
+#define FIDDLE_JIT_STORE_F(r, call) ((r)->ffloat = (call))
+
+FIDDLE_JIT_CALLER(V)
+FIDDLE_JIT_CALLER(I)
+FIDDLE_JIT_CALLER(L)
+FIDDLE_JIT_CALLER(P)
+FIDDLE_JIT_CALLER(D)
+FIDDLE_JIT_CALLER(F)
+
+/*
+ * The JIT caller for return +type+.  char and short results are read
+ * back truncated by the return converters, so they share the int one.
+ */
+static fiddle_direct_caller
+fiddle_jit_caller(int type)
+{
+    switch (type) {
+      case TYPE_VOID:
+    	return fiddle_jit_call_V;
+      case TYPE_VOIDP:
+      case TYPE_CONST_STRING:
+      case TYPE_STRING_BUFFER:
+    	return fiddle_jit_call_P;
+      case TYPE_CHAR:
+      case -TYPE_CHAR:
+      case TYPE_SHORT:
+      case -TYPE_SHORT:
+      case TYPE_INT:
+      case -TYPE_INT:
+    	return fiddle_jit_call_I;
+      case TYPE_LONG:
+      case -TYPE_LONG:
+#if HAVE_LONG_LONG
+      case TYPE_LONG_LONG:
+      case -TYPE_LONG_LONG:
+#endif
+    	return fiddle_jit_call_L;
+      case TYPE_FLOAT:
+    	return fiddle_jit_call_F;
+      case TYPE_DOUBLE:
+    	return fiddle_jit_call_D;
+      default:
+    	return NULL;
+    }
+}
+
+static int
+fiddle_jit_sse_p(int type)
+{
+    return type == TYPE_FLOAT || type == TYPE_DOUBLE;
+}
+
+int
+fiddle_jit_supported_p(fiddle_function *fn)
+{
+    mrb_int i, ints = 0, sses = 0;
+
+    if (fn->cif.abi != FFI_DEFAULT_ABI) return 0;
+    if (!fiddle_jit_caller(fn->ret_type)) return 0;
+    for (i = 0; i < fn->argc; i++) {
+    	int type = fn->arg_types[i];
+
+    	if (type == TYPE_VOID || !fiddle_jit_caller(type)) return 0;
+    	if (fiddle_jit_sse_p(type)) {
+    	    if (++sses > FIDDLE_JIT_SSE_REGS) return 0;
+    	}
+    	else {
+    	    if (++ints > FIDDLE_JIT_INT_REGS) return 0;
+    	}
+    }
+    return 1;
+}
+
+/* emits the stub for the argument types of +fn+ into +p+, returns its size */
+static size_t
+fiddle_jit_emit(fiddle_function *fn, unsigned char *p)
+{
+    unsigned char *start = p;
+    mrb_int i, ints = 0, sses = 0;
+
+    *p++ = 0x49; *p++ = 0x89; *p++ = 0xfb;    /* mov r11, rdi */
+    *p++ = 0x48; *p++ = 0x89; *p++ = 0xf0;    /* mov rax, rsi */
+
+    for (i = 0; i < fn->argc; i++) {
+    	int type = fn->arg_types[i];
+    	unsigned char reg;
+
+    	if (fiddle_jit_sse_p(type)) {
+    	    reg = (unsigned char)sses++;
+    	    *p++ = type == TYPE_FLOAT ? 0xf3 : 0xf2;      /* movss / movsd */
+    	    *p++ = 0x41;
+    	    *p++ = 0x0f; *p++ = 0x10;
+    	}
+    	else {
+    	    reg = fiddle_jit_int_regs[ints++];
+    	    switch (type) {
+    	      case TYPE_CHAR:
+    	      case -TYPE_CHAR:
+    	      case TYPE_SHORT:
+    	      case -TYPE_SHORT:
+    		/* movsx / movzx r32, byte or word */
+    		*p++ = 0x41 | ((reg & 8) >> 1);
+    		*p++ = 0x0f;
+    		if (type == TYPE_CHAR) *p++ = 0xbe;
+    		else if (type == -TYPE_CHAR) *p++ = 0xb6;
+    		else if (type == TYPE_SHORT) *p++ = 0xbf;
+    		else *p++ = 0xb7;
+    		break;
+    	      case TYPE_INT:
+    	      case -TYPE_INT:
+    		*p++ = 0x41 | ((reg & 8) >> 1);             /* mov r32, dword */
+    		*p++ = 0x8b;
+    		break;
+    	      default:
+    		*p++ = 0x49 | ((reg & 8) >> 1);             /* mov r64, qword */
+    		*p++ = 0x8b;
+    		break;
+    	    }
+    	}
+    	*p++ = 0x40 | ((reg & 7) << 3) | 3;             /* [r11 + disp8] */
+    	*p++ = (unsigned char)(i * sizeof(fiddle_generic));
+    }
+
+    *p++ = 0xff; *p++ = 0xe0;                         /* jmp rax */
+    return (size_t)(p - start);
+}
+
+static int
+fiddle_jit_same_signature_p(fiddle_jit_stub *stub, fiddle_function *fn)
+{
+    mrb_int i;
+
+    if (stub->argc != fn->argc) return 0;
+    for (i = 0; i < fn->argc; i++) {
+    	if (stub->types[i] != fn->arg_types[i]) return 0;
+    }
+    return 1;
+}
+
+static fiddle_jit_page *
+fiddle_jit_page_new(mrb_state *mrb, struct fiddle_jit *jit)
+{
+    fiddle_jit_page *page;
+    size_t page_size = (size_t)sysconf(_SC_PAGESIZE);
+    void *base, *code;
+
+    if (fiddle_trampoline_map_dual(page_size, &base, &code) != 0) {
+    	base = code = mmap(NULL, page_size, PROT_READ | PROT_WRITE,
+    	    MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    	if (base == MAP_FAILED) return NULL;
+    }
+    page = (fiddle_jit_page *)mrb_malloc(mrb, sizeof(fiddle_jit_page));
+    page->base = (unsigned char *)base;
+    page->code = (unsigned char *)code;
+    page->size = page_size;
+    page->used = 0;
+    page->next = jit->pages;
+    jit->pages = page;
+    return page;
+}
+
+/* copies a stub into executable memory, NULL if none can be mapped */
+static void *
+fiddle_jit_install(mrb_state *mrb, struct fiddle_jit *jit, const unsigned char *code, size_t size)
+{
+    fiddle_jit_page *page = jit->pages;
+    void *dst;
+
+    if (!page || page->size - page->used < size) {
+    	page = fiddle_jit_page_new(mrb, jit);
+    	if (!page) return NULL;
+    }
+
+    memcpy(page->base + page->used, code, size);
+    dst = page->code + page->used;
+    if (page->code == page->base) {
+    	/* a single mapping holds this stub only and is sealed right away */
+    	page->used = page->size;
+    	if (mprotect(page->base, page->size, PROT_READ | PROT_EXEC) != 0) return NULL;
+    }
+    else {
+    	/* keep stubs 16-byte aligned */
+    	page->used += (size + 15) & ~(size_t)15;
+    }
+    __builtin___clear_cache((char *)dst, (char *)dst + size);
+    return dst;
+}
+
+void
+fiddle_jit_compile(mrb_state *mrb, fiddle_function *fn)
+{
+    struct fiddle_jit *jit = fn->state->jit;
+    fiddle_jit_stub *stub;
+    unsigned char code[FIDDLE_JIT_STUB_MAX];
+    size_t size;
+
+    fn->jit_countdown = -1;
+    if (!jit) {
+    	jit = (struct fiddle_jit *)mrb_calloc(mrb, 1, sizeof(struct fiddle_jit));
+    	fn->state->jit = jit;
+    }
+
+    for (stub = jit->stubs; stub; stub = stub->next) {
+    	if (fiddle_jit_same_signature_p(stub, fn)) break;
+    }
+
+    if (!stub) {
+    	void *entry;
+
+    	size = fiddle_jit_emit(fn, code);
+    	entry = fiddle_jit_install(mrb, jit, code, size);
+    	if (!entry) return;    /* stay on ffi_call */
+
+    	stub = (fiddle_jit_stub *)mrb_malloc(mrb, sizeof(fiddle_jit_stub));
+    	stub->argc = fn->argc;
+    	memcpy(stub->types, fn->arg_types, sizeof(int) * fn->argc);
+    	stub->code = entry;
+    	stub->next = jit->stubs;
+    	jit->stubs = stub;
+    }
+
+    fn->jit_code = stub->code;
+    fn->direct_match = fiddle_jit_caller(fn->ret_type);
+    fn->direct = fn->direct_match;
+}
+
+void
+fiddle_jit_free(mrb_state *mrb, fiddle_state *state)
+{
+    struct fiddle_jit *jit = state->jit;
+
+    if (!jit) return;
+    while (jit->stubs) {
+    	fiddle_jit_stub *next = jit->stubs->next;
+    	mrb_free(mrb, jit->stubs);
+    	jit->stubs = next;
+    }
+    while (jit->pages) {
+    	fiddle_jit_page *next = jit->pages->next;
+    	if (jit->pages->code != jit->pages->base) munmap(jit->pages->code, jit->pages->size);
+    	munmap(jit->pages->base, jit->pages->size);
+    	mrb_free(mrb, jit->pages);
+    	jit->pages = next;
+    }
+    mrb_free(mrb, jit);
+    state->jit = NULL;
+}
+
+#endif
+/* vim: set noet sws=4 sw=4: */
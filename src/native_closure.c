@@ -0,0 +1,390 @@
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include "fiddle.h"
+#include "conversions.h"
+#include "pointer.h"
+#include "trampoline.h"
+
+struct RClass *cNativeClosure;
+
+extern struct RClass *cFiddle;
+
+/*
+ * Native closures.
+ *
+ * A Fiddle::NativeClosure is a C callback for qsort, bsearch and the
+ * like whose work is described by data instead of a block: which typed
+ * fields to compare, or which field to test against a constant.  Its
+ * trampoline comes from the same pool as those of Fiddle::Closure, but
+ * it runs a C handler that never enters the mrb_state, so it may be
+ * called from any thread and as often as the C library likes.
+ */
+
+#define FIDDLE_NATIVE_COMPARATOR 0      /* int (*)(const void *, const void *) */
+#define FIDDLE_NATIVE_PREDICATE  1      /* int (*)(const void *) */
+
+/* predicate operators */
+#define FIDDLE_NATIVE_EQ 0
+#define FIDDLE_NATIVE_NE 1
+#define FIDDLE_NATIVE_LT 2
+#define FIDDLE_NATIVE_LE 3
+#define FIDDLE_NATIVE_GT 4
+#define FIDDLE_NATIVE_GE 5
+
+/* one field of the elements a native closure looks at */
+typedef struct {
+    int type;                           /* TYPE_* code of the field */
+    size_t offset;                      /* of the field in an element */
+    int descending;                     /* comparators: reverse the order */
+} fiddle_native_key;
+
+typedef struct {
+    fiddle_trampoline *tramp;
+    ffi_cif cif;
+    ffi_type *arg_types[2];
+    int kind;                           /* FIDDLE_NATIVE_COMPARATOR or _PREDICATE */
+    mrb_int nkeys;
+    fiddle_native_key *keys;            /* comparators: by priority */
+    int op;                             /* predicates: FIDDLE_NATIVE_* operator */
+    fiddle_generic value;               /* predicates: the constant */
+} fiddle_native_closure;
+
+static void
+fiddle_native_closure_free(mrb_state *mrb, void *p)
+{
+    fiddle_native_closure *nc = (fiddle_native_closure *)p;
+
+    if (!nc) return;
+    if (nc->tramp) fiddle_trampoline_free(nc->tramp);
+    if (nc->keys) mrb_free(mrb, nc->keys);
+    mrb_free(mrb, nc);
+}
+
+static const struct mrb_data_type native_closure_data_type = {
+    "fiddle/native_closure",
+    fiddle_native_closure_free,
+};
+
+#define FIDDLE_NATIVE_CMP(ctype) \
+    do { \
+    	ctype x = *(ctype const *)a, y = *(ctype const *)b; \
+    	return (x > y) - (x < y); \
+    } while (0)
+
+/* orders two values of +type+ stored at +a+ and +b+ like strcmp */
+static int
+fiddle_native_compare(int type, const void *a, const void *b)
+{
+    switch (type) {
+      case TYPE_CHAR:
+    	FIDDLE_NATIVE_CMP(signed char);
+      case -TYPE_CHAR:
+    	FIDDLE_NATIVE_CMP(unsigned char);
+      case TYPE_SHORT:
+    	FIDDLE_NATIVE_CMP(signed short);
+      case -TYPE_SHORT:
+    	FIDDLE_NATIVE_CMP(unsigned short);
+      case TYPE_INT:
+    	FIDDLE_NATIVE_CMP(signed int);
+      case -TYPE_INT:
+    	FIDDLE_NATIVE_CMP(unsigned int);
+      case TYPE_LONG:
+    	FIDDLE_NATIVE_CMP(signed long);
+      case -TYPE_LONG:
+    	FIDDLE_NATIVE_CMP(unsigned long);
+#if HAVE_LONG_LONG
+      case TYPE_LONG_LONG:
+    	FIDDLE_NATIVE_CMP(signed LONG_LONG);
+      case -TYPE_LONG_LONG:
+    	FIDDLE_NATIVE_CMP(unsigned LONG_LONG);
+#endif
+      case TYPE_FLOAT:
+    	FIDDLE_NATIVE_CMP(float);
+      case TYPE_DOUBLE:
+    	FIDDLE_NATIVE_CMP(double);
+      case TYPE_VOIDP:
+    	FIDDLE_NATIVE_CMP(uintptr_t);
+      case TYPE_CONST_STRING:
+    	{
+    	    const char *x = *(const char * const *)a, *y = *(const char * const *)b;
+
+    	    /* NULL sorts first */
+    	    if (!x || !y) return (x != NULL) - (y != NULL);
+    	    return strcmp(x, y);
+    	}
+      default:
+    	return 0;
+    }
+}
+
+#undef FIDDLE_NATIVE_CMP
+
+static void
+fiddle_native_comparator(ffi_cif *cif, void *resp, void **args, void *user_data)
+{
+    fiddle_native_closure *nc = (fiddle_native_closure *)user_data;
+    const char *a = *(const char **)args[0];
+    const char *b = *(const char **)args[1];
+    int c = 0;
+    mrb_int i;
+
+    for (i = 0; i < nc->nkeys && c == 0; i++) {
+    	const fiddle_native_key *key = &nc->keys[i];
+
+    	c = fiddle_native_compare(key->type, a + key->offset, b + key->offset);
+    	if (key->descending) c = -c;
+    }
+    *(ffi_sarg *)resp = c;
+}
+
+static void
+fiddle_native_predicate(ffi_cif *cif, void *resp, void **args, void *user_data)
+{
+    fiddle_native_closure *nc = (fiddle_native_closure *)user_data;
+    const char *elem = *(const char **)args[0];
+    int c = fiddle_native_compare(nc->keys[0].type, elem + nc->keys[0].offset, &nc->value);
+    int r;
+
+    switch (nc->op) {
+      case FIDDLE_NATIVE_NE: r = c != 0; break;
+      case FIDDLE_NATIVE_LT: r = c < 0; break;
+      case FIDDLE_NATIVE_LE: r = c <= 0; break;
+      case FIDDLE_NATIVE_GT: r = c > 0; break;
+      case FIDDLE_NATIVE_GE: r = c >= 0; break;
+      default: r = c == 0; break;
+    }
+    *(ffi_sarg *)resp = r;
+}
+
+static int
+fiddle_native_key_type(mrb_state *mrb, mrb_value type)
+{
+    int t = (int)mrb_int(mrb, type);
+
+    switch (t) {
+      case TYPE_VOIDP:
+      case TYPE_CONST_STRING:
+      case TYPE_FLOAT:
+      case TYPE_DOUBLE:
+      case TYPE_CHAR: case -TYPE_CHAR:
+      case TYPE_SHORT: case -TYPE_SHORT:
+      case TYPE_INT: case -TYPE_INT:
+      case TYPE_LONG: case -TYPE_LONG:
+#if HAVE_LONG_LONG
+      case TYPE_LONG_LONG: case -TYPE_LONG_LONG:
+#endif
+    	return t;
+      default:
+    	mrb_raisef(mrb, E_ARGUMENT_ERROR, "can't compare values of type %S", type);
+    }
+    return 0;
+}
+
+static mrb_value
+fiddle_native_closure_new(mrb_state *mrb, struct RClass *klass, int kind, mrb_int nkeys)
+{
+    fiddle_native_closure *nc;
+    struct RData *data;
+
+    Data_Make_Struct(mrb, klass, fiddle_native_closure, &native_closure_data_type, nc, data);
+    nc->kind = kind;
+    nc->nkeys = nkeys;
+    nc->keys = (fiddle_native_key *)mrb_calloc(mrb, nkeys, sizeof(fiddle_native_key));
+    return mrb_obj_value(data);
+}
+
+/* builds the trampoline once the keys are known */
+static void
+fiddle_native_closure_prep(mrb_state *mrb, fiddle_native_closure *nc)
+{
+    unsigned int argc = nc->kind == FIDDLE_NATIVE_COMPARATOR ? 2 : 1;
+    int result;
+
+    nc->arg_types[0] = nc->arg_types[1] = &ffi_type_pointer;
+    result = ffi_prep_cif(&nc->cif, FFI_DEFAULT_ABI, argc, &ffi_type_sint, nc->arg_types);
+    if (result != FFI_OK) {
+    	mrb_raisef(mrb, E_RUNTIME_ERROR, "error prepping CIF %S", mrb_fixnum_value(result));
+    }
+
+    nc->tramp = fiddle_trampoline_alloc();
+    if (!nc->tramp) {
+    	mrb_raise(mrb, E_RUNTIME_ERROR, "cannot allocate a closure trampoline");
+    }
+    result = fiddle_trampoline_prep(nc->tramp, &nc->cif,
+        nc->kind == FIDDLE_NATIVE_COMPARATOR ? fiddle_native_comparator : fiddle_native_predicate, nc);
+    if (result < 0) {
+    	mrb_sys_fail(mrb, "mprotect");
+    }
+    if (result != FFI_OK) {
+    	mrb_raisef(mrb, E_RUNTIME_ERROR, "error prepping closure %S", mrb_fixnum_value(result));
+    }
+}
+
+/*
+ * call-seq: Fiddle::NativeClosure.comparator(type)
+ *           Fiddle::NativeClosure.comparator([[type, offset, order], ...])
+ *
+ * Returns an int (*)(const void *, const void *) for qsort and bsearch
+ * that orders the elements its arguments point to by fields of the
+ * given TYPE_* codes at the given byte offsets, the first key first.
+ * +offset+ defaults to 0 and +order+ to :asc; :desc reverses a key.  A
+ * plain type compares whole elements.  TYPE_CONST_STRING fields are
+ * compared with strcmp.
+ *
+ *   # struct { int id; double score; } by score, best first, then id
+ *   cmp = Fiddle::NativeClosure.comparator([[TYPE_DOUBLE, 8, :desc], [TYPE_INT, 0]])
+ *   qsort.call(items, count, 16, cmp)
+ */
+static mrb_value
+mrb_fiddle_native_closure_s_comparator(mrb_state *mrb, mrb_value klass)
+{
+    fiddle_native_closure *nc;
+    mrb_value spec, self;
+    mrb_int i, nkeys;
+
+    mrb_get_args(mrb, "o", &spec);
+
+    if (!mrb_array_p(spec)) spec = mrb_ary_new_from_values(mrb, 1, &spec);
+    nkeys = mrb_ary_len(mrb, spec);
+    if (nkeys == 0) {
+    	mrb_raise(mrb, E_ARGUMENT_ERROR, "a comparator needs at least one key");
+    }
+
+    self = fiddle_native_closure_new(mrb, mrb_class_ptr(klass), FIDDLE_NATIVE_COMPARATOR, nkeys);
+    nc = (fiddle_native_closure *)DATA_PTR(self);
+    for (i = 0; i < nkeys; i++) {
+    	mrb_value key = mrb_ary_entry(spec, i);
+    	mrb_value offset = mrb_fixnum_value(0), order = mrb_nil_value();
+
+    	if (mrb_array_p(key)) {
+    	    if (mrb_ary_len(mrb, key) > 1) offset = mrb_ary_entry(key, 1);
+    	    if (mrb_ary_len(mrb, key) > 2) order = mrb_ary_entry(key, 2);
+    	    key = mrb_ary_entry(key, 0);
+    	}
+    	nc->keys[i].type = fiddle_native_key_type(mrb, key);
+    	nc->keys[i].offset = (size_t)mrb_int(mrb, offset);
+    	if (mrb_nil_p(order) || (mrb_symbol_p(order) && mrb_symbol(order) == mrb_intern_lit(mrb, "asc"))) {
+    	    nc->keys[i].descending = 0;
+    	} else if (mrb_symbol_p(order) && mrb_symbol(order) == mrb_intern_lit(mrb, "desc")) {
+    	    nc->keys[i].descending = 1;
+    	} else {
+    	    mrb_raisef(mrb, E_ARGUMENT_ERROR, "order must be :asc or :desc, not %S", order);
+    	}
+    }
+
+    fiddle_native_closure_prep(mrb, nc);
+    return self;
+}
+
+/*
+ * call-seq: Fiddle::NativeClosure.predicate(type, offset, op, value)
+ *
+ * Returns an int (*)(const void *) that tells whether the field of
+ * +type+ at byte +offset+ of the element its argument points to stands
+ * in relation +op+ (:==, :!=, :<, :<=, :> or :>=) to +value+.
+ *
+ *   positive = Fiddle::NativeClosure.predicate(TYPE_INT, 4, :>, 0)
+ */
+static mrb_value
+mrb_fiddle_native_closure_s_predicate(mrb_state *mrb, mrb_value klass)
+{
+    fiddle_native_closure *nc;
+    mrb_value type, value, self;
+    mrb_int offset;
+    mrb_sym op;
+    int t;
+
+    mrb_get_args(mrb, "oino", &type, &offset, &op, &value);
+
+    t = fiddle_native_key_type(mrb, type);
+    self = fiddle_native_closure_new(mrb, mrb_class_ptr(klass), FIDDLE_NATIVE_PREDICATE, 1);
+    nc = (fiddle_native_closure *)DATA_PTR(self);
+    nc->keys[0].type = t;
+    nc->keys[0].offset = (size_t)offset;
+
+    if (op == mrb_intern_lit(mrb, "==")) nc->op = FIDDLE_NATIVE_EQ;
+    else if (op == mrb_intern_lit(mrb, "!=")) nc->op = FIDDLE_NATIVE_NE;
+    else if (op == mrb_intern_lit(mrb, "<")) nc->op = FIDDLE_NATIVE_LT;
+    else if (op == mrb_intern_lit(mrb, "<=")) nc->op = FIDDLE_NATIVE_LE;
+    else if (op == mrb_intern_lit(mrb, ">")) nc->op = FIDDLE_NATIVE_GT;
+    else if (op == mrb_intern_lit(mrb, ">=")) nc->op = FIDDLE_NATIVE_GE;
+    else mrb_raisef(mrb, E_ARGUMENT_ERROR, "unknown operator %S", mrb_symbol_value(op));
+
+    /*
+     * a string constant is compared in place, so a terminated copy of its
+     * own is kept with the closure; a dup could share an unterminated buffer
+     */
+    if (t == TYPE_CONST_STRING && mrb_string_p(value)) {
+    	value = mrb_str_new(mrb, RSTRING_PTR(value), RSTRING_LEN(value));
+    }
+    int_to_arg_converter(mrb, t)(mrb, value, &nc->value);
+    mrb_iv_set(mrb, self, mrb_intern_lit(mrb, "@value"), value);
+
+    fiddle_native_closure_prep(mrb, nc);
+    return self;
+}
+
+/*
+ * call-seq: to_i
+ *
+ * Returns the memory address of the C function.
+ */
+static mrb_value
+mrb_fiddle_native_closure_to_i(mrb_state *mrb, mrb_value self)
+{
+    fiddle_native_closure *nc;
+
+    Data_Get_Struct(mrb, self, &native_closure_data_type, nc);
+    return mrb_fixnum_value((mrb_int)(intptr_t)nc->tramp->code);
+}
+
+static mrb_value
+mrb_fiddle_native_closure_to_value(mrb_state *mrb, mrb_value self)
+{
+    fiddle_native_closure *nc;
+
+    Data_Get_Struct(mrb, self, &native_closure_data_type, nc);
+    return mrb_cptr_value(mrb, nc->tramp->code);
+}
+
+/*
+ * call-seq: to_ptr
+ *
+ * Returns the C function as a Fiddle::Pointer, so that the closure can
+ * be passed as a pointer argument as is.
+ */
+static mrb_value
+mrb_fiddle_native_closure_to_ptr(mrb_state *mrb, mrb_value self)
+{
+    fiddle_native_closure *nc;
+
+    Data_Get_Struct(mrb, self, &native_closure_data_type, nc);
+    return mrb_fiddle_ptr_new(mrb, nc->tramp->code, 0, NULL);
+}
+
+void
+mrb_fiddle_native_closure_init(mrb_state *mrb)
+{
+    /*
+     * Document-class: Fiddle::NativeClosure
+     *
+     * C callbacks implemented natively, for comparators and predicates
+     * called too often to run Ruby each time.
+     *
+     *   qsort = Fiddle::Function.new(libc['qsort'],
+     *     [TYPE_VOIDP, TYPE_SIZE_T, TYPE_SIZE_T, TYPE_VOIDP], TYPE_VOID)
+     *   qsort.call(ints, count, Fiddle::SIZEOF_INT, Fiddle::NativeClosure.comparator(TYPE_INT))
+     */
+    cNativeClosure = mrb_define_class_under(mrb, cFiddle, "NativeClosure", mrb->object_class);
+    MRB_SET_INSTANCE_TT(cNativeClosure, MRB_TT_DATA);
+    mrb_undef_class_method(mrb, cNativeClosure, "new");
+
+    mrb_define_class_method(mrb, cNativeClosure, "comparator", mrb_fiddle_native_closure_s_comparator, MRB_ARGS_REQ(1));
+    mrb_define_class_method(mrb, cNativeClosure, "predicate", mrb_fiddle_native_closure_s_predicate, MRB_ARGS_REQ(4));
+
+    mrb_define_method(mrb, cNativeClosure, "to_i", mrb_fiddle_native_closure_to_i, MRB_ARGS_NONE());
+    mrb_define_method(mrb, cNativeClosure, "to_value", mrb_fiddle_native_closure_to_value, MRB_ARGS_NONE());
+    mrb_define_method(mrb, cNativeClosure, "to_ptr", mrb_fiddle_native_closure_to_ptr, MRB_ARGS_NONE());
+}
+/* vim: set noet sws=4 sw=4: */
@@ -3,15 +3,17 @@
  */
 
 #include <ctype.h>
+#include <stdint.h>
+#include <string.h>
 #include "fiddle.h"
+#include "conversions.h"
+#include "pointer.h"
 
 struct RClass *cPointer;
 
 extern struct RClass *cFiddle;
 extern struct RClass *cFiddleError;
 
-typedef void (*freefunc_t)(void*);
-
 struct ptr_data {
     void *ptr;
     long size;
@@ -63,7 +65,7 @@ mrb_fiddle_ptr_new2(mrb_state *mrb, struct RClass *klass, void *ptr, long size,
     return val;
 }
 
-static mrb_value
+mrb_value
 mrb_fiddle_ptr_new(mrb_state *mrb, void *ptr, long size, freefunc_t func)
 {
     return mrb_fiddle_ptr_new2(mrb, cPointer, ptr, size, func);
@@ -213,6 +215,51 @@ mrb_fiddle_ptr_to_cptr(mrb_state *mrb, mrb_value self)
     return data->ptr;
 }
 
+long
+mrb_fiddle_ptr_size(mrb_state *mrb, mrb_value self)
+{
+    struct ptr_data *data;
+    Data_Get_Struct(mrb, self, &fiddle_ptr_data_type, data);
+    return data->size;
+}
+
+/*
+ * Returns the address Fiddle::Pointer[val] would wrap, without creating
+ * the Pointer.  Pointers, nil, Strings, C pointers and Integer addresses
+ * are handled directly; anything else must respond to +to_ptr+.
+ */
+void *
+mrb_fiddle_value_to_cptr(mrb_state *mrb, mrb_value val)
+{
+    mrb_value vptr;
+
+    if (mrb_nil_p(val)) {
+    	return NULL;
+    }
+    if (mrb_string_p(val)) {
+    	return mrb_string_value_ptr(mrb, val);
+    }
+    if (mrb_cptr_p(val)) {
+    	return mrb_cptr(val);
+    }
+    if (mrb_fixnum_p(val)) {
+    	return (void *)mrb_fixnum(val);
+    }
+    if (mrb_obj_is_kind_of(mrb, val, cPointer)) {
+    	return RPTR_DATA(val)->ptr;
+    }
+    if (mrb_respond_to(mrb, val, mrb_intern_lit(mrb, "to_ptr"))) {
+    	vptr = mrb_funcall(mrb, val, "to_ptr", 0, 0);
+    	if (mrb_obj_is_kind_of(mrb, vptr, cPointer)) {
+    	    return RPTR_DATA(vptr)->ptr;
+    	}
+    	mrb_raise(mrb, cFiddleError, "to_ptr should return a Fiddle::Pointer object");
+    }
+    mrb_raisef(mrb, E_TYPE_ERROR, "can't convert %S into a pointer",
+        mrb_str_new_cstr(mrb, mrb_obj_classname(mrb, val)));
+    return NULL;
+}
+
 /*
  * call-seq: ptr
  *
@@ -584,6 +631,276 @@ mrb_fiddle_ptr_aset(mrb_state *mrb, mrb_value self)
     return retval;
 }
 
+/*
+ * The +width+ bytes at +offset+ of +self+, checked against the size of
+ * the pointer when it is known.
+ */
+static char *
+fiddle_ptr_at(mrb_state *mrb, mrb_value self, mrb_int offset, size_t width)
+{
+    struct ptr_data *data;
+
+    Data_Get_Struct(mrb, self, &fiddle_ptr_data_type, data);
+    if (!data->ptr) mrb_raise(mrb, cFiddleError, "NULL pointer dereference");
+    if (data->size > 0 &&
+        (offset < 0 || (size_t)offset > (size_t)data->size || width > (size_t)data->size - (size_t)offset)) {
+    	mrb_raisef(mrb, E_INDEX_ERROR, "%S bytes at offset %S exceed the size %S",
+    	    mrb_fixnum_value((mrb_int)width), mrb_fixnum_value(offset), mrb_fixnum_value(data->size));
+    }
+    return (char *)data->ptr + offset;
+}
+
+/*
+ * call-seq:
+ *    ptr.get_i8(offset)          ->  int
+ *    ptr.get_u8(offset)          ->  int
+ *    ptr.get_i16(offset)         ->  int
+ *    ptr.get_u16(offset)         ->  int
+ *    ptr.get_i32(offset)         ->  int
+ *    ptr.get_u32(offset)         ->  int
+ *    ptr.get_i64(offset)         ->  int
+ *    ptr.get_u64(offset)         ->  int
+ *    ptr.get_f32(offset)         ->  float
+ *    ptr.get_f64(offset)         ->  float
+ *    ptr.get_ptr(offset)         ->  Fiddle::Pointer
+ *    ptr.put_i8(offset, value)   ->  value
+ *    ...
+ *    ptr.put_ptr(offset, value)  ->  value
+ *
+ * Reads or writes the value of the given signed, unsigned, floating
+ * point or pointer type stored at byte +offset+ of the memory.  An
+ * IndexError is raised if the value does not lie within #size bytes,
+ * unless the size is 0.  put_ptr takes whatever a TYPE_VOIDP argument
+ * takes.
+ */
+#define FIDDLE_PTR_ACCESSORS(name, ctype, to_value, from_value) \
+static mrb_value \
+mrb_fiddle_ptr_get_##name(mrb_state *mrb, mrb_value self) \
+{ \
+    mrb_int offset; \
+    ctype v; \
+ \
+    mrb_get_args(mrb, "i", &offset); \
+    memcpy(&v, fiddle_ptr_at(mrb, self, offset, sizeof(ctype)), sizeof(ctype)); \
+    return to_value; \
+} \
+ \
+static mrb_value \
+mrb_fiddle_ptr_put_##name(mrb_state *mrb, mrb_value self) \
+{ \
+    mrb_int offset; \
+    mrb_value val; \
+    ctype v; \
+ \
+    mrb_get_args(mrb, "io", &offset, &val); \
+    v = from_value; \
+    memcpy(fiddle_ptr_at(mrb, self, offset, sizeof(ctype)), &v, sizeof(ctype)); \
+    return val; \
+}
+
+#define FIDDLE_PTR_INT_ACCESSORS(name, ctype) \
+    FIDDLE_PTR_ACCESSORS(name, ctype, mrb_fixnum_value((mrb_int)v), (ctype)mrb_int(mrb, val))
+
+FIDDLE_PTR_INT_ACCESSORS(i8, int8_t)
+FIDDLE_PTR_INT_ACCESSORS(u8, uint8_t)
+FIDDLE_PTR_INT_ACCESSORS(i16, int16_t)
+FIDDLE_PTR_INT_ACCESSORS(u16, uint16_t)
+FIDDLE_PTR_INT_ACCESSORS(i32, int32_t)
+FIDDLE_PTR_INT_ACCESSORS(u32, uint32_t)
+FIDDLE_PTR_INT_ACCESSORS(i64, int64_t)
+FIDDLE_PTR_INT_ACCESSORS(u64, uint64_t)
+FIDDLE_PTR_ACCESSORS(f32, float, mrb_float_value(mrb, v), (float)mrb_float(mrb_Float(mrb, val)))
+FIDDLE_PTR_ACCESSORS(f64, double, mrb_float_value(mrb, v), (double)mrb_float(mrb_Float(mrb, val)))
+FIDDLE_PTR_ACCESSORS(ptr, void *, mrb_fiddle_ptr_new(mrb, v, 0, NULL), mrb_fiddle_value_to_cptr(mrb, val))
+
+#undef FIDDLE_PTR_INT_ACCESSORS
+#undef FIDDLE_PTR_ACCESSORS
+
+/*
+ * The width of the elements of +type+ in an array, for
+ * Pointer#read_array and #write_array.
+ */
+static size_t
+fiddle_ptr_element_size(mrb_state *mrb, mrb_int type)
+{
+    switch (type) {
+      case TYPE_CHAR:
+      case -TYPE_CHAR:
+      case TYPE_SHORT:
+      case -TYPE_SHORT:
+      case TYPE_INT:
+      case -TYPE_INT:
+      case TYPE_LONG:
+      case -TYPE_LONG:
+#if HAVE_LONG_LONG
+      case TYPE_LONG_LONG:
+      case -TYPE_LONG_LONG:
+#endif
+      case TYPE_FLOAT:
+      case TYPE_DOUBLE:
+      case TYPE_VOIDP:
+      case TYPE_CONST_STRING:
+    	return int_to_ffi_type(mrb, (int)type)->size;
+      default:
+    	mrb_raisef(mrb, E_ARGUMENT_ERROR, "no arrays of type %S", mrb_fixnum_value(type));
+    	return 0;
+    }
+}
+
+/* the memory of +count+ elements of +size+ bytes at +offset+ of +self+ */
+static char *
+fiddle_ptr_array_at(mrb_state *mrb, mrb_value self, mrb_int offset, mrb_int count, size_t size)
+{
+    if (count < 0) {
+    	mrb_raisef(mrb, E_ARGUMENT_ERROR, "negative count %S", mrb_fixnum_value(count));
+    }
+    if ((size_t)count > SIZE_MAX / size) {
+    	mrb_raisef(mrb, E_ARGUMENT_ERROR, "too many elements: %S", mrb_fixnum_value(count));
+    }
+    return fiddle_ptr_at(mrb, self, offset, (size_t)count * size);
+}
+
+#define FIDDLE_PTR_READ_ARRAY(ctype, to_value) \
+    for (i = 0; i < count; i++) { \
+    	ctype v; \
+ \
+    	memcpy(&v, src + i * sizeof(ctype), sizeof(ctype)); \
+    	mrb_ary_push(mrb, ary, to_value); \
+    	mrb_gc_arena_restore(mrb, ai); \
+    } \
+    break
+
+/*
+ * call-seq: read_array(type, count, offset = 0)  ->  Array
+ *
+ * Returns the +count+ values of +type+, one of the Fiddle::TYPE_*
+ * constants, stored one after the other from byte +offset+ on.
+ * Negative type codes read unsigned values.  Like the typed accessors,
+ * the elements must lie within #size bytes unless the size is 0.
+ *
+ *   samples = buffer.read_array(Fiddle::TYPE_FLOAT, 100_000)
+ */
+static mrb_value
+mrb_fiddle_ptr_read_array(mrb_state *mrb, mrb_value self)
+{
+    mrb_int type, count, offset = 0, i;
+    const char *src;
+    mrb_value ary;
+    int ai;
+
+    mrb_get_args(mrb, "ii|i", &type, &count, &offset);
+    src = fiddle_ptr_array_at(mrb, self, offset, count, fiddle_ptr_element_size(mrb, type));
+
+    ary = mrb_ary_new_capa(mrb, count);
+    ai = mrb_gc_arena_save(mrb);
+    switch (type) {
+      case TYPE_CHAR:
+    	FIDDLE_PTR_READ_ARRAY(signed char, mrb_fixnum_value(v));
+      case -TYPE_CHAR:
+    	FIDDLE_PTR_READ_ARRAY(unsigned char, mrb_fixnum_value(v));
+      case TYPE_SHORT:
+    	FIDDLE_PTR_READ_ARRAY(signed short, mrb_fixnum_value(v));
+      case -TYPE_SHORT:
+    	FIDDLE_PTR_READ_ARRAY(unsigned short, mrb_fixnum_value(v));
+      case TYPE_INT:
+    	FIDDLE_PTR_READ_ARRAY(signed int, mrb_fixnum_value(v));
+      case -TYPE_INT:
+    	FIDDLE_PTR_READ_ARRAY(unsigned int, mrb_fixnum_value(v));
+      case TYPE_LONG:
+    	FIDDLE_PTR_READ_ARRAY(signed long, mrb_fixnum_value(v));
+      case -TYPE_LONG:
+    	FIDDLE_PTR_READ_ARRAY(unsigned long, mrb_fixnum_value(v));
+#if HAVE_LONG_LONG
+      case TYPE_LONG_LONG:
+    	FIDDLE_PTR_READ_ARRAY(signed LONG_LONG, mrb_fixnum_value(v));
+      case -TYPE_LONG_LONG:
+    	FIDDLE_PTR_READ_ARRAY(unsigned LONG_LONG, mrb_fixnum_value(v));
+#endif
+      case TYPE_FLOAT:
+    	FIDDLE_PTR_READ_ARRAY(float, mrb_float_value(mrb, v));
+      case TYPE_DOUBLE:
+    	FIDDLE_PTR_READ_ARRAY(double, mrb_float_value(mrb, v));
+      case TYPE_VOIDP:
+    	FIDDLE_PTR_READ_ARRAY(void *, mrb_fiddle_ptr_new(mrb, v, 0, NULL));
+      case TYPE_CONST_STRING:
+    	FIDDLE_PTR_READ_ARRAY(const char *, v ? mrb_str_new_cstr(mrb, v) : mrb_nil_value());
+      default:
+    	mrb_raisef(mrb, E_ARGUMENT_ERROR, "no arrays of type %S", mrb_fixnum_value(type));
+    }
+    return ary;
+}
+
+#undef FIDDLE_PTR_READ_ARRAY
+
+/* elements are fetched with mrb_ary_ref: converting one may change +ary+ */
+#define FIDDLE_PTR_WRITE_ARRAY(ctype, from_value) \
+    for (i = 0; i < count; i++) { \
+    	mrb_value val = mrb_ary_ref(mrb, ary, i); \
+    	ctype v = from_value; \
+ \
+    	memcpy(dst + i * sizeof(ctype), &v, sizeof(ctype)); \
+    } \
+    break
+
+#define FIDDLE_PTR_WRITE_INT_ARRAY(ctype) FIDDLE_PTR_WRITE_ARRAY(ctype, (ctype)mrb_int(mrb, val))
+
+/*
+ * call-seq: write_array(type, ary, offset = 0)  ->  ary
+ *
+ * Stores the values of +ary+ as consecutive elements of +type+, one of
+ * the Fiddle::TYPE_* constants, from byte +offset+ on.  The elements
+ * must lie within #size bytes unless the size is 0.
+ */
+static mrb_value
+mrb_fiddle_ptr_write_array(mrb_state *mrb, mrb_value self)
+{
+    mrb_int type, offset = 0, count, i;
+    mrb_value ary;
+    char *dst;
+
+    mrb_get_args(mrb, "iA|i", &type, &ary, &offset);
+    count = RARRAY_LEN(ary);
+    dst = fiddle_ptr_array_at(mrb, self, offset, count, fiddle_ptr_element_size(mrb, type));
+
+    switch (type) {
+      case TYPE_CHAR:
+    	FIDDLE_PTR_WRITE_INT_ARRAY(signed char);
+      case -TYPE_CHAR:
+    	FIDDLE_PTR_WRITE_INT_ARRAY(unsigned char);
+      case TYPE_SHORT:
+    	FIDDLE_PTR_WRITE_INT_ARRAY(signed short);
+      case -TYPE_SHORT:
+    	FIDDLE_PTR_WRITE_INT_ARRAY(unsigned short);
+      case TYPE_INT:
+    	FIDDLE_PTR_WRITE_INT_ARRAY(signed int);
+      case -TYPE_INT:
+    	FIDDLE_PTR_WRITE_INT_ARRAY(unsigned int);
+      case TYPE_LONG:
+    	FIDDLE_PTR_WRITE_INT_ARRAY(signed long);
+      case -TYPE_LONG:
+    	FIDDLE_PTR_WRITE_INT_ARRAY(unsigned long);
+#if HAVE_LONG_LONG
+      case TYPE_LONG_LONG:
+    	FIDDLE_PTR_WRITE_INT_ARRAY(signed LONG_LONG);
+      case -TYPE_LONG_LONG:
+    	FIDDLE_PTR_WRITE_INT_ARRAY(unsigned LONG_LONG);
+#endif
+      case TYPE_FLOAT:
+    	FIDDLE_PTR_WRITE_ARRAY(float, (float)mrb_float(mrb_Float(mrb, val)));
+      case TYPE_DOUBLE:
+    	FIDDLE_PTR_WRITE_ARRAY(double, (double)mrb_float(mrb_Float(mrb, val)));
+      case TYPE_VOIDP:
+      case TYPE_CONST_STRING:
+    	FIDDLE_PTR_WRITE_ARRAY(void *, mrb_fiddle_value_to_cptr(mrb, val));
+      default:
+    	mrb_raisef(mrb, E_ARGUMENT_ERROR, "no arrays of type %S", mrb_fixnum_value(type));
+    }
+    return ary;
+}
+
+#undef FIDDLE_PTR_WRITE_INT_ARRAY
+#undef FIDDLE_PTR_WRITE_ARRAY
+
 /*
  * call-seq: size=(size)
  *
@@ -682,6 +999,25 @@ mrb_fiddle_pointer_init(mrb_state *mrb)
     mrb_define_method(mrb, cPointer, "size", mrb_fiddle_ptr_size_get, MRB_ARGS_NONE());
     mrb_define_method(mrb, cPointer, "size=", mrb_fiddle_ptr_size_set, MRB_ARGS_REQ(1));
 
+#define FIDDLE_PTR_DEFINE_ACCESSORS(name) \
+    mrb_define_method(mrb, cPointer, "get_" #name, mrb_fiddle_ptr_get_##name, MRB_ARGS_REQ(1)); \
+    mrb_define_method(mrb, cPointer, "put_" #name, mrb_fiddle_ptr_put_##name, MRB_ARGS_REQ(2))
+
+    FIDDLE_PTR_DEFINE_ACCESSORS(i8);
+    FIDDLE_PTR_DEFINE_ACCESSORS(u8);
+    FIDDLE_PTR_DEFINE_ACCESSORS(i16);
+    FIDDLE_PTR_DEFINE_ACCESSORS(u16);
+    FIDDLE_PTR_DEFINE_ACCESSORS(i32);
+    FIDDLE_PTR_DEFINE_ACCESSORS(u32);
+    FIDDLE_PTR_DEFINE_ACCESSORS(i64);
+    FIDDLE_PTR_DEFINE_ACCESSORS(u64);
+    FIDDLE_PTR_DEFINE_ACCESSORS(f32);
+    FIDDLE_PTR_DEFINE_ACCESSORS(f64);
+    FIDDLE_PTR_DEFINE_ACCESSORS(ptr);
+#undef FIDDLE_PTR_DEFINE_ACCESSORS
+    mrb_define_method(mrb, cPointer, "read_array", mrb_fiddle_ptr_read_array, MRB_ARGS_ARG(2, 1));
+    mrb_define_method(mrb, cPointer, "write_array", mrb_fiddle_ptr_write_array, MRB_ARGS_ARG(2, 1));
+
     /*  Document-const: NULL
      *
      * A NULL pointer
@@ -0,0 +1,13 @@
+#ifndef FIDDLE_POINTER_H
+#define FIDDLE_POINTER_H
+
+#include "fiddle.h"
+
+typedef void (*freefunc_t)(void*);
+
+mrb_value mrb_fiddle_ptr_new(mrb_state *mrb, void *ptr, long size, freefunc_t func);
+void *mrb_fiddle_ptr_to_cptr(mrb_state *mrb, mrb_value self);
+long mrb_fiddle_ptr_size(mrb_state *mrb, mrb_value self);
+void *mrb_fiddle_value_to_cptr(mrb_state *mrb, mrb_value val);
+
+#endif
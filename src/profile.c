@@ -0,0 +1,163 @@
+#include "fiddle.h"
+#include "function.h"
+#include "profile.h"
+#include <mruby/hash.h>
+
+extern struct RClass *cFiddle;
+extern struct RClass *cFunction;
+
+/*
+ * Function profiling.
+ *
+ * While Fiddle.profile is on, Function#call times every call and adds
+ * it to a fiddle_stats allocated for the Function on its first profiled
+ * call.  Profiled Functions are kept in a registry for
+ * Fiddle.profile_report, so their statistics outlive any other
+ * reference to them.  When profiling is off a call only tests the flag.
+ */
+
+static mrb_value
+fiddle_profiled(mrb_state *mrb)
+{
+    mrb_sym sym = mrb_intern_lit(mrb, "__profiled__");
+    mrb_value profiled = mrb_iv_get(mrb, mrb_obj_value(cFunction), sym);
+
+    if (mrb_nil_p(profiled)) {
+    	profiled = mrb_ary_new(mrb);
+    	mrb_iv_set(mrb, mrb_obj_value(cFunction), sym, profiled);
+    }
+    return profiled;
+}
+
+/* Allocates the statistics of +function+ and registers it for reports. */
+fiddle_stats *
+mrb_fiddle_profile_register(mrb_state *mrb, mrb_value function)
+{
+    fiddle_stats *stats = mrb_calloc(mrb, 1, sizeof(fiddle_stats));
+
+    mrb_ary_push(mrb, fiddle_profiled(mrb), function);
+    return stats;
+}
+
+void
+fiddle_stats_record(fiddle_stats *stats, uint64_t total, uint64_t convert, uint64_t native)
+{
+    int bucket = 0;
+
+    stats->calls++;
+    stats->total_ns += total;
+    stats->convert_ns += convert;
+    stats->native_ns += native;
+    if (total > stats->max_ns) stats->max_ns = total;
+
+    while (bucket < FIDDLE_PROFILE_BUCKETS - 1 && (total >> (bucket + 1)) != 0) bucket++;
+    stats->histogram[bucket]++;
+}
+
+#define FIDDLE_STATS_SET(name, value) \
+    mrb_hash_set(mrb, hash, mrb_symbol_value(mrb_intern_lit(mrb, name)), (value))
+
+mrb_value
+fiddle_stats_to_hash(mrb_state *mrb, const fiddle_stats *stats)
+{
+    mrb_value hash = mrb_hash_new(mrb);
+    mrb_value histogram = mrb_ary_new_capa(mrb, FIDDLE_PROFILE_BUCKETS);
+    int i, last = -1;
+
+    for (i = 0; i < FIDDLE_PROFILE_BUCKETS; i++) {
+    	if (stats->histogram[i]) last = i;
+    }
+    for (i = 0; i <= last; i++) {
+    	mrb_ary_push(mrb, histogram, mrb_fixnum_value(stats->histogram[i]));
+    }
+
+    FIDDLE_STATS_SET("calls", mrb_fixnum_value(stats->calls));
+    FIDDLE_STATS_SET("total_ns", mrb_fixnum_value((mrb_int)stats->total_ns));
+    FIDDLE_STATS_SET("max_ns", mrb_fixnum_value((mrb_int)stats->max_ns));
+    FIDDLE_STATS_SET("convert_ns", mrb_fixnum_value((mrb_int)stats->convert_ns));
+    FIDDLE_STATS_SET("native_ns", mrb_fixnum_value((mrb_int)stats->native_ns));
+    FIDDLE_STATS_SET("histogram", histogram);
+    return hash;
+}
+
+#undef FIDDLE_STATS_SET
+
+/*
+ * call-seq: Fiddle.profile = bool
+ *
+ * Turns profiling of Function#call on or off.
+ */
+static mrb_value
+mrb_fiddle_s_set_profile(mrb_state *mrb, mrb_value self)
+{
+    mrb_bool profile;
+
+    mrb_get_args(mrb, "b", &profile);
+    mrb_fiddle_state(mrb)->profiling = profile;
+    return mrb_bool_value(profile);
+}
+
+/*
+ * call-seq: Fiddle.profile? => true or false
+ *
+ * Returns true while Function#call is being profiled.
+ */
+static mrb_value
+mrb_fiddle_s_profile_p(mrb_state *mrb, mrb_value self)
+{
+    return mrb_bool_value(mrb_fiddle_state(mrb)->profiling);
+}
+
+/*
+ * call-seq: Fiddle.profile_report => Hash
+ *
+ * Returns the statistics of every profiled Function, see Function#stats,
+ * keyed by the Function's name or by the Function itself when it has
+ * none.
+ */
+static mrb_value
+mrb_fiddle_s_profile_report(mrb_state *mrb, mrb_value self)
+{
+    mrb_value profiled = fiddle_profiled(mrb);
+    mrb_value report = mrb_hash_new(mrb);
+    mrb_int i;
+
+    for (i = 0; i < mrb_ary_len(mrb, profiled); i++) {
+    	mrb_value function = mrb_ary_entry(profiled, i);
+    	mrb_value name = mrb_iv_get(mrb, function, mrb_intern_lit(mrb, "@name"));
+    	fiddle_function *fn = DATA_PTR(function);
+
+    	if (!fn || !fn->stats) continue;
+    	mrb_hash_set(mrb, report, mrb_nil_p(name) ? function : name, fiddle_stats_to_hash(mrb, fn->stats));
+    }
+    return report;
+}
+
+/*
+ * call-seq: Fiddle.profile_reset
+ *
+ * Clears the statistics of every profiled Function.
+ */
+static mrb_value
+mrb_fiddle_s_profile_reset(mrb_state *mrb, mrb_value self)
+{
+    mrb_value profiled = fiddle_profiled(mrb);
+    mrb_int i;
+
+    for (i = 0; i < mrb_ary_len(mrb, profiled); i++) {
+    	fiddle_function *fn = DATA_PTR(mrb_ary_entry(profiled, i));
+
+    	if (fn && fn->stats) memset(fn->stats, 0, sizeof(fiddle_stats));
+    }
+    return mrb_nil_value();
+}
+
+void
+mrb_fiddle_profile_init(mrb_state *mrb)
+{
+    mrb_define_module_function(mrb, cFiddle, "profile=", mrb_fiddle_s_set_profile, MRB_ARGS_REQ(1));
+    mrb_define_module_function(mrb, cFiddle, "profile?", mrb_fiddle_s_profile_p, MRB_ARGS_NONE());
+    mrb_define_module_function(mrb, cFiddle, "profile_report", mrb_fiddle_s_profile_report, MRB_ARGS_NONE());
+    mrb_define_module_function(mrb, cFiddle, "profile_reset", mrb_fiddle_s_profile_reset, MRB_ARGS_NONE());
+}
+/* vim: set noet sws=4 sw=4: */
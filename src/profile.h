@@ -0,0 +1,44 @@
+#ifndef FIDDLE_PROFILE_H
+#define FIDDLE_PROFILE_H
+
+#include "fiddle.h"
+#include <stdint.h>
+#if !defined(_WIN32)
+#include <time.h>
+#endif
+
+/* latency histogram buckets: bucket i counts calls of [2**i, 2**(i+1)) ns */
+#define FIDDLE_PROFILE_BUCKETS 32
+
+/* Profile of one Fiddle::Function, recorded while Fiddle.profile is on. */
+typedef struct {
+    mrb_int calls;
+    uint64_t total_ns;
+    uint64_t max_ns;
+    uint64_t convert_ns;                    /* argument and return value conversion */
+    uint64_t native_ns;                     /* inside the C function */
+    mrb_int histogram[FIDDLE_PROFILE_BUCKETS];
+} fiddle_stats;
+
+static inline uint64_t
+fiddle_now_ns(void)
+{
+#if defined(_WIN32)
+    LARGE_INTEGER freq, count;
+
+    QueryPerformanceFrequency(&freq);
+    QueryPerformanceCounter(&count);
+    return (uint64_t)((double)count.QuadPart * 1e9 / (double)freq.QuadPart);
+#else
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000u + (uint64_t)ts.tv_nsec;
+#endif
+}
+
+fiddle_stats *mrb_fiddle_profile_register(mrb_state *mrb, mrb_value function);
+void fiddle_stats_record(fiddle_stats *stats, uint64_t total, uint64_t convert, uint64_t native);
+mrb_value fiddle_stats_to_hash(mrb_state *mrb, const fiddle_stats *stats);
+
+#endif
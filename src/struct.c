@@ -0,0 +1,186 @@
+#include <stdlib.h>
+#include "fiddle.h"
+#include "conversions.h"
+#include "struct.h"
+
+struct RClass *cStructType;
+
+extern struct RClass *cFiddle;
+
+/*
+ * The ffi_type of a C struct, built from the member types of a
+ * Fiddle::CStruct class so that structs can be passed and returned by
+ * value.
+ */
+typedef struct {
+    ffi_type type;
+    ffi_type **elements;
+} fiddle_struct_type;
+
+static void
+fiddle_struct_type_free(mrb_state *mrb, void *p)
+{
+    fiddle_struct_type *st = p;
+    if (st->elements) mrb_free(mrb, st->elements);
+    mrb_free(mrb, st);
+}
+
+static const struct mrb_data_type struct_type_data_type = {
+    "fiddle/struct_type",
+    fiddle_struct_type_free,
+};
+
+/*
+ * call-seq: new(types)
+ *
+ * Builds the layout of a struct with the member +types+, given like
+ * Fiddle::CStructBuilder.create takes them: TYPE_* codes, or
+ * <tt>[type, count]</tt> pairs for array members.
+ */
+static mrb_value
+mrb_fiddle_struct_type_initialize(mrb_state *mrb, mrb_value self)
+{
+    fiddle_struct_type *st;
+    mrb_value types;
+    mrb_int i, j, n, count, len;
+    ffi_cif cif;
+    ffi_status result;
+
+    mrb_get_args(mrb, "A", &types);
+
+    st = (fiddle_struct_type *)DATA_PTR(self);
+    if (st) {
+    	fiddle_struct_type_free(mrb, st);
+    }
+    DATA_TYPE(self) = &struct_type_data_type;
+    DATA_PTR(self) = NULL;
+
+    st = mrb_calloc(mrb, 1, sizeof(fiddle_struct_type));
+    DATA_PTR(self) = st;
+
+    len = mrb_ary_len(mrb, types);
+    n = 0;
+    for (i = 0; i < len; i++) {
+    	mrb_value type = mrb_ary_entry(types, i);
+    	n += mrb_array_p(type) ? mrb_int(mrb, mrb_ary_entry(type, 1)) : 1;
+    }
+    if (n == 0) {
+    	mrb_raise(mrb, E_ARGUMENT_ERROR, "a struct needs at least one member");
+    }
+
+    st->elements = mrb_calloc(mrb, n + 1, sizeof(ffi_type *));
+    n = 0;
+    for (i = 0; i < len; i++) {
+    	mrb_value type = mrb_ary_entry(types, i);
+    	ffi_type *element;
+
+    	if (mrb_array_p(type)) {
+    	    element = INT2FFI_TYPE(mrb, (int)mrb_int(mrb, mrb_ary_entry(type, 0)));
+    	    count = mrb_int(mrb, mrb_ary_entry(type, 1));
+    	} else {
+    	    element = INT2FFI_TYPE(mrb, (int)mrb_int(mrb, type));
+    	    count = 1;
+    	}
+    	for (j = 0; j < count; j++) st->elements[n++] = element;
+    }
+    st->elements[n] = NULL;
+
+    st->type.size = 0;
+    st->type.alignment = 0;
+    st->type.type = FFI_TYPE_STRUCT;
+    st->type.elements = st->elements;
+
+    /* libffi lays the struct out the first time it sees it in a CIF */
+    result = ffi_prep_cif(&cif, FFI_DEFAULT_ABI, 0, &st->type, NULL);
+    if (result)
+    	mrb_raisef(mrb, E_RUNTIME_ERROR, "error creating struct type %S", mrb_fixnum_value(result));
+
+    return self;
+}
+
+/*
+ * call-seq: size => Integer
+ *
+ * Returns the size of the struct in bytes.
+ */
+static mrb_value
+mrb_fiddle_struct_type_size(mrb_state *mrb, mrb_value self)
+{
+    fiddle_struct_type *st;
+
+    Data_Get_Struct(mrb, self, &struct_type_data_type, st);
+    return mrb_fixnum_value((mrb_int)st->type.size);
+}
+
+/*
+ * call-seq: alignment => Integer
+ *
+ * Returns the alignment of the struct in bytes.
+ */
+static mrb_value
+mrb_fiddle_struct_type_alignment(mrb_state *mrb, mrb_value self)
+{
+    fiddle_struct_type *st;
+
+    Data_Get_Struct(mrb, self, &struct_type_data_type, st);
+    return mrb_fixnum_value((mrb_int)st->type.alignment);
+}
+
+/* Returns the ffi_type cached by the CStruct class +klass+. */
+ffi_type *
+mrb_fiddle_struct_ffi_type(mrb_state *mrb, mrb_value klass)
+{
+    mrb_value layout;
+    fiddle_struct_type *st;
+
+    if (!mrb_respond_to(mrb, klass, mrb_intern_lit(mrb, "ffi_type"))) {
+    	mrb_raisef(mrb, E_TYPE_ERROR, "%S is not a C type", mrb_inspect(mrb, klass));
+    }
+    layout = mrb_funcall(mrb, klass, "ffi_type", 0);
+    Data_Get_Struct(mrb, layout, &struct_type_data_type, st);
+    return &st->type;
+}
+
+/*
+ * Returns the TYPE_* code of +type+ and stores its ffi_type into +ffi+.
+ * +type+ is either a TYPE_* code or a CStruct class passed by value.
+ */
+int
+mrb_fiddle_type_code(mrb_state *mrb, mrb_value type, ffi_type **ffi)
+{
+    if (mrb_fixnum_p(type)) {
+    	*ffi = INT2FFI_TYPE(mrb, (int)mrb_fixnum(type));
+    	return (int)mrb_fixnum(type);
+    }
+    *ffi = mrb_fiddle_struct_ffi_type(mrb, type);
+    return TYPE_STRUCT;
+}
+
+/*
+ * Wraps +mem+, malloc'ed and holding a struct returned by value, into a
+ * new instance of the CStruct class +klass+ that frees it when collected.
+ */
+mrb_value
+mrb_fiddle_struct_new(mrb_state *mrb, mrb_value klass, void *mem)
+{
+    return mrb_funcall(mrb, klass, "new", 2, mrb_cptr_value(mrb, mem), mrb_cptr_value(mrb, (void *)free));
+}
+
+void
+mrb_fiddle_struct_type_init(mrb_state *mrb)
+{
+    /*
+     * Document-class: Fiddle::StructType
+     *
+     * The libffi layout of a C struct, used to pass and return structs by
+     * value.  CStruct classes built by Fiddle::CStructBuilder create one
+     * lazily through their +ffi_type+ method.
+     */
+    cStructType = mrb_define_class_under(mrb, cFiddle, "StructType", mrb->object_class);
+    MRB_SET_INSTANCE_TT(cStructType, MRB_TT_DATA);
+
+    mrb_define_method(mrb, cStructType, "initialize", mrb_fiddle_struct_type_initialize, MRB_ARGS_REQ(1));
+    mrb_define_method(mrb, cStructType, "size", mrb_fiddle_struct_type_size, MRB_ARGS_NONE());
+    mrb_define_method(mrb, cStructType, "alignment", mrb_fiddle_struct_type_alignment, MRB_ARGS_NONE());
+}
+/* vim: set noet sws=4 sw=4: */
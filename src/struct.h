@@ -0,0 +1,10 @@
+#ifndef FIDDLE_STRUCT_H
+#define FIDDLE_STRUCT_H
+
+#include "fiddle.h"
+
+ffi_type *mrb_fiddle_struct_ffi_type(mrb_state *mrb, mrb_value klass);
+int mrb_fiddle_type_code(mrb_state *mrb, mrb_value type, ffi_type **ffi);
+mrb_value mrb_fiddle_struct_new(mrb_state *mrb, mrb_value klass, void *mem);
+
+#endif
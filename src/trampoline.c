@@ -0,0 +1,321 @@
+#include "fiddle.h"
+#include "trampoline.h"
+#include <mruby/hash.h>
+
+#if !defined(_WIN32)
+#include <pthread.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#if defined(__linux__)
+#include <sys/syscall.h>
+#endif
+#endif
+
+/*
+ * Trampolines of Fiddle::Closures.
+ *
+ * Closures come and go much more often than their trampolines need to,
+ * so freed trampolines are kept on a free list and handed out again: a
+ * new Closure usually costs no allocation and no system call.
+ *
+ * With ffi_closure_alloc, libffi gives every closure a code address of
+ * its own, so up to FIDDLE_TRAMPOLINE_KEEP freed closures are kept as
+ * they are.  Without it, closures are carved FIDDLE_TRAMPOLINE_SLOT
+ * bytes apart out of pages mapped twice, once writable for preparing
+ * closures and once executable for calling them, so that live closures
+ * never lose PROT_EXEC.  Where such a mapping can't be made, every
+ * closure gets an executable page of its own, which is writable only
+ * while that closure is being prepared.  An empty page is unmapped once
+ * more than FIDDLE_TRAMPOLINE_KEEP closures are free, unless it is the
+ * newest page.
+ *
+ * The pool belongs to the process, like the memory behind it, and is
+ * not tied to an mrb_state: the GC frees Closures after
+ * mrb_mruby_fiddle_gem_final has run.
+ */
+
+#ifndef FIDDLE_TRAMPOLINE_KEEP
+#define FIDDLE_TRAMPOLINE_KEEP 256
+#endif
+
+#define FIDDLE_TRAMPOLINE_SLOT ((sizeof(ffi_closure) + 15) & ~(size_t)15)
+
+typedef struct fiddle_trampoline_page {
+    struct fiddle_trampoline_page *next;
+    unsigned char *base;                /* writable view */
+    unsigned char *code;                /* executable view, base if single */
+    size_t size;
+    size_t nslots;                      /* closures the page has room for */
+    size_t carved;                      /* closures handed out at least once */
+    size_t live;                        /* closures in use */
+    fiddle_trampoline *slots;           /* one per closure */
+    fiddle_trampoline *free;            /* freed closures of the page */
+} fiddle_trampoline_page;
+
+static struct {
+    fiddle_trampoline_page *pages;      /* newest first */
+    fiddle_trampoline *free;            /* kept ffi_closure_alloc closures */
+    size_t npages;
+    size_t nfree;                       /* closures held but not in use */
+    size_t live;
+    size_t allocated;                   /* closures handed out */
+    size_t recycled;                    /* of them, reused after a free */
+} fiddle_trampolines;
+
+#if !defined(_WIN32)
+static pthread_mutex_t fiddle_trampoline_lock = PTHREAD_MUTEX_INITIALIZER;
+# define FIDDLE_TRAMPOLINE_LOCK() pthread_mutex_lock(&fiddle_trampoline_lock)
+# define FIDDLE_TRAMPOLINE_UNLOCK() pthread_mutex_unlock(&fiddle_trampoline_lock)
+#else
+# define FIDDLE_TRAMPOLINE_LOCK() ((void)0)
+# define FIDDLE_TRAMPOLINE_UNLOCK() ((void)0)
+#endif
+
+#if !defined(_WIN32)
+
+/*
+ * Maps +size+ bytes of a memfd writable at *base and executable at *code,
+ * returning 0 on success.  The JIT stub pages of jit.c are mapped the
+ * same way.
+ */
+int
+fiddle_trampoline_map_dual(size_t size, void **base, void **code)
+{
+#if defined(__linux__) && defined(SYS_memfd_create)
+    int fd = (int)syscall(SYS_memfd_create, "fiddle-trampolines", 1 /* MFD_CLOEXEC */);
+
+    if (fd < 0) return -1;
+    if (ftruncate(fd, (off_t)size) != 0) {
+    	close(fd);
+    	return -1;
+    }
+    *base = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    *code = *base == MAP_FAILED ? MAP_FAILED : mmap(NULL, size, PROT_READ | PROT_EXEC, MAP_SHARED, fd, 0);
+    close(fd);
+    if (*code == MAP_FAILED) {
+    	if (*base != MAP_FAILED) munmap(*base, size);
+    	return -1;
+    }
+    return 0;
+#else
+    return -1;
+#endif
+}
+
+#endif
+
+#if USE_FFI_CLOSURE_ALLOC
+
+fiddle_trampoline *
+fiddle_trampoline_alloc(void)
+{
+    fiddle_trampoline *tramp;
+
+    FIDDLE_TRAMPOLINE_LOCK();
+    tramp = fiddle_trampolines.free;
+    if (tramp) {
+    	fiddle_trampolines.free = tramp->next;
+    	fiddle_trampolines.nfree--;
+    	fiddle_trampolines.recycled++;
+    	fiddle_trampolines.allocated++;
+    	fiddle_trampolines.live++;
+    }
+    FIDDLE_TRAMPOLINE_UNLOCK();
+    if (tramp) return tramp;
+
+    tramp = (fiddle_trampoline *)malloc(sizeof(fiddle_trampoline));
+    if (!tramp) return NULL;
+    tramp->closure = (ffi_closure *)ffi_closure_alloc(sizeof(ffi_closure), &tramp->code);
+    if (!tramp->closure) {
+    	free(tramp);
+    	return NULL;
+    }
+    tramp->page = NULL;
+
+    FIDDLE_TRAMPOLINE_LOCK();
+    fiddle_trampolines.allocated++;
+    fiddle_trampolines.live++;
+    FIDDLE_TRAMPOLINE_UNLOCK();
+    return tramp;
+}
+
+int
+fiddle_trampoline_prep(fiddle_trampoline *tramp, ffi_cif *cif, fiddle_trampoline_fun fun, void *user_data)
+{
+    return (int)ffi_prep_closure_loc(tramp->closure, cif, fun, user_data, tramp->code);
+}
+
+void
+fiddle_trampoline_free(fiddle_trampoline *tramp)
+{
+    int keep;
+
+    FIDDLE_TRAMPOLINE_LOCK();
+    fiddle_trampolines.live--;
+    keep = fiddle_trampolines.nfree < FIDDLE_TRAMPOLINE_KEEP;
+    if (keep) {
+    	tramp->next = fiddle_trampolines.free;
+    	fiddle_trampolines.free = tramp;
+    	fiddle_trampolines.nfree++;
+    }
+    FIDDLE_TRAMPOLINE_UNLOCK();
+
+    if (!keep) {
+    	ffi_closure_free(tramp->closure);
+    	free(tramp);
+    }
+}
+
+#else
+
+static fiddle_trampoline_page *
+fiddle_trampoline_page_new(void)
+{
+    fiddle_trampoline_page *page;
+    size_t size = (size_t)sysconf(_SC_PAGESIZE);
+    void *base, *code;
+
+    page = (fiddle_trampoline_page *)calloc(1, sizeof(fiddle_trampoline_page));
+    if (!page) return NULL;
+
+    if (fiddle_trampoline_map_dual(size, &base, &code) == 0) {
+    	page->nslots = size / FIDDLE_TRAMPOLINE_SLOT;
+    } else {
+    	size = (FIDDLE_TRAMPOLINE_SLOT + size - 1) / size * size;
+    	base = code = mmap(NULL, size, PROT_READ | PROT_EXEC, MAP_ANON | MAP_PRIVATE, -1, 0);
+    	page->nslots = 1;
+    }
+    page->slots = (fiddle_trampoline *)calloc(page->nslots, sizeof(fiddle_trampoline));
+    if (!page->slots || code == MAP_FAILED) {
+    	if (code != MAP_FAILED) munmap(code, size);
+    	if (code != MAP_FAILED && base != code) munmap(base, size);
+    	free(page->slots);
+    	free(page);
+    	return NULL;
+    }
+    page->base = (unsigned char *)base;
+    page->code = (unsigned char *)code;
+    page->size = size;
+
+    page->next = fiddle_trampolines.pages;
+    fiddle_trampolines.pages = page;
+    fiddle_trampolines.npages++;
+    fiddle_trampolines.nfree += page->nslots;
+    return page;
+}
+
+fiddle_trampoline *
+fiddle_trampoline_alloc(void)
+{
+    fiddle_trampoline_page *page;
+    fiddle_trampoline *tramp;
+
+    FIDDLE_TRAMPOLINE_LOCK();
+    for (page = fiddle_trampolines.pages; page; page = page->next) {
+    	if (page->free || page->carved < page->nslots) break;
+    }
+    if (!page) page = fiddle_trampoline_page_new();
+    if (!page) {
+    	FIDDLE_TRAMPOLINE_UNLOCK();
+    	return NULL;
+    }
+
+    if (page->free) {
+    	tramp = page->free;
+    	page->free = tramp->next;
+    	fiddle_trampolines.recycled++;
+    } else {
+    	tramp = &page->slots[page->carved];
+    	tramp->closure = (ffi_closure *)(page->base + page->carved * FIDDLE_TRAMPOLINE_SLOT);
+    	tramp->code = page->code + page->carved * FIDDLE_TRAMPOLINE_SLOT;
+    	tramp->page = page;
+    	page->carved++;
+    }
+    page->live++;
+    fiddle_trampolines.nfree--;
+    fiddle_trampolines.live++;
+    fiddle_trampolines.allocated++;
+    FIDDLE_TRAMPOLINE_UNLOCK();
+    return tramp;
+}
+
+/*
+ * Returns an ffi_status, or -1 with errno set if a single mapped page
+ * stays read-only.  Such a page holds only the closure being prepared,
+ * so no live closure is ever made non-executable.
+ */
+int
+fiddle_trampoline_prep(fiddle_trampoline *tramp, ffi_cif *cif, fiddle_trampoline_fun fun, void *user_data)
+{
+    fiddle_trampoline_page *page = tramp->page;
+    ffi_status result;
+
+    if (page->base != page->code) {
+    	result = ffi_prep_closure_loc(tramp->closure, cif, fun, user_data, tramp->code);
+    } else {
+    	if (mprotect(page->base, page->size, PROT_READ | PROT_WRITE) != 0) return -1;
+    	result = ffi_prep_closure_loc(tramp->closure, cif, fun, user_data, tramp->code);
+    	mprotect(page->base, page->size, PROT_READ | PROT_EXEC);
+    }
+#if defined(__GNUC__)
+    __builtin___clear_cache((char *)tramp->code, (char *)tramp->code + sizeof(ffi_closure));
+#endif
+    return (int)result;
+}
+
+void
+fiddle_trampoline_free(fiddle_trampoline *tramp)
+{
+    fiddle_trampoline_page *page = tramp->page, **link;
+
+    FIDDLE_TRAMPOLINE_LOCK();
+    tramp->next = page->free;
+    page->free = tramp;
+    page->live--;
+    fiddle_trampolines.live--;
+    fiddle_trampolines.nfree++;
+
+    if (page->live == 0 && page != fiddle_trampolines.pages &&
+    	fiddle_trampolines.nfree > FIDDLE_TRAMPOLINE_KEEP) {
+    	for (link = &fiddle_trampolines.pages; *link != page; link = &(*link)->next);
+    	*link = page->next;
+    	fiddle_trampolines.npages--;
+    	fiddle_trampolines.nfree -= page->nslots;
+    	if (page->code != page->base) munmap(page->code, page->size);
+    	munmap(page->base, page->size);
+    	free(page->slots);
+    	free(page);
+    }
+    FIDDLE_TRAMPOLINE_UNLOCK();
+}
+
+#endif
+
+#define FIDDLE_STATS_SET(name, value) \
+    mrb_hash_set(mrb, hash, mrb_symbol_value(mrb_intern_lit(mrb, name)), (value))
+
+/* the counters of the pool, see Fiddle::Closure.trampoline_stats */
+mrb_value
+fiddle_trampoline_stats(mrb_state *mrb)
+{
+    mrb_value hash = mrb_hash_new(mrb);
+    size_t npages, live, nfree, allocated, recycled;
+
+    FIDDLE_TRAMPOLINE_LOCK();
+    npages = fiddle_trampolines.npages;
+    live = fiddle_trampolines.live;
+    nfree = fiddle_trampolines.nfree;
+    allocated = fiddle_trampolines.allocated;
+    recycled = fiddle_trampolines.recycled;
+    FIDDLE_TRAMPOLINE_UNLOCK();
+
+    FIDDLE_STATS_SET("pages", mrb_fixnum_value((mrb_int)npages));
+    FIDDLE_STATS_SET("live", mrb_fixnum_value((mrb_int)live));
+    FIDDLE_STATS_SET("free", mrb_fixnum_value((mrb_int)nfree));
+    FIDDLE_STATS_SET("allocated", mrb_fixnum_value((mrb_int)allocated));
+    FIDDLE_STATS_SET("recycled", mrb_fixnum_value((mrb_int)recycled));
+    FIDDLE_STATS_SET("fragmentation",
+        mrb_float_value(mrb, live + nfree ? (mrb_float)nfree / (mrb_float)(live + nfree) : 0.0));
+    return hash;
+}
+/* vim: set noet sws=4 sw=4: */
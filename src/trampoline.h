@@ -0,0 +1,36 @@
+#ifndef FIDDLE_TRAMPOLINE_H
+#define FIDDLE_TRAMPOLINE_H
+
+#include "fiddle.h"
+
+#if defined(USE_FFI_CLOSURE_ALLOC)
+#elif defined(__OpenBSD__) || defined(__APPLE__) || defined(__linux__)
+# define USE_FFI_CLOSURE_ALLOC 0
+#elif defined(RUBY_LIBFFI_MODVERSION) && RUBY_LIBFFI_MODVERSION < 3000005 && \
+	(defined(__i386__) || defined(__x86_64__) || defined(_M_IX86) || defined(_M_AMD64))
+# define USE_FFI_CLOSURE_ALLOC 0
+#else
+# define USE_FFI_CLOSURE_ALLOC 1
+#endif
+
+struct fiddle_trampoline_page;
+
+/* The ffi_closure of a Fiddle::Closure, see trampoline.c. */
+typedef struct fiddle_trampoline {
+    ffi_closure *closure;                   /* writable view of the closure */
+    void *code;                             /* address C code calls */
+    struct fiddle_trampoline *next;         /* free list link */
+    struct fiddle_trampoline_page *page;    /* page it was carved from, if any */
+} fiddle_trampoline;
+
+typedef void (*fiddle_trampoline_fun)(ffi_cif *cif, void *ret, void **args, void *user_data);
+
+fiddle_trampoline *fiddle_trampoline_alloc(void);
+int fiddle_trampoline_prep(fiddle_trampoline *tramp, ffi_cif *cif, fiddle_trampoline_fun fun, void *user_data);
+void fiddle_trampoline_free(fiddle_trampoline *tramp);
+mrb_value fiddle_trampoline_stats(mrb_state *mrb);
+#if !defined(_WIN32)
+int fiddle_trampoline_map_dual(size_t size, void **base, void **code);
+#endif
+
+#endif
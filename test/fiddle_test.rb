@@ -1 +1,528 @@
+def fiddle_libc(name, args, ret)
+  Fiddle::Function.new(Fiddle.dlopen(nil)[name], args, ret, Fiddle::Function::DEFAULT, name)
+end
 
+assert('Fiddle::Function#call') do
+  strlen = fiddle_libc('strlen', [Fiddle::TYPE_VOIDP], Fiddle::TYPE_LONG)
+  abs = fiddle_libc('abs', [Fiddle::TYPE_INT], Fiddle::TYPE_INT)
+  assert_equal 5, strlen.call("hello")
+  assert_equal 3, abs.call(-3)
+  assert_raise(ArgumentError) { abs.call }
+  assert_raise(ArgumentError) { abs.call(1, 2) }
+  assert_raise(TypeError) { abs.call("three") }
+end
+
+assert('Fiddle::Function#call keeps STACK_ARGS arguments on the stack') do
+  n = Fiddle::Function::STACK_ARGS
+  types = [Fiddle::TYPE_INT] * n
+  cb = Fiddle::Closure::BlockCaller.new(Fiddle::TYPE_INT, types) do |*args|
+    args.inject(0) { |sum, i| sum + i }
+  end
+  func = Fiddle::Function.new(cb, types, Fiddle::TYPE_INT)
+
+  before = Fiddle::Function.heap_fallbacks
+  assert_equal n * (n + 1) / 2, func.call(*(1..n).to_a)
+  assert_equal before, Fiddle::Function.heap_fallbacks
+end
+
+assert('Fiddle::Function#call_many and #call_packed') do
+  abs = fiddle_libc('abs', [Fiddle::TYPE_INT], Fiddle::TYPE_INT)
+  assert_equal [1, 2, 3], abs.call_many([-1, [2], -3])
+  assert_equal Fiddle::SIZEOF_INT, abs.row_size
+  assert_equal [4, 5], abs.call_packed([-4, 5].pack('l*'), 2)
+
+  out = "\0" * (Fiddle::SIZEOF_INT * 2)
+  assert_equal out, abs.call_many([-6, -7], out)
+  assert_equal [6, 7], out.unpack('l*')
+  assert_raise(ArgumentError) { abs.call_many([[1, 2]]) }
+  assert_raise(ArgumentError) { abs.call_packed([-4].pack('l'), 2) }
+  assert_raise(ArgumentError) { abs.call_packed("", -1) }
+end
+
+assert('Fiddle::Function#map_buffer') do
+  abs = fiddle_libc('abs', [Fiddle::TYPE_INT], Fiddle::TYPE_INT)
+  output = "\0" * (Fiddle::SIZEOF_INT * 3)
+  abs.map_buffer([-1, 2, -3].pack('l*'), output, 3)
+  assert_equal [1, 2, 3], output.unpack('l*')
+
+  hypot = Fiddle::Closure::BlockCaller.new(Fiddle::TYPE_DOUBLE, [Fiddle::TYPE_DOUBLE] * 2) { |x, y| x * y }
+  func = Fiddle::Function.new(hypot, [Fiddle::TYPE_DOUBLE] * 2, Fiddle::TYPE_DOUBLE)
+  output = "\0" * (Fiddle::SIZEOF_DOUBLE * 2)
+  func.map_buffer([1.5, 2.0, -3.0, 0.5].pack('d*'), output, 2)
+  assert_equal [3.0, -1.5], output.unpack('d*')
+end
+
+assert('Fiddle::Function saves errno') do
+  strtol = fiddle_libc('strtol', [Fiddle::TYPE_VOIDP, Fiddle::TYPE_VOIDP, Fiddle::TYPE_INT], Fiddle::TYPE_LONG)
+  assert_true strtol.capture_errno?
+  Fiddle.last_error = 0
+  strtol.call("9" * 40, nil, 10)
+  assert_equal 34, Fiddle.last_error # ERANGE
+
+  strtol.capture_errno = false
+  Fiddle.last_error = 0
+  strtol.call("9" * 40, nil, 10)
+  assert_equal 0, Fiddle.last_error
+end
+
+assert('Fiddle::Function returns Fiddle::Pointer objects') do
+  strchr = fiddle_libc('strchr', [Fiddle::TYPE_VOIDP, Fiddle::TYPE_INT], Fiddle::TYPE_VOIDP)
+  text = "hello"
+  ptr = strchr.call(text, 108) # 'l'
+  assert_kind_of Fiddle::Pointer, ptr
+  assert_equal "llo", ptr.to_s
+  assert_equal "lo", strchr.call(ptr + 1, 108).to_s
+  assert_true strchr.call(text, 122).null?
+end
+
+assert('Fiddle::Function direct calls') do
+  strlen = fiddle_libc('strlen', [Fiddle::TYPE_VOIDP], Fiddle::TYPE_LONG)
+  ldexp = fiddle_libc('ldexp', [Fiddle::TYPE_DOUBLE, Fiddle::TYPE_INT], Fiddle::TYPE_DOUBLE)
+  assert_true strlen.direct_call?
+  assert_true ldexp.direct_call?
+  assert_equal 5, strlen.call("hello")
+  assert_equal 6.0, ldexp.call(1.5, 2)
+
+  strlen.direct_call = false
+  assert_false strlen.direct_call?
+  assert_equal 5, strlen.call("hello")
+end
+
+assert('Fiddle::Function JIT stubs') do
+  threshold = Fiddle::Function.jit_threshold
+  begin
+    Fiddle::Function.jit_threshold = 2 if threshold > 0
+    # void *memchr(const void *, int, size_t) has no direct caller
+    memchr = fiddle_libc('memchr', [Fiddle::TYPE_VOIDP, Fiddle::TYPE_INT, Fiddle::TYPE_LONG], Fiddle::TYPE_VOIDP)
+    assert_false memchr.jit?
+    3.times { assert_equal "llo", memchr.call("hello", 108, 5).to_s }
+
+    memchr.direct_call = false
+    assert_false memchr.jit?
+    assert_equal "lo", memchr.call("hello", 108, 5).to_s[1, 2]
+  ensure
+    Fiddle::Function.jit_threshold = threshold
+  end
+end
+
+assert('Fiddle::Function variadic calls') do
+  snprintf = fiddle_libc('snprintf',
+    [Fiddle::TYPE_VOIDP, Fiddle::TYPE_LONG, Fiddle::TYPE_VOIDP, Fiddle::TYPE_VARIADIC], Fiddle::TYPE_INT)
+  assert_true snprintf.variadic?
+
+  buf = Fiddle::Pointer.malloc(32)
+  assert_equal 7, snprintf.call(buf, 32, "%d-%s-%.1f", Fiddle::TYPE_INT, 7, Fiddle::TYPE_VOIDP, "x",
+    Fiddle::TYPE_DOUBLE, 2.5)
+  assert_equal "7-x-2.5", buf.to_s
+  assert_equal 2, snprintf.call(buf, 32, "%c%c", Fiddle::TYPE_CHAR, 111, Fiddle::TYPE_CHAR, 107)
+  assert_equal "ok", buf.to_s
+  assert_raise(ArgumentError) { snprintf.call(buf, 32, "%d", Fiddle::TYPE_INT) }
+  assert_raise(ArgumentError) { snprintf.call(buf, 32, "%d", Fiddle::TYPE_VOID, 1) }
+  assert_raise(ArgumentError) do
+    fiddle_libc('snprintf', [Fiddle::TYPE_VARIADIC, Fiddle::TYPE_INT], Fiddle::TYPE_INT)
+  end
+end
+
+assert('Fiddle::Function structs by value') do
+  div_t = Fiddle::CStructBuilder.create(Fiddle::CStruct, [Fiddle::TYPE_INT, Fiddle::TYPE_INT], %w(quot rem))
+  div = fiddle_libc('div', [Fiddle::TYPE_INT, Fiddle::TYPE_INT], div_t)
+  result = div.call(17, 5)
+  assert_kind_of div_t, result
+  assert_equal 3, result.quot
+  assert_equal 2, result.rem
+
+  cb = Fiddle::Closure::BlockCaller.new(Fiddle::TYPE_INT, [div_t]) { |d| d.quot * 10 + d.rem }
+  assert_equal 32, Fiddle::Function.new(cb, [div_t], Fiddle::TYPE_INT).call(result)
+  assert_raise(ArgumentError) { Fiddle::Function.new(cb, [div_t], Fiddle::TYPE_INT).call(nil) }
+end
+
+assert('Fiddle::Function#call_async') do
+  strlen = fiddle_libc('strlen', [Fiddle::TYPE_VOIDP], Fiddle::TYPE_LONG)
+  text = "asynchronous"
+  future = strlen.call_async(text)
+  assert_equal 12, future.value
+  assert_true future.done?
+  assert_equal [1, 2, 3], (1..3).map { |i| strlen.call_async("x" * i) }.map { |f| f.value }
+  assert_raise(ArgumentError) { strlen.call_async }
+end
+
+assert('Fiddle.profile') do
+  strlen = fiddle_libc('strlen', [Fiddle::TYPE_VOIDP], Fiddle::TYPE_LONG)
+  assert_nil strlen.stats
+  begin
+    Fiddle.profile = true
+    assert_true Fiddle.profile?
+    3.times { strlen.call("profiled") }
+    assert_equal 3, strlen.stats[:calls]
+    assert_true strlen.stats[:total_ns] >= strlen.stats[:max_ns]
+    assert_equal 3, Fiddle.profile_report['strlen'][:calls]
+    Fiddle.profile_reset
+    assert_equal 0, strlen.stats[:calls]
+  ensure
+    Fiddle.profile = false
+  end
+  assert_false Fiddle.profile?
+end
+
+assert('Fiddle::Function out and inout arguments') do
+  frexp = fiddle_libc('frexp', [Fiddle::TYPE_DOUBLE, Fiddle::TYPE_OUT + Fiddle::TYPE_INT], Fiddle::TYPE_DOUBLE)
+  assert_equal [0.5, 4], frexp.call(8.0)
+  assert_equal [0.75, 2], frexp.call(3.0)
+
+  twice = Fiddle::Closure::BlockCaller.new(Fiddle::TYPE_VOID, [Fiddle::TYPE_VOIDP]) do |ptr|
+    ptr[0, Fiddle::SIZEOF_INT] = [ptr[0, Fiddle::SIZEOF_INT].unpack('l')[0] * 2].pack('l')
+  end
+  func = Fiddle::Function.new(twice, [Fiddle::TYPE_INOUT + Fiddle::TYPE_INT], Fiddle::TYPE_VOID)
+  assert_equal [42], func.call(21)
+  assert_raise(ArgumentError) { func.call }
+end
+
+assert('Fiddle::Function const strings') do
+  strlen = fiddle_libc('strlen', [Fiddle::TYPE_CONST_STRING], Fiddle::TYPE_LONG)
+  text = "a shared string buffer " * 4
+  assert_equal 10, strlen.call(text[2, 10])
+  assert_equal 0, strlen.call("")
+
+  lib = Module.new do
+    extend Fiddle::Importer
+    dlload Fiddle.dlopen(nil)
+    extern 'long strlen(const char *)'
+  end
+  assert_equal 6, lib.strlen("extern")
+end
+
+assert('Fiddle::Function string buffers') do
+  getcwd = fiddle_libc('getcwd', [Fiddle::TYPE_STRING_BUFFER, Fiddle::TYPE_LONG], Fiddle::TYPE_VOIDP)
+  dir = Fiddle.string_buffer(4096)
+  getcwd.call(dir, 4096)
+  assert_true dir.size > 0
+  assert_equal "/", dir[0]
+
+  # the result is the length of a single buffer
+  strxfrm = fiddle_libc('strxfrm', [Fiddle::TYPE_STRING_BUFFER, Fiddle::TYPE_CONST_STRING, Fiddle::TYPE_LONG],
+    Fiddle::TYPE_LONG)
+  buf = Fiddle.string_buffer(16)
+  assert_equal 6, strxfrm.call(buf, "sorted", 16)
+  assert_equal "sorted", buf
+  assert_raise(TypeError) { strxfrm.call(nil, "sorted", 16) }
+  assert_raise(ArgumentError) { Fiddle.string_buffer(-1) }
+end
+
+assert('Fiddle::Closure decodes its arguments') do
+  types = [Fiddle::TYPE_CHAR, Fiddle::TYPE_INT, Fiddle::TYPE_DOUBLE, Fiddle::TYPE_FLOAT, Fiddle::TYPE_LONG]
+  cb = Fiddle::Closure::BlockCaller.new(Fiddle::TYPE_DOUBLE, types) { |c, i, d, f, l| c + i + d + f + l }
+  assert_equal 16.0, Fiddle::Function.new(cb, types, Fiddle::TYPE_DOUBLE).call(1, 2, 3.5, 4.5, 5)
+
+  wide = [Fiddle::TYPE_DOUBLE] * 10
+  cb = Fiddle::Closure::BlockCaller.new(Fiddle::TYPE_DOUBLE, wide) { |*xs| xs.inject(0.0) { |s, x| s + x } }
+  assert_equal 55.0, Fiddle::Function.new(cb, wide, Fiddle::TYPE_DOUBLE).call(*(1..10).map { |i| i.to_f })
+end
+
+assert('Fiddle::Closure::BlockCaller dispatch') do
+  plain = Fiddle::Closure::BlockCaller.new(Fiddle::TYPE_INT, [Fiddle::TYPE_INT]) { |x| x + 1 }
+  assert_equal 3, Fiddle::Function.new(plain, [Fiddle::TYPE_INT], Fiddle::TYPE_INT).call(2)
+
+  klass = Class.new(Fiddle::Closure::BlockCaller) do
+    def call(x)
+      super(x) * 10
+    end
+  end
+  custom = klass.new(Fiddle::TYPE_INT, [Fiddle::TYPE_INT]) { |x| x + 1 }
+  assert_equal 30, Fiddle::Function.new(custom, [Fiddle::TYPE_INT], Fiddle::TYPE_INT).call(2)
+end
+
+assert('Fiddle::Closure as a qsort comparator') do
+  qsort = fiddle_libc('qsort', [Fiddle::TYPE_VOIDP, Fiddle::TYPE_LONG, Fiddle::TYPE_LONG, Fiddle::TYPE_VOIDP],
+    Fiddle::TYPE_VOID)
+  cmp = Fiddle::Closure::BlockCaller.new(Fiddle::TYPE_INT, [Fiddle::TYPE_VOIDP, Fiddle::TYPE_VOIDP]) do |a, b|
+    a[0, Fiddle::SIZEOF_INT].unpack('l')[0] <=> b[0, Fiddle::SIZEOF_INT].unpack('l')[0]
+  end
+  ints = [5, -1, 3, 0, 2].pack('l*')
+  qsort.call(ints, 5, Fiddle::SIZEOF_INT, cmp.to_i)
+  assert_equal [-1, 0, 2, 3, 5], ints.unpack('l*')
+end
+
+assert('Fiddle::Closure.trampoline_stats') do
+  before = Fiddle::Closure.trampoline_stats
+  cb = Fiddle::Closure::BlockCaller.new(Fiddle::TYPE_VOID, []) { }
+  stats = Fiddle::Closure.trampoline_stats
+  assert_kind_of Hash, stats
+  assert_equal before[:allocated] + 1, stats[:allocated]
+  assert_true stats[:live] >= 1
+  assert_true stats[:fragmentation] >= 0.0
+  assert_true cb.to_i != 0
+end
+
+assert('Fiddle::Closure#foreign_calls') do
+  cb = Fiddle::Closure::BlockCaller.new(Fiddle::TYPE_INT, [Fiddle::TYPE_INT]) { |i| i }
+  assert_equal :direct, cb.foreign_calls
+  cb.foreign_calls = :queue
+  cb.foreign_default = 7
+  assert_equal :queue, cb.foreign_calls
+  assert_equal 7, cb.foreign_default
+  assert_equal 0, Fiddle::Closure.dispatch_pending
+  # calls from the mruby thread still run the closure
+  assert_equal 5, Fiddle::Function.new(cb, [Fiddle::TYPE_INT], Fiddle::TYPE_INT).call(5)
+  cb.foreign_calls = :direct
+  assert_raise(ArgumentError) { cb.foreign_calls = :later }
+end
+
+assert('Fiddle::Closure#batch') do
+  events = []
+  cb = Fiddle::Closure::BlockCaller.new(Fiddle::TYPE_VOID, [Fiddle::TYPE_INT]) { |i| events << [:call, i] }
+  func = Fiddle::Function.new(cb, [Fiddle::TYPE_INT], Fiddle::TYPE_VOID)
+  cb.batch(2) { |rows| events.concat(rows) }
+
+  func.call(1)
+  assert_equal [], events
+  func.call(2)
+  assert_equal [1, 2], events
+  func.call(3)
+  assert_equal 1, cb.flush
+  assert_equal [1, 2, 3], events
+  assert_equal 0, cb.unbatch
+
+  func.call(4)
+  assert_equal [1, 2, 3, [:call, 4]], events
+end
+
+assert('Fiddle::NativeClosure.comparator') do
+  qsort = fiddle_libc('qsort', [Fiddle::TYPE_VOIDP, Fiddle::TYPE_LONG, Fiddle::TYPE_LONG, Fiddle::TYPE_VOIDP],
+    Fiddle::TYPE_VOID)
+  ints = [4, 9, -7, 1, 1].pack('l*')
+  qsort.call(ints, 5, Fiddle::SIZEOF_INT, Fiddle::NativeClosure.comparator([[Fiddle::TYPE_INT, 0, :desc]]))
+  assert_equal [9, 4, 1, 1, -7], ints.unpack('l*')
+
+  doubles = [2.5, -1.0, 0.5].pack('d*')
+  qsort.call(doubles, 3, Fiddle::SIZEOF_DOUBLE, Fiddle::NativeClosure.comparator(Fiddle::TYPE_DOUBLE))
+  assert_equal [-1.0, 0.5, 2.5], doubles.unpack('d*')
+  assert_raise(ArgumentError) { Fiddle::NativeClosure.comparator([]) }
+end
+
+assert('Fiddle::NativeClosure.predicate') do
+  positive = Fiddle::NativeClosure.predicate(Fiddle::TYPE_INT, 0, :>, 0)
+  func = Fiddle::Function.new(positive, [Fiddle::TYPE_VOIDP], Fiddle::TYPE_INT)
+  assert_equal 1, func.call([3].pack('l'))
+  assert_equal 0, func.call([-3].pack('l'))
+  assert_raise(ArgumentError) { Fiddle::NativeClosure.predicate(Fiddle::TYPE_INT, 0, :"<>", 0) }
+end
+
+assert('Fiddle::Closure.gc_step_interval') do
+  qsort = fiddle_libc('qsort', [Fiddle::TYPE_VOIDP, Fiddle::TYPE_LONG, Fiddle::TYPE_LONG, Fiddle::TYPE_VOIDP],
+    Fiddle::TYPE_VOID)
+  interval = Fiddle::Closure.gc_step_interval
+  assert_raise(ArgumentError) { Fiddle::Closure.gc_step_interval = -1 }
+  begin
+    Fiddle::Closure.gc_step_interval = 16
+    assert_equal 16, Fiddle::Closure.gc_step_interval
+    # every callback of one qsort call leaves garbage behind
+    cmp = Fiddle::Closure::BlockCaller.new(Fiddle::TYPE_INT, [Fiddle::TYPE_VOIDP, Fiddle::TYPE_VOIDP]) do |a, b|
+      a[0, Fiddle::SIZEOF_INT].unpack('l')[0] <=> b[0, Fiddle::SIZEOF_INT].unpack('l')[0]
+    end
+    values = (0...2000).map { |i| i * 7919 % 2000 }
+    ints = values.pack('l*')
+    qsort.call(ints, values.size, Fiddle::SIZEOF_INT, cmp.to_i)
+    assert_equal values.sort, ints.unpack('l*')
+  ensure
+    Fiddle::Closure.gc_step_interval = interval
+  end
+end
+
+assert('Fiddle::Pointer typed accessors') do
+  ptr = Fiddle::Pointer.malloc(16)
+  ptr.put_i32(0, -5)
+  assert_equal(-5, ptr.get_i32(0))
+  assert_equal 2**32 - 5, ptr.get_u32(0)
+  ptr.put_u8(4, 255)
+  assert_equal(-1, ptr.get_i8(4))
+  ptr.put_f64(8, 1.5)
+  assert_equal 1.5, ptr.get_f64(8)
+  ptr.put_ptr(8, ptr)
+  assert_equal ptr.to_i, ptr.get_ptr(8).to_i
+  assert_raise(IndexError) { ptr.get_i64(12) }
+  assert_raise(IndexError) { ptr.put_i32(-1, 0) }
+end
+
+assert('Fiddle::Pointer#read_array and #write_array') do
+  ptr = Fiddle::Pointer.malloc(Fiddle::SIZEOF_DOUBLE * 4)
+  assert_equal [1.0, 2.5], ptr.write_array(Fiddle::TYPE_DOUBLE, [1.0, 2.5], Fiddle::SIZEOF_DOUBLE)
+  assert_equal [1.0, 2.5], ptr.read_array(Fiddle::TYPE_DOUBLE, 2, Fiddle::SIZEOF_DOUBLE)
+  ptr.write_array(Fiddle::TYPE_SHORT, [-1, 2, 3])
+  assert_equal [-1, 2, 3], ptr.read_array(Fiddle::TYPE_SHORT, 3)
+  assert_raise(IndexError) { ptr.read_array(Fiddle::TYPE_DOUBLE, 5) }
+  assert_raise(IndexError) { ptr.write_array(Fiddle::TYPE_DOUBLE, [0.0] * 4, 8) }
+  assert_raise(ArgumentError) { ptr.read_array(Fiddle::TYPE_INT, -1) }
+end
+
+assert('Fiddle::Function with more than 8 arguments') do
+  types = [Fiddle::TYPE_INT] * 9
+  cb = Fiddle::Closure::BlockCaller.new(Fiddle::TYPE_INT, types) do |*args|
+    args.inject(0) { |sum, i| sum + i }
+  end
+  func = Fiddle::Function.new(cb, types, Fiddle::TYPE_INT)
+
+  before = Fiddle::Function.heap_fallbacks
+  assert_equal 45, func.call(1, 2, 3, 4, 5, 6, 7, 8, 9)
+  assert_true Fiddle::Function.heap_fallbacks > before
+  assert_raise(TypeError) { func.call(1, 2, 3, 4, 5, 6, 7, 8, "nine") }
+  assert_equal 9, func.call(1, 1, 1, 1, 1, 1, 1, 1, 1)
+end
+
+assert('Fiddle::Function#map_buffer checks String buffers') do
+  abs = fiddle_libc('abs', [Fiddle::TYPE_INT], Fiddle::TYPE_INT)
+  input = [-1, 2].pack('l*')
+  output = "\0" * 8
+  shared = output.dup
+
+  assert_raise(ArgumentError) { abs.map_buffer("", output, 2) }
+  assert_raise(ArgumentError) { abs.map_buffer(input, "", 2) }
+  assert_raise(ArgumentError) { abs.call_packed(input, 2, "") }
+
+  abs.map_buffer(input, output, 2)
+  assert_equal [1, 2], output.unpack('l*')
+  assert_equal "\0" * 8, shared
+end
+
+assert('Fiddle::Function#map_buffer with and without direct calls') do
+  double = Fiddle::Closure::BlockCaller.new(Fiddle::TYPE_DOUBLE, [Fiddle::TYPE_DOUBLE]) { |x| x * 2 }
+  func = Fiddle::Function.new(double, [Fiddle::TYPE_DOUBLE], Fiddle::TYPE_DOUBLE)
+  input = [1.5, -2.0, 4.25].pack('d*')
+
+  [true, false].each do |direct|
+    func.direct_call = direct
+    output = "\0" * input.size
+    func.map_buffer(input, output, 3)
+    assert_equal [3.0, -4.0, 8.5], output.unpack('d*')
+  end
+end
+
+assert('Fiddle::Function variadic call with many arguments') do
+  snprintf = fiddle_libc('snprintf',
+    [Fiddle::TYPE_VOIDP, Fiddle::TYPE_LONG, Fiddle::TYPE_VOIDP, Fiddle::TYPE_VARIADIC], Fiddle::TYPE_INT)
+  buf = Fiddle::Pointer.malloc(64)
+  fmt = "%d%d%d%d%d%d%d%d%d"
+  ints = (1..9).map { |i| [Fiddle::TYPE_INT, i] }.flatten
+
+  assert_raise(RuntimeError) { snprintf.call(buf, 64, fmt, *(ints[0, 16] + [999, 9])) }
+  assert_equal 9, snprintf.call(buf, 64, fmt, *ints)
+  assert_equal "123456789", buf.to_s
+end
+
+assert('Fiddle::Function#call_async keeps converted arguments alive') do
+  strlen = fiddle_libc('strlen', [Fiddle::TYPE_CONST_STRING], Fiddle::TYPE_LONG)
+  text = "hello, asynchronous world" * 4
+  futures = (0...8).map { |i| strlen.call_async(text[i, 20]) }
+  GC.start
+  assert_equal [20] * 8, futures.map { |f| f.value }
+end
+
+assert('Fiddle::Importer#bind passes const char * arguments as Pointers') do
+  lib = Module.new do
+    extend Fiddle::Importer
+    dlload Fiddle.dlopen(nil)
+    bind('int text_length(const char *)') do |text|
+      text.is_a?(Fiddle::Pointer) ? text.to_s.size : -1
+    end
+  end
+  assert_equal 5, lib.text_length("hello")
+end
+
+assert('Fiddle::Closure stays callable while others are prepared') do
+  funcs = (0...64).map do |i|
+    cb = Fiddle::Closure::BlockCaller.new(Fiddle::TYPE_INT, [Fiddle::TYPE_INT]) { |x| x + i }
+    Fiddle::Function.new(cb, [Fiddle::TYPE_INT], Fiddle::TYPE_INT)
+  end
+  assert_equal (100...164).to_a, funcs.map { |f| f.call(100) }
+end
+
+assert('Fiddle::NativeClosure.predicate keeps its string constant') do
+  word = "abcdefghijklmnopqrstuvwxyz"
+  other = "abc"
+  pred = Fiddle::NativeClosure.predicate(Fiddle::TYPE_CONST_STRING, 0, :==, ("-" + word * 2)[1, 26])
+  func = Fiddle::Function.new(pred, [Fiddle::TYPE_VOIDP], Fiddle::TYPE_INT)
+  elem = Fiddle::Pointer.malloc(Fiddle::SIZEOF_VOIDP)
+  GC.start
+
+  elem.put_ptr(0, word)
+  assert_equal 1, func.call(elem)
+  elem.put_ptr(0, other)
+  assert_equal 0, func.call(elem)
+end
+
+assert('Fiddle::Closure returning a fresh String to C') do
+  interval = Fiddle::Closure.gc_step_interval
+  begin
+    Fiddle::Closure.gc_step_interval = 1
+    cb = Fiddle::Closure::BlockCaller.new(Fiddle::TYPE_CONST_STRING, [Fiddle::TYPE_INT]) do |i|
+      "callback result #{i} " * 4
+    end
+    func = Fiddle::Function.new(cb, [Fiddle::TYPE_INT], Fiddle::TYPE_VOIDP)
+    50.times do |i|
+      assert_equal "callback result #{i} " * 4, func.call(i).to_s
+    end
+  ensure
+    Fiddle::Closure.gc_step_interval = interval
+  end
+end
+
+assert('Fiddle::Pointer#read_array rejects unsupported types') do
+  ptr = Fiddle::Pointer.malloc(16)
+  assert_raise(ArgumentError) { ptr.read_array(Fiddle::TYPE_STRUCT, 1) }
+  assert_raise(ArgumentError) { ptr.write_array(Fiddle::TYPE_VOID, [1]) }
+  assert_raise(ArgumentError) { ptr.read_array(12345, 1) }
+end
+
+assert('Fiddle::Function batch calls with structs larger than 8 bytes') do
+  quad = Fiddle::CStructBuilder.create(Fiddle::CStruct, [Fiddle::TYPE_INT] * 4, %w(a b c d))
+  cb = Fiddle::Closure::BlockCaller.new(Fiddle::TYPE_INT, [quad, Fiddle::TYPE_INT]) do |q, k|
+    (q.a + q.b + q.c + q.d) * k
+  end
+  func = Fiddle::Function.new(cb, [quad, Fiddle::TYPE_INT], Fiddle::TYPE_INT)
+  rows = [1, 2, 3, 4, 10, 5, 6, 7, 8, -1].pack('l*')
+
+  assert_equal Fiddle::SIZEOF_INT * 5, func.row_size
+  assert_equal [100, -26], func.call_packed(rows, 2)
+  output = "\0" * (Fiddle::SIZEOF_INT * 2)
+  func.map_buffer(rows, output, 2)
+  assert_equal [100, -26], output.unpack('l*')
+end
+
+assert('Fiddle::Function#call_async with many outstanding calls') do
+  strlen = fiddle_libc('strlen', [Fiddle::TYPE_CONST_STRING], Fiddle::TYPE_LONG)
+  texts = (1..300).map { |i| "x" * (i % 17) }
+  futures = texts.map { |text| strlen.call_async(text) }
+  GC.start
+  assert_equal texts.map { |text| text.size }, futures.map { |f| f.value }
+end
+
+assert('Fiddle::Function out arguments of reentrant calls') do
+  func = nil
+  cb = Fiddle::Closure::BlockCaller.new(Fiddle::TYPE_VOID, [Fiddle::TYPE_VOIDP, Fiddle::TYPE_INT]) do |ptr, n|
+    ptr[0, Fiddle::SIZEOF_INT] = [n * 10].pack('l')
+    # the nested call stages its own out value
+    func.call(n - 1) if n > 0
+  end
+  func = Fiddle::Function.new(cb, [Fiddle::TYPE_OUT + Fiddle::TYPE_INT, Fiddle::TYPE_INT], Fiddle::TYPE_VOID)
+  assert_equal [30], func.call(3)
+end
+
+assert('Fiddle::Closure#batch rejects capacities that overflow') do
+  cb = Fiddle::Closure::BlockCaller.new(Fiddle::TYPE_VOID, [Fiddle::TYPE_DOUBLE] * 4) { }
+  # a Float past the mrb_int range raises RangeError before the check
+  assert_raise(ArgumentError, RangeError) { cb.batch(2**62) { } }
+  assert_equal 0, cb.unbatch
+end
+
+assert('Fiddle::Closure returning objects from more callbacks than the arena holds') do
+  qsort = fiddle_libc('qsort', [Fiddle::TYPE_VOIDP, Fiddle::TYPE_LONG, Fiddle::TYPE_LONG, Fiddle::TYPE_VOIDP],
+    Fiddle::TYPE_VOID)
+  # every callback returns a fresh Pointer; qsort reads its low 32 bits as the int
+  cmp = Fiddle::Closure::BlockCaller.new(Fiddle::TYPE_VOIDP, [Fiddle::TYPE_VOIDP, Fiddle::TYPE_VOIDP]) do |a, b|
+    order = a[0, Fiddle::SIZEOF_INT].unpack('l')[0] <=> b[0, Fiddle::SIZEOF_INT].unpack('l')[0]
+    Fiddle::Pointer.new(order)
+  end
+  values = (0...2000).map { |i| i * 7919 % 2000 }
+  ints = values.pack('l*')
+  qsort.call(ints, values.size, Fiddle::SIZEOF_INT, cmp.to_i)
+  assert_equal values.sort, ints.unpack('l*')
+end